@@ -1,221 +1,1547 @@
 //by Aashish Dugar
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "ecdh.h"
 #include "primefield.h"
+#include "multibuf.h"
+
+/**
+ * Size of a cache line, and the alignment of struct AffinePoint
+ */
+#define CACHE_LINE 64
+
+#if defined(__GNUC__)
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+#else
+#define CACHE_ALIGNED
+#endif
+
+/**
+ * Struct to represent a point in the prime field during arithmetic
+ *
+ * The co-ordinates are fixed-limb field elements kept in the
+ * representation used by the curve's field (Montgomery form, if the
+ * field uses it) for the whole computation. The struct is aligned to a
+ * cache line, so every entry of a table of precomputed points is read
+ * with a single line fill instead of straddling two.
+ *
+ * x and y are the co-ordinates of the point.
+ * infinity is set if the point is the point at infinity.
+ */
+struct AffinePoint {
+	fe_t x;
+	fe_t y;
+	int infinity;
+} CACHE_ALIGNED;
+
+/**
+ * Converts a struct Point into a struct AffinePoint on the curve ec
+ *
+ * The point (0,0) is taken to be the point at infinity.
+ *
+ * Returns 0 on success, or -1 if a co-ordinate is negative or not below
+ * the prime
+ */
+static int point_to_affine(struct AffinePoint *r, struct Point *p,
+				const struct Curve *ec)
+{
+	r->infinity = mpz_cmp_ui(p->x, 0UL) == 0 && mpz_cmp_ui(p->y, 0UL) == 0;
+	if (fe_set_mpz(r->x, p->x, &ec->field) != 0
+		|| fe_set_mpz(r->y, p->y, &ec->field) != 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Sets r to the point at infinity and returns -1, for the point
+ * operations given a co-ordinate outside the prime field
+ */
+static int point_reject(struct Point *r)
+{
+	mpz_set_ui(r->x, 0UL);
+	mpz_set_ui(r->y, 0UL);
+	return -1;
+}
+
+/**
+ * Returns 1 if p is a point of the curve ec, with co-ordinates within
+ * the prime field, and 0 otherwise
+ *
+ * The point at infinity is not accepted. Both curves have cofactor 1,
+ * so every other point of the curve is in the group generated by G.
+ * This is checked on the public keys of peers before they are used.
+ */
+static int point_is_valid(struct Point *p, const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t x, y, b, lhs, rhs;
+
+	if (fe_set_mpz(x, p->x, f) != 0 || fe_set_mpz(y, p->y, f) != 0
+		|| fe_set_mpz(b, (mpz_ptr)ec->b, f) != 0)
+		return 0;
+
+	// y^2 = (x^2 + a) x + b
+	fe_sq(lhs, y, f);
+	fe_sq(rhs, x, f);
+	fe_add(rhs, rhs, ec->fe_a, f);
+	fe_mul(rhs, rhs, x, f);
+	fe_add(rhs, rhs, b, f);
+	return fe_equal(lhs, rhs);
+}
+
+/**
+ * Converts a struct AffinePoint back into a struct Point
+ *
+ * r must be initialized. No memory is allocated if it was initialized
+ * with init_point.
+ */
+static void affine_to_point(struct Point *r, const struct AffinePoint *p,
+				const struct Curve *ec)
+{
+	if (p->infinity) {
+		mpz_set_ui(r->x, 0UL);
+		mpz_set_ui(r->y, 0UL);
+	} else {
+		fe_get_mpz(r->x, p->x, &ec->field);
+		fe_get_mpz(r->y, p->y, &ec->field);
+	}
+}
+
+/**
+ * Struct to represent a point in Jacobian projective co-ordinates
+ *
+ * The point (X:Y:Z) stands for the affine point (X/Z^2, Y/Z^3), which
+ * lets points be added and doubled without any field inversion. Z = 0
+ * is the point at infinity. The co-ordinates are held in the
+ * representation used by the curve's field.
+ * See https://hyperelliptic.org/EFD/g1p/auto-shortw-jacobian.html
+ * for details.
+ */
+struct JacobianPoint {
+	fe_t X;
+	fe_t Y;
+	fe_t Z;
+};
+
+/**
+ * Converts a struct AffinePoint into Jacobian co-ordinates with Z = 1
+ */
+static void affine_to_jacobian(struct JacobianPoint *r,
+				const struct AffinePoint *p,
+				const struct Curve *ec)
+{
+	memcpy(r->X, p->x, sizeof(fe_t));
+	memcpy(r->Y, p->y, sizeof(fe_t));
+	if (p->infinity)
+		memset(r->Z, 0, sizeof(fe_t));
+	else
+		memcpy(r->Z, ec->field.one, sizeof(fe_t));
+}
+
+/**
+ * Converts a point in Jacobian co-ordinates back into affine form
+ *
+ * This costs one field inversion.
+ */
+static void jacobian_to_affine(struct AffinePoint *r,
+				const struct JacobianPoint *p,
+				const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t zinv, zinv2;
+
+	r->infinity = fe_is_zero(p->Z);
+	fe_inv(zinv, p->Z, f);
+	fe_sq(zinv2, zinv, f);
+	fe_mul(r->x, p->X, zinv2, f);
+	fe_mul(zinv2, zinv2, zinv, f);
+	fe_mul(r->y, p->Y, zinv2, f);
+}
+
+/**
+ * Doubles a point in Jacobian co-ordinates
+ *
+ * Uses the dbl-2007-bl formula for any a. The database lists it as
+ * 1M + 8S plus one multiplication by a; a is a full field element here,
+ * so as implemented it costs 2M + 8S.
+ * r may alias p.
+ */
+static void jacobian_double_generic(struct JacobianPoint *r,
+				const struct JacobianPoint *p,
+				const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t xx, yy, yyyy, zz, s, m, tmp;
+
+	fe_sq(xx, p->X, f);
+	fe_sq(yy, p->Y, f);
+	fe_sq(yyyy, yy, f);
+	fe_sq(zz, p->Z, f);
+
+	// S = 2((X + YY)^2 - XX - YYYY)
+	fe_add(s, p->X, yy, f);
+	fe_sq(s, s, f);
+	fe_sub(s, s, xx, f);
+	fe_sub(s, s, yyyy, f);
+	fe_add(s, s, s, f);
+
+	// M = 3XX + a ZZ^2
+	fe_sq(tmp, zz, f);
+	fe_mul(tmp, tmp, ec->fe_a, f);
+	fe_add(m, xx, xx, f);
+	fe_add(m, m, xx, f);
+	fe_add(m, m, tmp, f);
+
+	// Z3 = (Y + Z)^2 - YY - ZZ, before Y and Z are overwritten
+	fe_add(tmp, p->Y, p->Z, f);
+	fe_sq(tmp, tmp, f);
+	fe_sub(tmp, tmp, yy, f);
+	fe_sub(r->Z, tmp, zz, f);
+
+	// X3 = M^2 - 2S
+	fe_sq(tmp, m, f);
+	fe_sub(tmp, tmp, s, f);
+	fe_sub(r->X, tmp, s, f);
+
+	// Y3 = M(S - X3) - 8YYYY
+	fe_sub(s, s, r->X, f);
+	fe_mul(s, m, s, f);
+	fe_add(yyyy, yyyy, yyyy, f);
+	fe_add(yyyy, yyyy, yyyy, f);
+	fe_add(yyyy, yyyy, yyyy, f);
+	fe_sub(r->Y, s, yyyy, f);
+}
+
+/**
+ * Doubles a point in Jacobian co-ordinates on a curve with a = -3
+ *
+ * With a = -3, 3X^2 + aZ^4 factors into 3(X - Z^2)(X + Z^2), so the
+ * dbl-2001-b formula costs 3M + 5S. This is used for secp192r1.
+ * r may alias p.
+ */
+static void jacobian_double_a3(struct JacobianPoint *r,
+				const struct JacobianPoint *p,
+				const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t delta, gamma, beta, alpha, tmp;
+
+	fe_sq(delta, p->Z, f);
+	fe_sq(gamma, p->Y, f);
+	fe_mul(beta, p->X, gamma, f);
+
+	// alpha = 3(X - delta)(X + delta)
+	fe_sub(tmp, p->X, delta, f);
+	fe_add(alpha, p->X, delta, f);
+	fe_mul(alpha, alpha, tmp, f);
+	fe_add(tmp, alpha, alpha, f);
+	fe_add(alpha, alpha, tmp, f);
+
+	// Z3 = (Y + Z)^2 - gamma - delta, before Y and Z are overwritten
+	fe_add(tmp, p->Y, p->Z, f);
+	fe_sq(tmp, tmp, f);
+	fe_sub(tmp, tmp, gamma, f);
+	fe_sub(r->Z, tmp, delta, f);
+
+	// X3 = alpha^2 - 8 beta
+	fe_add(beta, beta, beta, f);
+	fe_add(beta, beta, beta, f);
+	fe_sq(tmp, alpha, f);
+	fe_sub(tmp, tmp, beta, f);
+	fe_sub(r->X, tmp, beta, f);
+
+	// Y3 = alpha(4 beta - X3) - 8 gamma^2
+	fe_sub(beta, beta, r->X, f);
+	fe_mul(beta, alpha, beta, f);
+	fe_sq(gamma, gamma, f);
+	fe_add(gamma, gamma, gamma, f);
+	fe_add(gamma, gamma, gamma, f);
+	fe_add(gamma, gamma, gamma, f);
+	fe_sub(r->Y, beta, gamma, f);
+}
+
+/**
+ * Doubles a point in Jacobian co-ordinates on a curve with a = 0
+ *
+ * With a = 0 there is no a Z^4 term at all, and Z3 = 2YZ takes one
+ * multiplication, so the dbl-2009-l formula costs 2M + 5S. This is used
+ * for secp192k1.
+ * r may alias p.
+ */
+static void jacobian_double_a0(struct JacobianPoint *r,
+				const struct JacobianPoint *p,
+				const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t a, b, c, d, e, tmp;
+
+	fe_sq(a, p->X, f);
+	fe_sq(b, p->Y, f);
+	fe_sq(c, b, f);
+
+	// D = 2((X + B)^2 - A - C)
+	fe_add(d, p->X, b, f);
+	fe_sq(d, d, f);
+	fe_sub(d, d, a, f);
+	fe_sub(d, d, c, f);
+	fe_add(d, d, d, f);
+
+	// E = 3A
+	fe_add(e, a, a, f);
+	fe_add(e, e, a, f);
+
+	// Z3 = 2YZ, before Y and Z are overwritten
+	fe_mul(tmp, p->Y, p->Z, f);
+	fe_add(r->Z, tmp, tmp, f);
+
+	// X3 = E^2 - 2D
+	fe_sq(tmp, e, f);
+	fe_sub(tmp, tmp, d, f);
+	fe_sub(r->X, tmp, d, f);
+
+	// Y3 = E(D - X3) - 8C
+	fe_sub(d, d, r->X, f);
+	fe_mul(d, e, d, f);
+	fe_add(c, c, c, f);
+	fe_add(c, c, c, f);
+	fe_add(c, c, c, f);
+	fe_sub(r->Y, d, c, f);
+}
+
+/**
+ * Doubles a point in Jacobian co-ordinates, using the formula
+ * selected for the curve
+ */
+static void jacobian_double(struct JacobianPoint *r,
+				const struct JacobianPoint *p,
+				const struct Curve *ec)
+{
+	ec->double_point(r, p, ec);
+}
+
+/**
+ * Adds two points in Jacobian co-ordinates
+ *
+ * Uses the add-2007-bl formula, which costs 11M + 5S. Unlike the
+ * formula alone, p and q may be the point at infinity, the same point
+ * or each other's negation. r may alias p or q.
+ */
+static void jacobian_add(struct JacobianPoint *r,
+			const struct JacobianPoint *p,
+			const struct JacobianPoint *q,
+			const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t z1z1, z2z2, u1, u2, s1, s2, h, i, j, rr, v;
+
+	if (fe_is_zero(p->Z)) {
+		*r = *q;
+		return;
+	}
+	if (fe_is_zero(q->Z)) {
+		*r = *p;
+		return;
+	}
+
+	fe_sq(z1z1, p->Z, f);
+	fe_sq(z2z2, q->Z, f);
+	fe_mul(u1, p->X, z2z2, f);
+	fe_mul(u2, q->X, z1z1, f);
+	fe_mul(s1, p->Y, q->Z, f);
+	fe_mul(s1, s1, z2z2, f);
+	fe_mul(s2, q->Y, p->Z, f);
+	fe_mul(s2, s2, z1z1, f);
+
+	// H = U2 - U1 and r = 2(S2 - S1)
+	fe_sub(h, u2, u1, f);
+	fe_sub(rr, s2, s1, f);
+	if (fe_is_zero(h)) {
+		if (fe_is_zero(rr))
+			jacobian_double(r, p, ec);
+		else
+			memset(r, 0, sizeof(*r));
+		return;
+	}
+	fe_add(rr, rr, rr, f);
+
+	// I = (2H)^2, J = H I and V = U1 I
+	fe_add(i, h, h, f);
+	fe_sq(i, i, f);
+	fe_mul(j, h, i, f);
+	fe_mul(v, u1, i, f);
+
+	// Z3 = ((Z1 + Z2)^2 - Z1Z1 - Z2Z2) H, before Z is overwritten
+	fe_add(i, p->Z, q->Z, f);
+	fe_sq(i, i, f);
+	fe_sub(i, i, z1z1, f);
+	fe_sub(i, i, z2z2, f);
+	fe_mul(r->Z, i, h, f);
+
+	// X3 = r^2 - J - 2V
+	fe_sq(i, rr, f);
+	fe_sub(i, i, j, f);
+	fe_sub(i, i, v, f);
+	fe_sub(r->X, i, v, f);
+
+	// Y3 = r(V - X3) - 2 S1 J
+	fe_sub(v, v, r->X, f);
+	fe_mul(v, rr, v, f);
+	fe_mul(s1, s1, j, f);
+	fe_add(s1, s1, s1, f);
+	fe_sub(r->Y, v, s1, f);
+}
+
+/**
+ * Finishes the madd-2007-bl mixed addition of jacobian_add_affine and
+ * jacobian_add_affine_ct, from Z1Z1 = Z1^2, H = U2 - X1 and
+ * rr = S2 - Y1. rr is overwritten. r may alias p.
+ */
+static void jacobian_add_affine_finish(struct JacobianPoint *r,
+					const struct JacobianPoint *p,
+					const fe_t z1z1, const fe_t h, fe_t rr,
+					const struct Field *f)
+{
+	fe_t hh, i, j, v, s;
+
+	fe_add(rr, rr, rr, f);
+
+	// I = 4HH, J = H I and V = X1 I
+	fe_sq(hh, h, f);
+	fe_add(i, hh, hh, f);
+	fe_add(i, i, i, f);
+	fe_mul(j, h, i, f);
+	fe_mul(v, p->X, i, f);
+
+	// Z3 = (Z1 + H)^2 - Z1Z1 - HH, before Z is overwritten
+	fe_add(i, p->Z, h, f);
+	fe_sq(i, i, f);
+	fe_sub(i, i, z1z1, f);
+	fe_sub(r->Z, i, hh, f);
+
+	// X3 = r^2 - J - 2V
+	fe_mul(s, p->Y, j, f);
+	fe_sq(hh, rr, f);
+	fe_sub(hh, hh, j, f);
+	fe_sub(hh, hh, v, f);
+	fe_sub(r->X, hh, v, f);
+
+	// Y3 = r(V - X3) - 2 Y1 J
+	fe_sub(v, v, r->X, f);
+	fe_mul(v, rr, v, f);
+	fe_add(s, s, s, f);
+	fe_sub(r->Y, v, s, f);
+}
+
+/**
+ * Adds a point in affine form to a point in Jacobian co-ordinates
+ *
+ * With Z2 = 1 the madd-2007-bl mixed addition formula costs 7M + 4S,
+ * against 11M + 5S for jacobian_add, which is why precomputed points
+ * are kept in affine form. p and q may be the point at infinity, the
+ * same point or each other's negation. r may alias p.
+ */
+static void jacobian_add_affine(struct JacobianPoint *r,
+				const struct JacobianPoint *p,
+				const struct AffinePoint *q,
+				const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t z1z1, u2, s2, h, rr;
+
+	if (q->infinity) {
+		*r = *p;
+		return;
+	}
+	if (fe_is_zero(p->Z)) {
+		affine_to_jacobian(r, q, ec);
+		return;
+	}
+
+	fe_sq(z1z1, p->Z, f);
+	fe_mul(u2, q->x, z1z1, f);
+	fe_mul(s2, q->y, p->Z, f);
+	fe_mul(s2, s2, z1z1, f);
+
+	// H = U2 - X1 and r = 2(S2 - Y1)
+	fe_sub(h, u2, p->X, f);
+	fe_sub(rr, s2, p->Y, f);
+	if (fe_is_zero(h)) {
+		if (fe_is_zero(rr))
+			jacobian_double(r, p, ec);
+		else
+			memset(r, 0, sizeof(*r));
+		return;
+	}
+	jacobian_add_affine_finish(r, p, z1z1, h, rr, f);
+}
+
+/**
+ * Number of points normalized with each field inversion by
+ * jacobian_batch_to_affine, bounding its stack usage
+ */
+#define NORMALIZE_BATCH 32
+
+/**
+ * Converts n points in Jacobian co-ordinates into affine form
+ *
+ * The Z co-ordinates are inverted together with fe_batch_inv, so this
+ * costs one inversion per NORMALIZE_BATCH points plus 3M + 1S for each
+ * point. Used to store tables of precomputed points in affine form.
+ */
+static void jacobian_batch_to_affine(struct AffinePoint r[],
+					const struct JacobianPoint p[],
+					size_t n, const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t z[NORMALIZE_BATCH];
+	fe_t zinv[NORMALIZE_BATCH];
+	fe_t zinv2;
+	size_t i, j, m;
+
+	for (i = 0; i < n; i += NORMALIZE_BATCH) {
+		m = n - i < NORMALIZE_BATCH ? n - i : NORMALIZE_BATCH;
+		for (j = 0; j < m; j++)
+			memcpy(z[j], p[i + j].Z, sizeof(fe_t));
+		fe_batch_inv(zinv, z, m, f);
+
+		for (j = 0; j < m; j++) {
+			r[i + j].infinity = fe_is_zero(z[j]);
+			fe_sq(zinv2, zinv[j], f);
+			fe_mul(r[i + j].x, p[i + j].X, zinv2, f);
+			fe_mul(zinv2, zinv2, zinv[j], f);
+			fe_mul(r[i + j].y, p[i + j].Y, zinv2, f);
+		}
+	}
+}
+
+/**
+ * Adds two points in the prime field, writing the result into r
+ *
+ * See https://www.johannes-bauer.com/compsci/ecc/#anchor17 for details
+ *
+ * r is the return variable. It must be initialized and may alias p or q.
+ * p and q are the points to add.
+ * ec is the curve on which the points lie.
+ *
+ * Returns 0 on success, or -1 with r set to the point at infinity if a
+ * co-ordinate of p or q is negative or not below the prime
+ */
+int point_add_into(struct Point *r, struct Point *p, struct Point *q,
+			const struct Curve *ec)
+{
+	struct AffinePoint a, b;
+	struct JacobianPoint j, k;
+
+	if (point_to_affine(&a, p, ec) != 0
+		|| point_to_affine(&b, q, ec) != 0)
+		return point_reject(r);
+	affine_to_jacobian(&j, &a, ec);
+	affine_to_jacobian(&k, &b, ec);
+	jacobian_add(&j, &j, &k, ec);
+	jacobian_to_affine(&a, &j, ec);
+	affine_to_point(r, &a, ec);
+	return 0;
+}
+
+/**
+ * Doubles a point in the prime field, writing the result into r
+ *
+ * See https://www.johannes-bauer.com/compsci/ecc/#anchor18 for details
+ *
+ * r is the return variable. It must be initialized and may alias p.
+ * p is the point to double.
+ * ec is the curve on which the point lies.
+ *
+ * Returns 0 on success, or -1 with r set to the point at infinity if a
+ * co-ordinate of p is negative or not below the prime
+ */
+int point_double_into(struct Point *r, struct Point *p,
+			const struct Curve *ec)
+{
+	struct AffinePoint a;
+	struct JacobianPoint j;
+
+	if (point_to_affine(&a, p, ec) != 0)
+		return point_reject(r);
+	affine_to_jacobian(&j, &a, ec);
+	jacobian_double(&j, &j, ec);
+	jacobian_to_affine(&a, &j, ec);
+	affine_to_point(r, &a, ec);
+	return 0;
+}
 
 /**
  * Adds two points in the prime field
  *
- * The two points cannot be the same point.
- * See https://www.johannes-bauer.com/compsci/ecc/#anchor17 for details
+ * See https://www.johannes-bauer.com/compsci/ecc/#anchor17 for details
+ *
+ * p and q are the points to add.
+ * ec is the curve on which the points lie.
+ *
+ * Returns a new point which is the result of the operation, or NULL if
+ * a co-ordinate of the input is negative or not below the prime
+ */
+struct Point *point_add(struct Point *p, struct Point *q,
+			const struct Curve *ec)
+{
+	struct Point *r = create_point();
+
+	if (point_add_into(r, p, q, ec) != 0) {
+		free_point(r);
+		return NULL;
+	}
+	return r;
+}
+
+/**
+ * Doubles a point in the prime field
+ *
+ * See https://www.johannes-bauer.com/compsci/ecc/#anchor18 for details
+ *
+ * p is the point to double.
+ * ec is the curve on which the point lies.
+ *
+ * Returns a new point which is the result of the operation, or NULL if
+ * a co-ordinate of the input is negative or not below the prime
+ */
+struct Point *point_double(struct Point *p, const struct Curve *ec)
+{
+	struct Point *r = create_point();
+
+	if (point_double_into(r, p, ec) != 0) {
+		free_point(r);
+		return NULL;
+	}
+	return r;
+}
+
+/**
+ * Default width in bits of the wNAF window used by scalar_mult. It can
+ * be changed per curve through the window member of struct Curve, and
+ * must be between 2 and WNAF_MAX_WINDOW.
+ */
+#ifndef SCALAR_MULT_WINDOW
+#define SCALAR_MULT_WINDOW 5
+#endif
+
+#define WNAF_MAX_WINDOW 8
+
+/**
+ * Size of a wNAF digit array for a scalar reduced modulo the order. The
+ * order is at most one bit longer than the prime, the recoding adds one
+ * more digit and may write zeros up to a window past the end.
+ */
+#define WNAF_MAX_DIGITS (FIELD_BITS + 2 + WNAF_MAX_WINDOW)
+
+/**
+ * Number of odd multiples P, 3P, ... (2^(w-1) - 1)P in the table for a
+ * window of width w
+ */
+#define WNAF_TABLE_SIZE(w) (1 << ((w) - 2))
+
+/**
+ * Recodes a scalar in width-w non-adjacent form
+ *
+ * Every non-zero digit is odd and less than 2^(w-1) in magnitude, and
+ * any w consecutive digits hold at most one non-zero digit, so a scalar
+ * of n bits needs about n / (w + 1) additions instead of n / 2. The
+ * digits are produced from the least significant end, carrying into
+ * the next window whenever a digit is made negative.
+ * See Algorithm 3.35 of "Guide to Elliptic Curve Cryptography" for
+ * details.
+ *
+ * naf is the return array of at least mpz_sizeinbase(k, 2) + w + 1
+ * digits, least significant first.
+ * k is the scalar to recode, which must not be negative.
+ * w is the width of the window.
+ *
+ * Returns the number of digits written
+ */
+static int wnaf_recode(int naf[], mpz_t k, int w)
+{
+	int bits = mpz_sizeinbase(k, 2);
+	int carry = 0;
+	int len = 0;
+	int i, j, digit;
+
+	if (mpz_sgn(k) == 0)
+		return 0;
+
+	i = 0;
+	while (i < bits || carry) {
+		if (mpz_tstbit(k, i) == (unsigned long)carry) {
+			naf[i++] = 0;
+			continue;
+		}
+
+		digit = carry;
+		for (j = w - 1; j >= 0; j--)
+			digit += mpz_tstbit(k, i + j) << j;
+		carry = digit >> (w - 1);
+		digit -= carry << w;
+
+		naf[i] = digit;
+		for (j = 1; j < w; j++)
+			naf[i + j] = 0;
+		len = i + 1;
+		i += w;
+	}
+	return len;
+}
+
+/**
+ * Fills table[i] with (2i + 1)P for the odd multiples of P used by a
+ * window of width w, in affine form
+ *
+ * The multiples are computed by repeatedly adding 2P and normalized
+ * with one batch inversion.
+ */
+static void build_table(struct AffinePoint table[], int w,
+			const struct AffinePoint *p,
+			const struct Curve *ec)
+{
+	const int size = WNAF_TABLE_SIZE(w);
+	struct JacobianPoint jtable[WNAF_TABLE_SIZE(WNAF_MAX_WINDOW)];
+	struct JacobianPoint p2;
+	int i;
+
+	affine_to_jacobian(&jtable[0], p, ec);
+	if (size > 1) {
+		jacobian_double(&p2, &jtable[0], ec);
+		for (i = 1; i < size; i++)
+			jacobian_add(&jtable[i], &jtable[i - 1], &p2, ec);
+	}
+	jacobian_batch_to_affine(table, jtable, size, ec);
+}
+
+/**
+ * Adds digit P to r, for a non-zero wNAF digit and the table of odd
+ * multiples of P
+ *
+ * Negative digits use the negated table entry, which costs only a
+ * subtraction of y from zero.
+ */
+static void add_digit(struct JacobianPoint *r,
+			const struct AffinePoint table[], int digit,
+			const struct Curve *ec)
+{
+	const fe_t zero = { 0 };
+	struct AffinePoint neg;
+
+	if (digit > 0) {
+		jacobian_add_affine(r, r, &table[digit >> 1], ec);
+	} else {
+		neg = table[(-digit) >> 1];
+		fe_sub(neg.y, zero, neg.y, &ec->field);
+		jacobian_add_affine(r, r, &neg, ec);
+	}
+}
+
+/**
+ * Computes r = kP with the wNAF method
+ *
+ * The scalar is reduced modulo the order and recoded with wnaf_recode,
+ * then processed from the most significant digit with one doubling per
+ * digit and one mixed addition per non-zero digit.
+ */
+static void scalar_mult_wnaf(struct JacobianPoint *r,
+				const struct AffinePoint *p, mpz_t k,
+				const struct Curve *ec, struct Scratch *s)
+{
+	struct AffinePoint table[WNAF_TABLE_SIZE(WNAF_MAX_WINDOW)];
+	int naf[WNAF_MAX_DIGITS];
+	int i, len;
+
+	mpz_mod(s->e, k, ec->order);
+	len = wnaf_recode(naf, s->e, ec->window);
+
+	build_table(table, ec->window, p, ec);
+
+	memset(r, 0, sizeof(*r));
+	for (i = len - 1; i >= 0; i--) {
+		jacobian_double(r, r, ec);
+		if (naf[i] != 0)
+			add_digit(r, table, naf[i], ec);
+	}
+}
+
+/**
+ * Splits k into k1 + k2 lambda modulo the order, with k1 and k2 about
+ * half the size of the order
+ *
+ * With c1 = round(b2 k / n) and c2 = round(-b1 k / n), the split is
+ * k1 = k - c1 a1 - c2 a2 and k2 = -c1 b1 - c2 b2. See Algorithm 3.74 of
+ * "Guide to Elliptic Curve Cryptography" for details.
+ *
+ * k1 and k2 are returned in s->k1 and s->k2, and may be negative.
+ */
+static void glv_split(mpz_t k, const struct Curve *ec, struct Scratch *s)
+{
+	const struct Endomorphism *glv = &ec->glv;
+	mpz_ptr k1 = s->k1, k2 = s->k2, c1 = s->c1, c2 = s->c2, tmp = s->e;
+
+	mpz_mod(k1, k, ec->order);
+
+	// round(x / n) = floor((2x + n) / 2n) for x >= 0
+	mpz_mul(c1, glv->b2, k1);
+	mpz_mul_2exp(c1, c1, 1);
+	mpz_add(c1, c1, ec->order);
+	mpz_mul_2exp(tmp, ec->order, 1);
+	mpz_fdiv_q(c1, c1, tmp);
+
+	mpz_mul(c2, glv->b1, k1);
+	mpz_neg(c2, c2);
+	mpz_mul_2exp(c2, c2, 1);
+	mpz_add(c2, c2, ec->order);
+	mpz_fdiv_q(c2, c2, tmp);
+
+	mpz_submul(k1, c1, glv->a1);
+	mpz_submul(k1, c2, glv->a2);
+	mpz_mul(k2, c1, glv->b1);
+	mpz_addmul(k2, c2, glv->b2);
+	mpz_neg(k2, k2);
+}
+
+/**
+ * Computes r = kP using the GLV endomorphism of the curve
+ *
+ * k is split with glv_split and both halves are recoded in wNAF. The
+ * table of odd multiples of P is mapped through the endomorphism to
+ * give the table for lambda P at one multiplication per entry, and both
+ * half-size scalars are processed together with a shared chain of
+ * doublings. Negative halves flip the sign of their digits.
+ */
+static void scalar_mult_glv(struct JacobianPoint *r,
+				const struct AffinePoint *p, mpz_t k,
+				const struct Curve *ec, struct Scratch *s)
+{
+	struct AffinePoint table1[WNAF_TABLE_SIZE(WNAF_MAX_WINDOW)];
+	struct AffinePoint table2[WNAF_TABLE_SIZE(WNAF_MAX_WINDOW)];
+	int naf1[WNAF_MAX_DIGITS];
+	int naf2[WNAF_MAX_DIGITS];
+	int sign1, sign2, len1, len2, i;
+
+	glv_split(k, ec, s);
+
+	sign1 = mpz_sgn(s->k1) < 0 ? -1 : 1;
+	sign2 = mpz_sgn(s->k2) < 0 ? -1 : 1;
+	mpz_abs(s->k1, s->k1);
+	mpz_abs(s->k2, s->k2);
+	len1 = wnaf_recode(naf1, s->k1, ec->window);
+	len2 = wnaf_recode(naf2, s->k2, ec->window);
+
+	build_table(table1, ec->window, p, ec);
+	for (i = 0; i < WNAF_TABLE_SIZE(ec->window); i++) {
+		fe_mul(table2[i].x, table1[i].x, ec->glv.beta, &ec->field);
+		memcpy(table2[i].y, table1[i].y, sizeof(fe_t));
+		table2[i].infinity = table1[i].infinity;
+	}
+
+	memset(r, 0, sizeof(*r));
+	for (i = (len1 > len2 ? len1 : len2) - 1; i >= 0; i--) {
+		jacobian_double(r, r, ec);
+		if (i < len1 && naf1[i] != 0)
+			add_digit(r, table1, sign1 * naf1[i], ec);
+		if (i < len2 && naf2[i] != 0)
+			add_digit(r, table2, sign2 * naf2[i], ec);
+	}
+}
+
+/**
+ * Multiplies a point in the prime field with a scalar, writing the result
+ * into r
+ *
+ * Curves with a GLV endomorphism use scalar_mult_glv, all others
+ * scalar_mult_wnaf. Either way everything runs in Jacobian co-ordinates
+ * with precomputed odd multiples of P in affine form, and is converted
+ * back to affine form only when the result is returned.
+ * See https://www.johannes-bauer.com/compsci/ecc/#anchor19 for details
+ *
+ * r is the return variable. It must be initialized and may alias p.
+ * p is the point to multiply.
+ * k is the scalar value.
+ * ec is the curve on which the point lies.
+ * s is the scratch space for the temporaries.
+ *
+ * Returns 0 on success, or -1 with r set to the point at infinity if a
+ * co-ordinate of p is negative or not below the prime
+ */
+int scalar_mult_into(struct Point *r, struct Point *p, mpz_t k,
+			const struct Curve *ec, struct Scratch *s)
+{
+	struct AffinePoint a;
+	struct JacobianPoint res;
+
+	if (point_to_affine(&a, p, ec) != 0)
+		return point_reject(r);
+	if (ec->glv.enabled)
+		scalar_mult_glv(&res, &a, k, ec, s);
+	else
+		scalar_mult_wnaf(&res, &a, k, ec, s);
+
+	jacobian_to_affine(&a, &res, ec);
+	affine_to_point(r, &a, ec);
+	return 0;
+}
+
+/**
+ * Multiplies a point in the prime field with a scalar
+ *
+ * See scalar_mult_into for details.
+ *
+ * p is the point to multiply.
+ * k is the scalar value.
+ * ec is the curve on which the point lies.
+ *
+ * Returns a new point which is the result of the operation, or NULL if
+ * a co-ordinate of the input is negative or not below the prime
+ */
+struct Point *scalar_mult(struct Point *p, mpz_t k, const struct Curve *ec)
+{
+	struct Point *r = create_point();
+	struct Scratch s;
+
+	init_scratch(&s);
+	if (scalar_mult_into(r, p, k, ec, &s) != 0) {
+		free_point(r);
+		r = NULL;
+	}
+	clear_scratch(&s);
+	return r;
+}
+
+/**
+ * Width in bits of the windows of the fixed-base table of G used by
+ * scalar_mult_base. The table holds about 2^(w-1) (bits / w) affine
+ * points, e.g. 25 KB at w = 4 and 66 KB at w = 6 for the 192-bit
+ * curves. Setting it to 0 disables the table, and scalar_mult_base
+ * falls back to scalar_mult.
+ */
+#ifndef FIXED_BASE_WINDOW
+#define FIXED_BASE_WINDOW 6
+#endif
+
+#if FIXED_BASE_WINDOW > 0
+#define FIXED_BASE_ENTRIES (1 << (FIXED_BASE_WINDOW - 1))
+
+/**
+ * Builds the fixed-base table of G
+ *
+ * Window i holds d 2^(wi) G for d = 1 .. 2^(w-1), so every signed digit
+ * of a scalar in base 2^w is a single table lookup. Each window is
+ * filled by repeated addition, the next window starts from a doubling
+ * of the last entry, and all entries are normalized together.
+ *
+ * Returns the table of ec->g_windows windows, allocated with
+ * posix_memalign to keep the entries aligned
+ */
+static struct AffinePoint *build_base_table(const struct Curve *ec)
+{
+	const size_t n = (size_t)ec->g_windows * FIXED_BASE_ENTRIES;
+	struct AffinePoint *table = NULL;
+	struct JacobianPoint *jtable = malloc(n * sizeof(*jtable));
+	struct AffinePoint g;
+	struct JacobianPoint base;
+	size_t i;
+	int d;
+
+	if (posix_memalign((void **)&table, CACHE_LINE, n * sizeof(*table))
+	    || jtable == NULL) {
+		printf("Failed to allocate memory for base table");
+		free(table);
+		free(jtable);
+		return NULL;
+	}
+
+	point_to_affine(&g, (struct Point *)&ec->G, ec);
+	affine_to_jacobian(&base, &g, ec);
+	for (i = 0; i < n; i += FIXED_BASE_ENTRIES) {
+		jtable[i] = base;
+		for (d = 1; d < FIXED_BASE_ENTRIES; d++)
+			jacobian_add(&jtable[i + d], &jtable[i + d - 1],
+					&base, ec);
+		jacobian_double(&base, &jtable[i + FIXED_BASE_ENTRIES - 1], ec);
+	}
+	jacobian_batch_to_affine(table, jtable, n, ec);
+
+	free(jtable);
+	return table;
+}
+
+/**
+ * Adds a point in affine form to a point in Jacobian co-ordinates,
+ * without branching on either of them
+ *
+ * This is jacobian_add_affine without its special cases: r is only the
+ * sum if p is not the point at infinity, q is not the point at infinity
+ * and p and q have different x co-ordinates. r may alias p.
+ *
+ * Returns 1 if p and q have the same x co-ordinate, and 0 otherwise
+ */
+static int jacobian_add_affine_ct(struct JacobianPoint *r,
+					const struct JacobianPoint *p,
+					const struct AffinePoint *q,
+					const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+	fe_t z1z1, u2, s2, h, rr;
+	int same;
+
+	fe_sq(z1z1, p->Z, f);
+	fe_mul(u2, q->x, z1z1, f);
+	fe_mul(s2, q->y, p->Z, f);
+	fe_mul(s2, s2, z1z1, f);
+	fe_sub(h, u2, p->X, f);
+	fe_sub(rr, s2, p->Y, f);
+	same = fe_is_zero(h);
+	jacobian_add_affine_finish(r, p, z1z1, h, rr, f);
+	return same;
+}
+
+/**
+ * Sets r to p if flag is 1 and leaves it unchanged if flag is 0,
+ * without branching on flag
+ */
+static void jacobian_cmov(struct JacobianPoint *r,
+				const struct JacobianPoint *p, int flag)
+{
+	fe_cmov(r->X, p->X, flag);
+	fe_cmov(r->Y, p->Y, flag);
+	fe_cmov(r->Z, p->Z, flag);
+}
+
+/**
+ * Sets r to the entry of a window of the fixed-base table for a signed
+ * digit, d 2^(wi) G for the digit d of window i
+ *
+ * Every entry of the window is read and the sign is applied with
+ * fe_cmov, so neither the memory accesses nor the branches depend on
+ * the digit. A zero digit gives the first entry, which the caller
+ * discards.
+ */
+static void base_table_lookup(struct AffinePoint *r,
+				const struct AffinePoint window[], int digit,
+				const struct Curve *ec)
+{
+	const fe_t zero = { 0 };
+	int negative = (unsigned int)digit >> (sizeof(int) * 8 - 1);
+	int index = (digit ^ -negative) + negative;
+	limb_t mask;
+	fe_t y;
+	int d, l;
+
+	*r = window[0];
+	for (d = 2; d <= FIXED_BASE_ENTRIES; d++) {
+		mask = -(limb_t)(d == index);
+		for (l = 0; l < FIELD_LIMBS; l++) {
+			r->x[l] ^= (r->x[l] ^ window[d - 1].x[l]) & mask;
+			r->y[l] ^= (r->y[l] ^ window[d - 1].y[l]) & mask;
+		}
+	}
+	r->infinity = 0;
+	fe_sub(y, zero, r->y, &ec->field);
+	fe_cmov(r->y, y, negative);
+}
+#endif
+
+/**
+ * Sets up the fixed-base table of G for a curve whose arithmetic has
+ * been set up
+ */
+static void curve_init_base(struct Curve *ec)
+{
+#if FIXED_BASE_WINDOW > 0
+	ec->g_windows = mpz_sizeinbase(ec->order, 2) / FIXED_BASE_WINDOW + 1;
+	ec->g_table = build_base_table(ec);
+#else
+	ec->g_windows = 0;
+	ec->g_table = NULL;
+#endif
+}
+
+/**
+ * Multiplies the generator of a curve with a scalar, writing the result
+ * into r
+ *
+ * The scalar is reduced modulo the order and split into signed digits
+ * in base 2^w, with every digit between -2^(w-1) and 2^(w-1). Each
+ * digit adds one entry of the fixed-base table, so no doublings are
+ * needed and the cost is one mixed addition per window.
  *
- * p and q are the points to add.
- * ec is the curve on which the points lie.
+ * As the scalar is usually a private key, the windows are processed
+ * without branching on the digits: every entry of a window is scanned
+ * with base_table_lookup, the addition is always done and its result
+ * is kept with jacobian_cmov, as is the entry itself while the sum is
+ * still the point at infinity. The reduction of the scalar and the
+ * field arithmetic are those of the rest of the code. The sum of the
+ * windows below i is smaller than the entry of window i, so none of the
+ * additions has two points with the same x co-ordinate, which the
+ * branch-free formula cannot handle, as long as the order is close to a
+ * power of two as for the curves here. Should it happen on another
+ * curve, the product is redone with scalar_mult_into.
  *
- * Returns a new point which is the result of the operation
+ * r is the return variable. It must be initialized.
+ * k is the scalar value.
+ * ec is the curve whose generator is multiplied.
+ * s is the scratch space for the temporaries.
  */
-struct Point *point_add(struct Point *p, struct Point *q, struct Curve *ec)
+void scalar_mult_base_into(struct Point *r, mpz_t k, const struct Curve *ec,
+				struct Scratch *s)
 {
-	if (mpz_cmp_ui(p->x, 0UL) == 0 && mpz_cmp_ui(p->y, 0UL) == 0)
-		return copy_point(q);
-	if (mpz_cmp_ui(q->x, 0UL) == 0 && mpz_cmp_ui(q->y, 0UL) == 0)
-		return copy_point(p);
-
-	struct Point *r = create_point();
+#if FIXED_BASE_WINDOW > 0
+	struct AffinePoint a;
+	struct JacobianPoint res, sum, entry;
+	mpz_ptr e = s->e;
+	int carry = 0, empty = 1, same = 0;
+	int i, j, digit, nonzero;
+
+	if (ec->g_table == NULL) {
+		scalar_mult_into(r, (struct Point *)&ec->G, k, ec, s);
+		return;
+	}
 
-	mpz_t tmp1;
-	mpz_t tmp2;
-	mpz_t s;
-	mpz_t x_delta;
-	mpz_t y_delta;
-
-	if (mpz_cmp(p->x, q->x) == 0)
-		return r;
-
-	// Calculate Px - Qx
-	mpz_init(x_delta);
-	prime_field_sub(x_delta, p->x, q->x, ec->prime);
-
-	// Calculate Py - Qy
-	mpz_init(y_delta);
-	prime_field_sub(y_delta, p->y, q->y, ec->prime);
-
-	// Calculate slope as Py - Qy / Px - Qx
-	mpz_init(s);
-	prime_field_div(s, y_delta, x_delta, ec->prime);
-
-	// Calculate Rx as slope^2 - Px -Qx
-	mpz_init(tmp1);
-	mpz_init(tmp2);
-	prime_field_sq(tmp1, s, ec->prime);
-	prime_field_add(tmp2, p->x, q->x, ec->prime);
-	prime_field_sub(r->x, tmp1, tmp2, ec->prime);
-
-	// Calculate Ry as (slope (Px - Rx) - Py)
-	prime_field_sub(tmp1, p->x, r->x, ec->prime);
-	prime_field_mul(tmp2, s, tmp1, ec->prime);
-	prime_field_sub(r->y, tmp2, p->y, ec->prime);
-
-	mpz_clear(tmp1);
-	mpz_clear(tmp2);
-	mpz_clear(x_delta);
-	mpz_clear(y_delta);
-	mpz_clear(s);
+	mpz_mod(e, k, ec->order);
+
+	memset(&res, 0, sizeof(res));
+	for (i = 0; i < ec->g_windows; i++) {
+		digit = carry;
+		for (j = FIXED_BASE_WINDOW - 1; j >= 0; j--)
+			digit += mpz_tstbit(e, i * FIXED_BASE_WINDOW + j) << j;
+		carry = digit > FIXED_BASE_ENTRIES;
+		digit -= carry << FIXED_BASE_WINDOW;
+		nonzero = digit != 0;
+
+		base_table_lookup(&a, &ec->g_table[i * FIXED_BASE_ENTRIES],
+					digit, ec);
+		same |= jacobian_add_affine_ct(&sum, &res, &a, ec) & nonzero
+			& !empty;
+		affine_to_jacobian(&entry, &a, ec);
+		jacobian_cmov(&sum, &entry, empty);
+		jacobian_cmov(&res, &sum, nonzero);
+		empty &= !nonzero;
+	}
+	if (same) {
+		scalar_mult_into(r, (struct Point *)&ec->G, k, ec, s);
+		return;
+	}
 
-	return r;
+	jacobian_to_affine(&a, &res, ec);
+	affine_to_point(r, &a, ec);
+#else
+	scalar_mult_into(r, (struct Point *)&ec->G, k, ec, s);
+#endif
 }
 
 /**
- * Doubles a point in the prime field
+ * Multiplies the generator of a curve with a scalar
  *
- * See https://www.johannes-bauer.com/compsci/ecc/#anchor18 for details
+ * See scalar_mult_base_into for details.
  *
- * p is the point to double.
- * ec is the curve on which the point lies.
+ * k is the scalar value.
+ * ec is the curve whose generator is multiplied.
  *
  * Returns a new point which is the result of the operation
  */
-struct Point *point_double(struct Point *p, struct Curve *ec)
+struct Point *scalar_mult_base(mpz_t k, const struct Curve *ec)
 {
 	struct Point *r = create_point();
+	struct Scratch s;
 
-	mpz_t s;
-	mpz_t s_sq;
-	mpz_t tmp1;
-	mpz_t tmp2;
-	mpz_t px_sq;
-	mpz_t px_2;
-	mpz_t py_2;
-	mpz_t three;
-	mpz_t two;
-	mpz_t sum;
-
-	// Calculate Px^2
-	mpz_init(px_sq);
-	prime_field_sq(px_sq, p->x, ec->prime);
-
-	// Calculate 3Px^2
-	mpz_init(tmp1);
-	mpz_init_set_ui(three, 3UL);
-	prime_field_mul(tmp1, px_sq, three, ec->prime);
-
-	// Calculate 3Px^2 + a, where a is EC parmater
-	mpz_init(sum);
-	prime_field_add(sum, tmp1, ec->a, ec->prime);
-
-	// Calculate 2Px
-	mpz_init(px_2);
-	mpz_init_set_ui(two, 2UL);
-	prime_field_mul(px_2, p->x, two, ec->prime);
-
-	// Calculate 2Py
-	mpz_init(py_2);
-	prime_field_mul(py_2, p->y, two, ec->prime);
-
-	// Calculate s = (3Px^2 + a) / 2Py
-	mpz_init(s);
-	prime_field_div(s, sum, py_2, ec->prime);
-
-	// Calculate s^2
-	mpz_init(s_sq);
-	prime_field_sq(s_sq, s, ec->prime);
-
-	// Calculate Rx = s^2 - 2Px
-	prime_field_sub(r->x, s_sq, px_2, ec->prime);
-
-	// Calculate s (Px - Rx)
-	mpz_init(tmp2);
-	prime_field_sub(tmp1, p->x, r->x, ec->prime);
-	prime_field_mul(tmp2, s, tmp1, ec->prime);
-
-	// Calculate Ry = s(Px - Rx) - Py
-	prime_field_sub(r->y, tmp2, p->y, ec->prime);
-
-	mpz_clear(s);
-	mpz_clear(s_sq);
-	mpz_clear(tmp1);
-	mpz_clear(tmp2);
-	mpz_clear(px_sq);
-	mpz_clear(px_2);
-	mpz_clear(py_2);
-	mpz_clear(three);
-	mpz_clear(two);
-	mpz_clear(sum);
-
+	init_scratch(&s);
+	scalar_mult_base_into(r, k, ec, &s);
+	clear_scratch(&s);
 	return r;
 }
 
+#if MULTIBUF_AVX2 || MULTIBUF_IFMA
 /**
- * Multiplies a point in the prime field with a scalar
+ * The field kernels of the multi-buffer backends, used for everything
+ * but the batches
+ */
+#if FIELD_MULX
+#define BACKEND_FE_MUL fe_mul_mulx
+#define BACKEND_FE_SQ fe_sq_mulx
+#else
+#define BACKEND_FE_MUL fe_mul_generic
+#define BACKEND_FE_SQ fe_sq_generic
+#endif
+
+/**
+ * Returns 1 if the CPU can run the field kernels of the multi-buffer
+ * backends
+ */
+static int backend_fe_supported(void)
+{
+#if FIELD_MULX
+	return field_mulx_supported();
+#else
+	return 1;
+#endif
+}
+#endif
+
+#if MULTIBUF_AVX2
+static int backend_avx2_supported(void)
+{
+	return multibuf_x4_supported() && backend_fe_supported();
+}
+
+/**
+ * The backend running batches four at a time with AVX2
+ */
+static const struct Backend backend_avx2 = {
+	"avx2", backend_avx2_supported, BACKEND_FE_MUL, BACKEND_FE_SQ,
+	{ { FE4_LANES, scalar_mult_x4 } }
+};
+#endif
+
+#if MULTIBUF_IFMA
+static int backend_avx512ifma_supported(void)
+{
+	return multibuf_x8_supported() && multibuf_x4_supported()
+		&& backend_fe_supported();
+}
+
+/**
+ * The backend running batches eight at a time with AVX-512 IFMA
  *
- * See https://www.johannes-bauer.com/compsci/ecc/#anchor19 for details
+ * What is left runs four at a time with AVX2 only with 32-bit limbs,
+ * where that is faster than one at a time; with mulx it is slower.
+ */
+static const struct Backend backend_avx512ifma = {
+	"avx512ifma", backend_avx512ifma_supported, BACKEND_FE_MUL,
+	BACKEND_FE_SQ,
+#if FIELD_MULX
+	{ { FE8_LANES, scalar_mult_x8 } }
+#else
+	{ { FE8_LANES, scalar_mult_x8 }, { FE4_LANES, scalar_mult_x4 } }
+#endif
+};
+#endif
+
+/**
+ * The dispatch table, from the fastest backend down to the portable one
  *
- * p is the point to multiply.
- * k is the scalar value.
- * ec is the curve on which the point lies.
+ * The four lanes of avx2 take longer per scalar multiplication than
+ * mulx does one at a time, so avx2 comes after mulx. As it also needs
+ * the mulx kernels, it is only picked when forced with ECDH_BACKEND in
+ * builds with mulx, and by default with 32-bit limbs, where it beats
+ * generic.
+ */
+static const struct Backend *const backends[] = {
+#if MULTIBUF_IFMA
+	&backend_avx512ifma,
+#endif
+#if FIELD_MULX
+	&backend_mulx,
+#endif
+#if MULTIBUF_AVX2
+	&backend_avx2,
+#endif
+	&backend_generic
+};
+#define BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+#if FIELD_DISPATCH
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Returns 1 if the CPU can run the backend b
+ */
+static int backend_supported(const struct Backend *b)
+{
+	return b->supported == NULL || b->supported();
+}
+
+/**
+ * Picks the backend, the first one in the table that the CPU can run
  *
- * Returns a new point which is the result of the operation
+ * If ECDH_BACKEND names a backend, that backend is used, so that it can
+ * be forced for benchmarks and comparisons. A name that is not compiled
+ * into this build, or whose backend the CPU cannot run, gives the
+ * portable backend, so that a forced backend is never replaced by a
+ * faster one.
  */
-struct Point *scalar_mult(struct Point *p, mpz_t k, struct Curve *ec)
+static void init_backend(void)
 {
-	struct Point *res = create_point();
-	struct Point *p_copy = copy_point(p);
-	struct Point *tmp1, *tmp2;
+	const char *name = getenv("ECDH_BACKEND");
+	size_t i;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	// Needed by __builtin_cpu_supports in code run before main
+	__builtin_cpu_init();
+#endif
+	if (name != NULL && *name != '\0') {
+		backend = &backend_generic;
+		for (i = 0; i < BACKENDS; i++) {
+			if (strcmp(name, backends[i]->name) == 0
+			    && backend_supported(backends[i]))
+				backend = backends[i];
+		}
+		return;
+	}
+	for (i = 0; i < BACKENDS; i++) {
+		if (backend_supported(backends[i])) {
+			backend = backends[i];
+			break;
+		}
+	}
+}
 
-	char *val_str = mpz_get_str(NULL, 2, k);
-	size_t len = strlen(val_str);
-	int i;
-	for (i = len - 1; i >= 0; i--) {
-		if (val_str[i] == '1') {
-			tmp1 = point_add(p_copy, res, ec);
-			free_point(res);
-			res = tmp1;
+/**
+ * Returns the backend the arithmetic runs on
+ *
+ * The backend is picked once, by the first call or, with GNU C, at
+ * startup, and never changes afterwards. Until then the portable
+ * backend is used.
+ */
+const struct Backend *get_backend(void)
+{
+	pthread_once(&backend_once, init_backend);
+	return backend;
+}
+
+#if defined(__GNUC__)
+__attribute__((constructor)) static void init_backend_at_startup(void)
+{
+	get_backend();
+}
+#endif
+#else
+/**
+ * Returns the backend the arithmetic runs on, the portable one in
+ * builds without runtime dispatch
+ */
+const struct Backend *get_backend(void)
+{
+	return backends[0];
+}
+#endif
+
+/**
+ * Multiplies n points with n scalars, r[i] = k[i] p[i]
+ *
+ * The multiplications run in groups on the multi-buffer engines of the
+ * backend, see get_backend: eight at a time in lockstep with AVX-512
+ * IFMA, or four at a time with AVX2 where that is faster than one at a
+ * time (see backends). The remaining ones, or all of them with a
+ * backend without engines, go through scalar_mult_into one at a time.
+ * The results are the same either way.
+ *
+ * Every point is checked before it is loaded into a lane: the complete
+ * formulas of the engines only hold on the curve, so points that are
+ * neither on the curve nor (0, 0) go through scalar_mult_into instead.
+ * Those with a co-ordinate outside the prime field give the point at
+ * infinity there.
+ *
+ * r is the array of return variables. They must be initialized and may
+ * be the same as p.
+ * p is the array of points to multiply, all in the group generated by G.
+ * k is the array of scalar values.
+ * n is the number of multiplications.
+ * ec is the curve on which the points lie.
+ * s is the scratch space for the temporaries.
+ */
+void scalar_mult_batch_into(struct Point r[], struct Point p[], mpz_t k[],
+				size_t n, const struct Curve *ec,
+				struct Scratch *s)
+{
+	const struct MultiBufEngine *engines = get_backend()->engines;
+	struct Point *rl[MULTIBUF_MAX_LANES], *pl[MULTIBUF_MAX_LANES];
+	mpz_ptr kl[MULTIBUF_MAX_LANES];
+	size_t i;
+	int e, l, m = 0;
+
+	for (i = 0; i < n && engines[0].lanes > 0; i++) {
+		if (!(mpz_sgn(p[i].x) == 0 && mpz_sgn(p[i].y) == 0)
+			&& !point_is_valid(&p[i], ec)) {
+			scalar_mult_into(&r[i], &p[i], k[i], ec, s);
+			continue;
+		}
+		rl[m] = &r[i];
+		pl[m] = &p[i];
+		kl[m] = k[i];
+		if (++m == engines[0].lanes) {
+			engines[0].scalar_mult(rl, pl, kl, ec, s);
+			m = 0;
 		}
-		tmp2 = point_double(p_copy, ec);
-		free_point(p_copy);
-		p_copy = tmp2;
 	}
 
-	free_point(p_copy);
-	free(val_str);
+	// Fewer points than the widest engine takes are left over
+	l = 0;
+	for (e = 1; e < BACKEND_ENGINES && engines[e].lanes > 0; e++) {
+		for (; l + engines[e].lanes <= m; l += engines[e].lanes)
+			engines[e].scalar_mult(&rl[l], &pl[l], &kl[l], ec, s);
+	}
+	for (; l < m; l++)
+		scalar_mult_into(rl[l], pl[l], kl[l], ec, s);
+	for (; i < n; i++)
+		scalar_mult_into(&r[i], &p[i], k[i], ec, s);
+}
+
+/**
+ * Multiplies the generator of a curve with n scalars, r[i] = k[i] G
+ *
+ * With a fixed-base table each multiplication is a few dozen additions
+ * and runs through scalar_mult_base_into. Without one, the batch goes
+ * through scalar_mult_batch_into, if the backend has multi-buffer
+ * engines.
+ *
+ * r is the array of return variables. They must be initialized.
+ * k is the array of scalar values.
+ * n is the number of multiplications.
+ * ec is the curve whose generator is multiplied.
+ * s is the scratch space for the temporaries.
+ */
+void scalar_mult_base_batch_into(struct Point r[], mpz_t k[], size_t n,
+					const struct Curve *ec,
+					struct Scratch *s)
+{
+	struct Point g[MULTIBUF_MAX_LANES];
+	size_t i, m;
+	int l;
+
+	if (ec->g_table != NULL || get_backend()->engines[0].lanes == 0) {
+		for (i = 0; i < n; i++)
+			scalar_mult_base_into(&r[i], k[i], ec, s);
+		return;
+	}
 
-	return res;
+	for (l = 0; l < MULTIBUF_MAX_LANES; l++) {
+		init_point(&g[l]);
+		mpz_set(g[l].x, ec->G.x);
+		mpz_set(g[l].y, ec->G.y);
+	}
+	for (i = 0; i < n; i += m) {
+		m = n - i < MULTIBUF_MAX_LANES ? n - i : MULTIBUF_MAX_LANES;
+		scalar_mult_batch_into(&r[i], g, &k[i], m, ec, s);
+	}
+	for (l = 0; l < MULTIBUF_MAX_LANES; l++)
+		clear_point(&g[l]);
 }
 
 /**
- * Returns the secp192k1 curve. The curve parameters are obtained
- * from the SEC 2 document available at http://www.secg.org/sec2-v2.pdf
+ * Sets up the GLV endomorphism of a curve
+ *
+ * beta is the hex string of the cube root of unity in the field, or
+ * NULL if the curve has no endomorphism. The remaining arguments are
+ * the hex strings of the lattice basis, see struct Endomorphism.
  */
-struct Curve *get_secp192k1_curve(void)
+static void curve_init_glv(struct Curve *ec, const char *beta,
+				const char *a1, const char *b1,
+				const char *a2, const char *b2)
+{
+	struct Endomorphism *glv = &ec->glv;
+	mpz_t tmp;
+
+	glv->enabled = beta != NULL;
+	if (!glv->enabled) {
+		memset(glv->beta, 0, sizeof(fe_t));
+		mpz_init(glv->a1);
+		mpz_init(glv->b1);
+		mpz_init(glv->a2);
+		mpz_init(glv->b2);
+		return;
+	}
+
+	str_to_scalar(tmp, beta);
+	fe_set_mpz(glv->beta, tmp, &ec->field);
+	mpz_clear(tmp);
+	str_to_scalar(glv->a1, a1);
+	str_to_scalar(glv->b1, b1);
+	str_to_scalar(glv->a2, a2);
+	str_to_scalar(glv->b2, b2);
+}
+
+/**
+ * Sets up the fixed-limb arithmetic of a curve whose parameters
+ * have been set, choosing the point formulas from the value of a
+ */
+static void curve_init_arithmetic(struct Curve *ec)
+{
+	mpz_t tmp;
+	mpz_init(tmp);
+
+	field_init(&ec->field, ec->prime, FIELD_MONTGOMERY);
+	fe_set_mpz(ec->fe_a, ec->a, &ec->field);
+
+	mpz_add_ui(tmp, ec->a, 3UL);
+	if (mpz_sgn(ec->a) == 0)
+		ec->double_point = jacobian_double_a0;
+	else if (mpz_cmp(tmp, ec->prime) == 0)
+		ec->double_point = jacobian_double_a3;
+	else
+		ec->double_point = jacobian_double_generic;
+	ec->window = SCALAR_MULT_WINDOW;
+
+	mpz_clear(tmp);
+}
+
+/**
+ * Sets up the constants of the multi-buffer engines once per curve, so
+ * that batches start without any GMP arithmetic
+ */
+static void curve_init_multibuf(struct Curve *ec)
+{
+#if FIELD_DISPATCH
+	memset(&ec->mb_x4, 0, sizeof(ec->mb_x4));
+	memset(&ec->mb_x8, 0, sizeof(ec->mb_x8));
+#endif
+#if MULTIBUF_AVX2
+	mb_field_init(&ec->mb_x4, FE4_LIMBS, FE4_BITS, ec);
+#endif
+#if MULTIBUF_IFMA
+	mb_field_init(&ec->mb_x8, FE8_LIMBS, FE8_BITS, ec);
+#endif
+}
+
+/**
+ * Initializes a caller-owned instance of the secp192k1 curve. The curve
+ * parameters are obtained from the SEC 2 document available at
+ * http://www.secg.org/sec2-v2.pdf
+ *
+ * The instance must be released with clear_curve.
+ */
+void init_secp192k1_curve(struct Curve *ec)
 {
-	struct Curve *ec = malloc(sizeof(*ec));
 	str_to_scalar(ec->prime, "ffffffffffffffff"
 				"ffffffffffffffff"
 				"fffffffeffffee37");
 	mpz_init_set_ui(ec->a, 0UL);
 	mpz_init_set_ui(ec->b, 3UL);
-	ec->G = str_to_point("04"
-			"db4ff10ec057e9ae26b07d0280b7f4341da5d1b1eae06c7d"
-			"9b2f2f6d9c5628a7844163d015be86344082aa88d95e2f9d");
+	str_to_scalar(ec->G.x, "db4ff10ec057e9ae26b07d0280b7f4341da5d1b1eae06c7d");
+	str_to_scalar(ec->G.y, "9b2f2f6d9c5628a7844163d015be86344082aa88d95e2f9d");
 	str_to_scalar(ec->order, "ffffffffffffffff"
 				"fffffffe26f2fc17"
 				"0f69466a74defd8d");
 	mpz_init_set_ui(ec->cofactor, 1UL);
 	ec->key_size_bits = 160;
-	return ec;
-};
+	curve_init_arithmetic(ec);
+	curve_init_multibuf(ec);
+	curve_init_glv(ec, "bb85691939b869c1d087f601554b96b80cb4f55b35f433c2",
+			"71169be7330b3038edb025f1",
+			"-b3fb3400dec5c4adceb8655c",
+			"12511cfe811d0f4e6bc688b4d",
+			"71169be7330b3038edb025f1");
+	curve_init_base(ec);
+}
 
 /**
- * Returns the secp192r1 curve. The curve parameters are obtained
- * from the SEC 2 document available at http://www.secg.org/sec2-v2.pdf
+ * Initializes a caller-owned instance of the secp192r1 curve. The curve
+ * parameters are obtained from the SEC 2 document available at
+ * http://www.secg.org/sec2-v2.pdf
+ *
+ * The instance must be released with clear_curve.
  */
-struct Curve *get_secp192r1_curve(void)
+void init_secp192r1_curve(struct Curve *ec)
 {
-	struct Curve *ec = malloc(sizeof(*ec));
 	str_to_scalar(ec->prime, "FFFFFFFFFFFFFFFF"
 				"FFFFFFFFFFFFFFFE"
 				"FFFFFFFFFFFFFFFF");
@@ -225,16 +1551,98 @@ struct Curve *get_secp192r1_curve(void)
 	mpz_init_set_str(ec->b, "64210519E59C80E7"
 				"0FA7E9AB72243049"
 				"FEB8DEECC146B9B1", 16);
-	ec->G = str_to_point("04"
-			"188DA80EB03090F67CBF20EB43A18800F4FF0AFD82FF1012"
-			"07192B95FFC8DA78631011ED6B24CDD573F977A11E794811");
+	str_to_scalar(ec->G.x, "188DA80EB03090F67CBF20EB43A18800F4FF0AFD82FF1012");
+	str_to_scalar(ec->G.y, "07192B95FFC8DA78631011ED6B24CDD573F977A11E794811");
 	str_to_scalar(ec->order, "FFFFFFFFFFFFFFFF"
 				"FFFFFFFF99DEF836"
 				"146BC9B1B4D22831");
 	mpz_init_set_ui(ec->cofactor, 1UL);
 	ec->key_size_bits = 160;
+	curve_init_arithmetic(ec);
+	curve_init_multibuf(ec);
+	curve_init_glv(ec, NULL, NULL, NULL, NULL, NULL);
+	curve_init_base(ec);
+}
+
+/**
+ * Returns the secp192k1 curve
+ *
+ * This creates a new instance, which must be freed with free_curve.
+ * Key pairs use the shared instance returned by get_curve instead.
+ */
+struct Curve *get_secp192k1_curve(void)
+{
+	struct Curve *ec = malloc(sizeof(*ec));
+	init_secp192k1_curve(ec);
 	return ec;
-};
+}
+
+/**
+ * Returns the secp192r1 curve
+ *
+ * This creates a new instance, which must be freed with free_curve.
+ * Key pairs use the shared instance returned by get_curve instead.
+ */
+struct Curve *get_secp192r1_curve(void)
+{
+	struct Curve *ec = malloc(sizeof(*ec));
+	init_secp192r1_curve(ec);
+	return ec;
+}
+
+#ifdef CURVE_TABLES
+#include "curve_tables.h"
+
+/**
+ * Returns the shared instance of a curve
+ *
+ * The curves are generated at build time by utils/gen_tables.c and are
+ * read-only data, so there is no setup at runtime. They can be used
+ * from any number of threads and must not be freed.
+ */
+const struct Curve *get_curve(enum Curves curve)
+{
+	switch (curve) {
+	case SECP_192_R1:
+		return &secp192r1_curve;
+	case SECP_192_K1:
+	default:
+		return &secp192k1_curve;
+	}
+}
+#else
+/**
+ * The curves shared by all key pairs, created once by init_curves
+ */
+static struct Curve *curves[SECP_192_R1 + 1];
+static pthread_once_t curves_once = PTHREAD_ONCE_INIT;
+
+static void init_curves(void)
+{
+	curves[SECP_192_K1] = get_secp192k1_curve();
+	curves[SECP_192_R1] = get_secp192r1_curve();
+}
+
+/**
+ * Returns the shared instance of a curve
+ *
+ * The curves are created on the first call, together with their field
+ * constants and fixed-base tables, and are never modified afterwards.
+ * They can be used from any number of threads and must not be freed.
+ */
+const struct Curve *get_curve(enum Curves curve)
+{
+	pthread_once(&curves_once, init_curves);
+
+	switch (curve) {
+	case SECP_192_R1:
+		return curves[SECP_192_R1];
+	case SECP_192_K1:
+	default:
+		return curves[SECP_192_K1];
+	}
+}
+#endif
 
 
 /**
@@ -245,18 +1653,30 @@ struct Curve *get_secp192r1_curve(void)
  *
  * str is the string to convert to struct Point
  *
- * Returns a new Point
+ * Returns a new Point, or NULL if str is not "04" followed by two
+ * hexadecimal numbers of the same length
  */
 struct Point *str_to_point(const char *str)
 {
-	struct Point *point = malloc(sizeof(*point));
-
 	size_t len = strlen(str);
-	int str_end_idx = (len / 2) - 1;
-
-	char *x = malloc(len * sizeof(*x) / 2);
-	char *y = malloc(len * sizeof(*y) / 2);
-	int i;
+	size_t str_end_idx = (len / 2) - 1;
+	struct Point *point;
+	char *x, *y;
+	size_t i;
+	int ok;
+
+	if (len < 4 || len % 2 != 0 || str[0] != '0' || str[1] != '4')
+		return NULL;
+
+	point = malloc(sizeof(*point));
+	x = malloc(len * sizeof(*x) / 2);
+	y = malloc(len * sizeof(*y) / 2);
+	if (point == NULL || x == NULL || y == NULL) {
+		free(point);
+		free(x);
+		free(y);
+		return NULL;
+	}
 	for (i = 0; i < str_end_idx; i++) {
 		x[i] = str[i + 2];
 		y[i] = str[i + 1 + (len / 2)];
@@ -264,11 +1684,16 @@ struct Point *str_to_point(const char *str)
 	x[str_end_idx] = '\0';
 	y[str_end_idx] = '\0';
 
-	str_to_scalar(point->x, x);
-	str_to_scalar(point->y, y);
+	// GMP initializes the integers even when the string is rejected
+	ok = str_to_scalar(point->x, x) == 0;
+	ok = str_to_scalar(point->y, y) == 0 && ok;
 
 	free(x);
 	free(y);
+	if (!ok) {
+		free_point(point);
+		return NULL;
+	}
 	return point;
 }
 
@@ -284,7 +1709,7 @@ struct Point *str_to_point(const char *str)
  * point is the Point to convert to string
  * *len will hold the length of the resulting string
  *
- * Returns a new string
+ * Returns a new string, or NULL if memory ran out
  */
 char *point_to_str(struct Point *point, size_t *len)
 {
@@ -300,6 +1725,11 @@ char *point_to_str(struct Point *point, size_t *len)
 
 
 	int i;
+	if (x == NULL || y == NULL) {
+		free(x);
+		free(y);
+		return NULL;
+	}
 	if (x_len < y_len) {
 		diff = y_len - x_len;
 		res = calloc((3 + x_len + y_len + diff), sizeof(*res));
@@ -315,6 +1745,11 @@ char *point_to_str(struct Point *point, size_t *len)
 	} else {
 		res = calloc((3 + x_len + y_len), sizeof(*res));
 	}
+	if (res == NULL) {
+		free(x);
+		free(y);
+		return NULL;
+	}
 
 	res[0] = '0';
 	res[1] = '4';
@@ -334,16 +1769,7 @@ char *point_to_str(struct Point *point, size_t *len)
  */
 struct KeyPair *gen_key_pair(enum Curves curve)
 {
-	struct Curve *ec;
-
-	switch (curve) {
-	case SECP_192_R1:
-		ec = get_secp192r1_curve();
-		break;
-	case SECP_192_K1:
-	default:
-		ec = get_secp192k1_curve();
-	}
+	const struct Curve *ec = get_curve(curve);
 
 	size_t len;
 	struct KeyPair *key_pair;
@@ -362,7 +1788,7 @@ struct KeyPair *gen_key_pair(enum Curves curve)
 	mpz_init(key_pair->private);
 	mpz_import(key_pair->private, bytes, 1, sizeof(*buf), 1, 0, buf);
 
-	public_key = scalar_mult(ec->G, key_pair->private, ec);
+	public_key = scalar_mult_base(key_pair->private, ec);
 
 	key_pair->public = point_to_str(public_key, &len);
 	key_pair->ec = ec;
@@ -383,20 +1809,200 @@ struct KeyPair *gen_key_pair(enum Curves curve)
  * peer is the public key of the peer
  * *len is the length of the secret
  *
- * Returns a string representing the secret
+ * Returns a string representing the secret, or NULL if peer is not a
+ * point of the curve of key_pair
  */
 char *get_secret(struct KeyPair *key_pair, char *peer, size_t *len)
 {
 	struct Point *peer_point = str_to_point(peer);
-	struct Point *res_point = scalar_mult(peer_point, key_pair->private,
-						key_pair->ec);
-	char *res = point_to_str(res_point, len);
+	struct Point *res_point;
+	char *res;
+
+	if (peer_point == NULL)
+		return NULL;
+	if (!point_is_valid(peer_point, key_pair->ec)) {
+		free_point(peer_point);
+		return NULL;
+	}
+	res_point = scalar_mult(peer_point, key_pair->private, key_pair->ec);
+	res = point_to_str(res_point, len);
 
 	free_point(peer_point);
 	free_point(res_point);
 	return res;
 }
 
+/**
+ * Generates n public-private key pairs using the specified curve
+ *
+ * This is gen_key_pair for many keys at once: the random bytes of all
+ * private keys are read in one go and the public keys are computed with
+ * scalar_mult_base_batch_into.
+ *
+ * keys is the array receiving the n new key pairs, to be freed with
+ * free_key. On failure no key pair is left allocated.
+ * n is the number of key pairs.
+ * curve is the curve of the keys.
+ *
+ * Returns 0 on success, or -1 if memory or random bytes ran out
+ */
+int gen_key_pairs(struct KeyPair *keys[], size_t n, enum Curves curve)
+{
+	const struct Curve *ec;
+	struct Point *public_keys;
+	mpz_t *private_keys;
+	unsigned char *buf;
+	struct Scratch s;
+	size_t i, bytes, len;
+	int failed = 0;
+	FILE *fp;
+
+	if (n == 0)
+		return 0;
+	ec = get_curve(curve);
+	bytes = ec->key_size_bits / 8;
+	public_keys = malloc(n * sizeof(*public_keys));
+	private_keys = malloc(n * sizeof(*private_keys));
+	buf = malloc(n * bytes);
+	fp = fopen("/dev/urandom", "r");
+	if (public_keys == NULL || private_keys == NULL || buf == NULL
+		|| fp == NULL || fread(buf, 1, n * bytes, fp) != n * bytes) {
+		printf("Failed to allocate memory for key pairs");
+		if (fp != NULL)
+			fclose(fp);
+		free(public_keys);
+		free(private_keys);
+		free(buf);
+		return -1;
+	}
+	fclose(fp);
+
+	for (i = 0; i < n; i++) {
+		keys[i] = malloc(sizeof(*keys[i]));
+		if (keys[i] == NULL) {
+			failed = 1;
+			break;
+		}
+		mpz_init(keys[i]->private);
+		mpz_import(keys[i]->private, bytes, 1, 1, 1, 0,
+				&buf[i * bytes]);
+		keys[i]->public = NULL;
+		keys[i]->ec = ec;
+		mpz_init2(private_keys[i], FIELD_BITS);
+		mpz_set(private_keys[i], keys[i]->private);
+		init_point(&public_keys[i]);
+	}
+
+	if (!failed) {
+		init_scratch(&s);
+		scalar_mult_base_batch_into(public_keys, private_keys, n, ec,
+						&s);
+		clear_scratch(&s);
+	}
+
+	for (n = i, i = 0; i < n; i++) {
+		if (!failed)
+			keys[i]->public = point_to_str(&public_keys[i], &len);
+		failed |= keys[i]->public == NULL;
+		mpz_clear(private_keys[i]);
+		clear_point(&public_keys[i]);
+	}
+	if (failed) {
+		printf("Failed to allocate memory for key pairs");
+		for (i = 0; i < n; i++) {
+			free_key(keys[i]);
+			keys[i] = NULL;
+		}
+	}
+
+	free(public_keys);
+	free(private_keys);
+	free(buf);
+	return failed ? -1 : 0;
+}
+
+/**
+ * Calculates the secrets of n key exchanges at once
+ *
+ * This is get_secret for many key pairs, with the scalar
+ * multiplications done by scalar_mult_batch_into. All key pairs must
+ * be on the same curve; if they are not, each secret is computed with
+ * get_secret. Every peer key is checked before any multiplication, and
+ * only the valid ones go into the batch.
+ *
+ * secrets is the array receiving the n new secret strings. secrets[i]
+ * is NULL if peers[i] is not a point of the curve.
+ * lens is the array receiving the lengths of the secrets.
+ * keys is the array of key pairs of self.
+ * peers is the array of the public keys of the peers, peers[i] being
+ * the peer of keys[i].
+ * n is the number of exchanges.
+ */
+void get_secrets(char *secrets[], size_t lens[], struct KeyPair *keys[],
+			char *peers[], size_t n)
+{
+	const struct Curve *ec = n > 0 ? keys[0]->ec : NULL;
+	struct Point *points;
+	mpz_t *private_keys;
+	unsigned char *valid;
+	struct Point *peer;
+	struct Scratch s;
+	size_t i, m;
+
+	for (i = 1; i < n; i++) {
+		if (keys[i]->ec != ec)
+			break;
+	}
+	points = i == n ? malloc(n * sizeof(*points)) : NULL;
+	private_keys = i == n ? malloc(n * sizeof(*private_keys)) : NULL;
+	valid = i == n ? malloc(n) : NULL;
+	if (points == NULL || private_keys == NULL || valid == NULL) {
+		free(points);
+		free(private_keys);
+		free(valid);
+		for (i = 0; i < n; i++)
+			secrets[i] = get_secret(keys[i], peers[i], &lens[i]);
+		return;
+	}
+
+	// The batch holds the exchanges with a valid peer, in order
+	for (i = 0, m = 0; i < n; i++) {
+		peer = str_to_point(peers[i]);
+		valid[i] = peer != NULL && point_is_valid(peer, ec);
+		if (!valid[i]) {
+			if (peer != NULL)
+				free_point(peer);
+			continue;
+		}
+		init_point(&points[m]);
+		mpz_set(points[m].x, peer->x);
+		mpz_set(points[m].y, peer->y);
+		free_point(peer);
+		mpz_init2(private_keys[m], FIELD_BITS);
+		mpz_set(private_keys[m], keys[i]->private);
+		m++;
+	}
+
+	init_scratch(&s);
+	scalar_mult_batch_into(points, points, private_keys, m, ec, &s);
+	clear_scratch(&s);
+
+	for (i = 0, m = 0; i < n; i++) {
+		secrets[i] = NULL;
+		lens[i] = 0;
+		if (!valid[i])
+			continue;
+		secrets[i] = point_to_str(&points[m], &lens[i]);
+		clear_point(&points[m]);
+		mpz_clear(private_keys[m]);
+		m++;
+	}
+
+	free(points);
+	free(private_keys);
+	free(valid);
+}
+
 /**
  * Creates a new Point at (0,0)
  */
@@ -408,6 +2014,28 @@ struct Point *create_point(void)
 	return point;
 }
 
+/**
+ * Initializes a caller-owned Point at (0,0)
+ *
+ * Room for a co-ordinate of the field size is allocated up front, so
+ * the functions writing results into the point never reallocate it.
+ * The point must be released with clear_point.
+ */
+void init_point(struct Point *point)
+{
+	mpz_init2(point->x, FIELD_BITS);
+	mpz_init2(point->y, FIELD_BITS);
+}
+
+/**
+ * Releases the memory of a Point initialized with init_point
+ */
+void clear_point(struct Point *point)
+{
+	mpz_clear(point->x);
+	mpz_clear(point->y);
+}
+
 /**
  * Creates a copy of an exitsting point
  */
@@ -436,24 +2064,38 @@ void free_key(struct KeyPair *key)
 {
 	mpz_clear(key->private);
 	free(key->public);
-	free_curve(key->ec);
 	free(key);
 }
 
 /**
- * Free the memory occupied by the curve
+ * Releases the memory of a curve initialized with init_secp192k1_curve
+ * or init_secp192r1_curve
  */
-void free_curve(struct Curve *ec)
+void clear_curve(struct Curve *ec)
 {
 	mpz_clear(ec->prime);
 	mpz_clear(ec->a);
 	mpz_clear(ec->b);
-	free_point(ec->G);
+	clear_point(&ec->G);
 	mpz_clear(ec->order);
 	mpz_clear(ec->cofactor);
+	mpz_clear(ec->glv.a1);
+	mpz_clear(ec->glv.b1);
+	mpz_clear(ec->glv.a2);
+	mpz_clear(ec->glv.b2);
+	free((void *)ec->g_table);
+}
+
+/**
+ * Free the memory occupied by the curve
+ */
+void free_curve(struct Curve *ec)
+{
+	clear_curve(ec);
 	free(ec);
 }
 
+#ifndef ECDH_NO_MAIN
 /**
  * Main function
  *
@@ -503,3 +2145,4 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
+#endif
@@ -2,7 +2,13 @@
 #ifndef __ecdh_header
 #define __ecdh_header
 
+#ifdef ECDH_NO_GMP
+#include "fixedmpz.h"
+#else
 #include <gmp.h>
+#endif
+
+#include "primefield.h"
 
 /**
  * Struct to represent a point in the prime field
@@ -14,6 +20,58 @@ struct Point {
     mpz_t y;
 };
 
+struct JacobianPoint;
+struct AffinePoint;
+
+/**
+ * Struct holding the GLV endomorphism of a curve, if it has one
+ *
+ * On curves with a = 0 and p = 1 mod 3, (x, y) -> (beta x, y) maps
+ * every point P to lambda P for a cube root of unity lambda modulo the
+ * order. A scalar k is split into k1 + k2 lambda with k1 and k2 of half
+ * the size, so kP = k1 P + k2 (beta x, y) needs half the doublings.
+ * See "Faster Point Multiplication on Elliptic Curves with Efficient
+ * Endomorphisms" by Gallant, Lambert and Vanstone for details.
+ *
+ * enabled is set if the curve has the endomorphism.
+ * beta is the cube root of unity in the representation used by field.
+ * a1, b1, a2 and b2 are a short basis of the lattice of (x, y) with
+ * x + y lambda = 0 modulo the order, used to split the scalar.
+ */
+struct Endomorphism {
+    int enabled;
+    fe_t beta;
+    mpz_t a1;
+    mpz_t b1;
+    mpz_t a2;
+    mpz_t b2;
+};
+
+/**
+ * Largest number of limbs of a field element of the multi-buffer
+ * engines, see multibuf.h
+ */
+#define MULTIBUF_MAX_LIMBS 8
+
+/**
+ * Struct holding the constants of a curve for a multi-buffer engine
+ *
+ * These are the members of struct Fe4Field or struct Fe8Field in
+ * multibuf.h for a single lane, in limbs of the engine's width. They
+ * are computed once per curve, and broadcast to the lanes at the start
+ * of each batch.
+ */
+struct MultiBufField {
+    uint64_t p[MULTIBUF_MAX_LIMBS];
+    uint64_t q[MULTIBUF_MAX_LIMBS];
+    uint64_t r2[MULTIBUF_MAX_LIMBS];
+    uint64_t one[MULTIBUF_MAX_LIMBS];
+    uint64_t a[MULTIBUF_MAX_LIMBS];
+    uint64_t b3[MULTIBUF_MAX_LIMBS];
+    uint64_t n0;
+    int a_zero;
+};
+
 /**
  * Struct to represent an ellitic curve in a prime field
  * The curves are represented by the equation y^2 = x^3 + a*x + b
@@ -24,6 +82,17 @@ struct Point {
  * The key_size_bits is an implementation detail and can be
  * public as well.
  *
+ * The members used by the point arithmetic come first, so that the hot
+ * ones share cache lines, followed by the GMP parameters of the curve.
+ *
+ * field is the fixed-limb arithmetic context for the prime.
+ * fe_a is the curve parameter a in the representation used by field.
+ * double_point is the point doubling formula for the curve, chosen from
+ * the value of a when the curve is created.
+ * window is the width of the wNAF window used by scalar_mult.
+ * g_table is the fixed-base table of multiples of G used by
+ * scalar_mult_base, and g_windows is its number of windows.
+ * glv is the endomorphism used to speed up scalar_mult, if any.
  * prime is the prime number defining the field.
  * a is the curve parameter a in the equation above.
  * b is the curve parameter b in the equation above.
@@ -31,15 +100,29 @@ struct Point {
  * order is the order of the curve.
  * cofactor is the cofactor of the curve.
  * key_size_bits is the size in bits for the private keys.
+ * mb_x4 and mb_x8 are the constants of the AVX2 and the AVX-512 IFMA
+ * multi-buffer engines, in builds with runtime dispatch.
  */
 struct Curve {
+    struct Field field;
+    fe_t fe_a;
+    void (*double_point)(struct JacobianPoint *r,
+                const struct JacobianPoint *p, const struct Curve *ec);
+    int window;
+    const struct AffinePoint *g_table;
+    int g_windows;
+    struct Endomorphism glv;
     mpz_t prime;
     mpz_t a;
     mpz_t b;
-    struct Point *G;
+    struct Point G;
     mpz_t order;
     mpz_t cofactor;
     unsigned int key_size_bits;
+#if FIELD_DISPATCH
+    struct MultiBufField mb_x4;
+    struct MultiBufField mb_x8;
+#endif
 };
 
 /**
@@ -56,31 +139,59 @@ enum Curves {
  *
  * private is the private key
  * public is the public key as a hexadecimal string
- * ec is the elliptic curve on which the key works
+ * ec is the elliptic curve on which the key works, shared by all keys on
+ * the curve, see get_curve
  */
 struct KeyPair {
     mpz_t private;
     char *public;
-    struct Curve *ec;
+    const struct Curve *ec;
 };
 
 /* Functions for struct KeyPair */
 struct KeyPair *gen_key_pair(enum Curves curve);
+int gen_key_pairs(struct KeyPair *keys[], size_t n, enum Curves curve);
+char *get_secret(struct KeyPair *key_pair, char *peer, size_t *len);
+void get_secrets(char *secrets[], size_t lens[], struct KeyPair *keys[],
+                        char *peers[], size_t n);
 void free_key(struct KeyPair *key);
 
 /* Functions for point arithmetic and conversions */
-struct Point *point_add(struct Point *j, struct Point *k, struct Curve *ec);
-struct Point *point_double(struct Point *p, struct Curve *ec);
-struct Point *scalar_mult(struct Point *p, mpz_t k, struct Curve *ec);
+struct Point *point_add(struct Point *j, struct Point *k,
+                        const struct Curve *ec);
+struct Point *point_double(struct Point *p, const struct Curve *ec);
+struct Point *scalar_mult(struct Point *p, mpz_t k, const struct Curve *ec);
+struct Point *scalar_mult_base(mpz_t k, const struct Curve *ec);
+int point_add_into(struct Point *r, struct Point *p, struct Point *q,
+                        const struct Curve *ec);
+int point_double_into(struct Point *r, struct Point *p,
+                        const struct Curve *ec);
+int scalar_mult_into(struct Point *r, struct Point *p, mpz_t k,
+                        const struct Curve *ec, struct Scratch *s);
+void scalar_mult_base_into(struct Point *r, mpz_t k, const struct Curve *ec,
+                        struct Scratch *s);
+void scalar_mult_batch_into(struct Point r[], struct Point p[], mpz_t k[],
+                        size_t n, const struct Curve *ec, struct Scratch *s);
+void scalar_mult_base_batch_into(struct Point r[], mpz_t k[], size_t n,
+                        const struct Curve *ec, struct Scratch *s);
 struct Point *str_to_point(const char *str);
 char *point_to_str(struct Point *point, size_t *len);
 struct Point *create_point(void);
 void free_point(struct Point *point);
 struct Point *copy_point(struct Point *point);
+void init_point(struct Point *point);
+void clear_point(struct Point *point);
 
 /* Functions for struct Curve */
 struct Curve *get_secp192k1_curve(void);
 struct Curve *get_secp192r1_curve(void);
+void init_secp192k1_curve(struct Curve *ec);
+void init_secp192r1_curve(struct Curve *ec);
+void clear_curve(struct Curve *ec);
+const struct Curve *get_curve(enum Curves curve);
 void free_curve(struct Curve *curve);
 
+/* Functions for struct Backend */
+const struct Backend *get_backend(void);
+
 #endif
@@ -0,0 +1,583 @@
+//by Aashish Dugar
+#ifndef __fixedmpz_header
+#define __fixedmpz_header
+
+/**
+ * Constant-size replacement for the part of the GMP integer API used by
+ * primefield.h and ecdh.c
+ *
+ * Selected instead of <gmp.h> by building with -DECDH_NO_GMP, for
+ * targets without libgmp or without a heap. Every mpz_t holds its limbs
+ * inline, so integers live on the stack or in static storage, and
+ * mpz_init and mpz_clear do nothing. The functions follow the GMP
+ * semantics for the arguments used in this code, with these limits:
+ *
+ * - Integers hold at most FIXEDMPZ_BITS bits. Results that do
+ *   not fit are truncated, so callers must keep to the sizes needed by
+ *   the field arithmetic: double-width products and 2^(3 * 192) for
+ *   the Montgomery constants.
+ * - mpz_tstbit only supports non-negative integers.
+ * - Strings are read and written in base 16 only, and mpz_get_str
+ *   needs a caller-provided buffer.
+ * - Division is binary long division. It is only used for the scalar
+ *   reductions and setup, never per field operation.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef FIXEDMPZ_BITS
+#define FIXEDMPZ_BITS 640
+#endif
+
+/**
+ * Limbs are 64 bits wide where the compiler has 128-bit integers for
+ * their products, and 32 bits wide otherwise or when the field
+ * arithmetic is built with 32-bit limbs (see FIELD_LIMB_BITS)
+ */
+#if (defined(FIELD_LIMB_BITS) && FIELD_LIMB_BITS == 32) \
+	|| !defined(__SIZEOF_INT128__)
+#define GMP_NUMB_BITS 32
+typedef uint32_t mp_limb_t;
+typedef uint64_t fz_dlimb_t;
+#else
+#define GMP_NUMB_BITS 64
+typedef uint64_t mp_limb_t;
+typedef unsigned __int128 fz_dlimb_t;
+#endif
+
+#define FIXEDMPZ_LIMBS (FIXEDMPZ_BITS / GMP_NUMB_BITS)
+#define FIXEDMPZ_LIMB_BYTES (GMP_NUMB_BITS / 8)
+#define FIXEDMPZ_LIMB_DIGITS (GMP_NUMB_BITS / 4)
+typedef unsigned long mp_bitcnt_t;
+
+/**
+ * Struct holding a fixed-size integer
+ *
+ * _mp_size is the number of limbs in use, negated for negative numbers,
+ * as in GMP. _mp_d holds the magnitude, least significant limb first.
+ * Limbs at and above the size are always zero.
+ */
+typedef struct {
+	int _mp_size;
+	mp_limb_t _mp_d[FIXEDMPZ_LIMBS];
+} __mpz_struct;
+
+typedef __mpz_struct mpz_t[1];
+typedef __mpz_struct *mpz_ptr;
+typedef const __mpz_struct *mpz_srcptr;
+
+/**
+ * Returns the number of limbs in use of the magnitude r[0..n)
+ */
+static int fz_len(const mp_limb_t *r, int n)
+{
+	while (n > 0 && r[n - 1] == 0)
+		n--;
+	return n;
+}
+
+/**
+ * Sets the integer r to the magnitude d with the given sign
+ */
+static void fz_finish(mpz_ptr r, const mp_limb_t *d, int negative)
+{
+	int n;
+
+	if (d != r->_mp_d)
+		memcpy(r->_mp_d, d, sizeof(r->_mp_d));
+	n = fz_len(r->_mp_d, FIXEDMPZ_LIMBS);
+	r->_mp_size = negative ? -n : n;
+}
+
+/**
+ * Compares the magnitudes of a and b
+ */
+static int fz_cmp_abs(const mp_limb_t *a, const mp_limb_t *b)
+{
+	int i;
+
+	for (i = FIXEDMPZ_LIMBS - 1; i >= 0; i--)
+		if (a[i] != b[i])
+			return a[i] > b[i] ? 1 : -1;
+	return 0;
+}
+
+/**
+ * Computes the magnitude r = a + b, truncated to FIXEDMPZ_LIMBS limbs
+ */
+static void fz_add_abs(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b)
+{
+	fz_dlimb_t acc = 0;
+	int i;
+
+	for (i = 0; i < FIXEDMPZ_LIMBS; i++) {
+		acc += (fz_dlimb_t)a[i] + b[i];
+		r[i] = (mp_limb_t)acc;
+		acc >>= GMP_NUMB_BITS;
+	}
+}
+
+/**
+ * Computes the magnitude r = a - b for a >= b
+ */
+static void fz_sub_abs(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b)
+{
+	mp_limb_t borrow = 0, t;
+	int i;
+
+	for (i = 0; i < FIXEDMPZ_LIMBS; i++) {
+		t = a[i] - b[i] - borrow;
+		borrow = (a[i] < b[i]) || (a[i] == b[i] && borrow);
+		r[i] = t;
+	}
+}
+
+void mpz_init(mpz_t r)
+{
+	memset(r, 0, sizeof(mpz_t));
+}
+
+void mpz_init2(mpz_t r, mp_bitcnt_t bits)
+{
+	(void)bits;
+	mpz_init(r);
+}
+
+void mpz_clear(mpz_t r)
+{
+	(void)r;
+}
+
+void mpz_set(mpz_t r, const mpz_t a)
+{
+	if (r != a)
+		memcpy(r, a, sizeof(mpz_t));
+}
+
+void mpz_set_ui(mpz_t r, unsigned long a)
+{
+	unsigned long long x = a;
+	int i;
+
+	mpz_init(r);
+	for (i = 0; i < FIXEDMPZ_LIMBS && x != 0; i++) {
+		r->_mp_d[i] = (mp_limb_t)x;
+		x = x >> 1 >> (GMP_NUMB_BITS - 1);
+	}
+	r->_mp_size = i;
+}
+
+void mpz_init_set_ui(mpz_t r, unsigned long a)
+{
+	mpz_set_ui(r, a);
+}
+
+void mpz_swap(mpz_t a, mpz_t b)
+{
+	mpz_t t;
+
+	memcpy(t, a, sizeof(mpz_t));
+	memcpy(a, b, sizeof(mpz_t));
+	memcpy(b, t, sizeof(mpz_t));
+}
+
+/**
+ * Sets r to the hexadecimal number in str, with an optional leading
+ * minus sign
+ *
+ * Returns 0 on success, or -1 if str is not a number in base 16 or
+ * does not fit
+ */
+int mpz_init_set_str(mpz_t r, const char *str, int base)
+{
+	int negative = 0;
+	size_t len, i;
+	int digit;
+
+	mpz_init(r);
+	if (base != 16)
+		return -1;
+	if (*str == '-') {
+		negative = 1;
+		str++;
+	}
+	len = strlen(str);
+	if (len == 0 || len > FIXEDMPZ_BITS / 4)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		char c = str[len - 1 - i];
+
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
+		else
+			return -1;
+		r->_mp_d[i / FIXEDMPZ_LIMB_DIGITS] |=
+			(mp_limb_t)digit << (4 * (i % FIXEDMPZ_LIMB_DIGITS));
+	}
+	fz_finish(r, r->_mp_d, negative);
+	return 0;
+}
+
+int mpz_sgn(const mpz_t a)
+{
+	return a->_mp_size < 0 ? -1 : a->_mp_size > 0;
+}
+
+size_t mpz_size(const mpz_t a)
+{
+	return a->_mp_size < 0 ? -a->_mp_size : a->_mp_size;
+}
+
+int mpz_cmp(const mpz_t a, const mpz_t b)
+{
+	int c;
+
+	if (mpz_sgn(a) != mpz_sgn(b))
+		return mpz_sgn(a) < mpz_sgn(b) ? -1 : 1;
+	c = fz_cmp_abs(a->_mp_d, b->_mp_d);
+	return mpz_sgn(a) < 0 ? -c : c;
+}
+
+int mpz_cmp_ui(const mpz_t a, unsigned long b)
+{
+	mpz_t t;
+
+	mpz_set_ui(t, b);
+	return mpz_cmp(a, t);
+}
+
+/**
+ * Returns the number of digits of |a| in base 2 or 16, which is 1 for
+ * zero
+ */
+size_t mpz_sizeinbase(const mpz_t a, int base)
+{
+	size_t n = mpz_size(a);
+	size_t bits;
+
+	if (n == 0)
+		return 1;
+	bits = GMP_NUMB_BITS * n - __builtin_clzll(a->_mp_d[n - 1])
+		+ (64 - GMP_NUMB_BITS);
+	return base == 16 ? (bits + 3) / 4 : bits;
+}
+
+int mpz_tstbit(const mpz_t a, mp_bitcnt_t bit)
+{
+	if (bit >= FIXEDMPZ_BITS)
+		return 0;
+	return (a->_mp_d[bit / GMP_NUMB_BITS] >> (bit % GMP_NUMB_BITS)) & 1;
+}
+
+void mpz_setbit(mpz_t r, mp_bitcnt_t bit)
+{
+	if (bit >= FIXEDMPZ_BITS)
+		return;
+	r->_mp_d[bit / GMP_NUMB_BITS] |= (mp_limb_t)1 << (bit % GMP_NUMB_BITS);
+	fz_finish(r, r->_mp_d, r->_mp_size < 0);
+}
+
+void mpz_neg(mpz_t r, const mpz_t a)
+{
+	mpz_set(r, a);
+	r->_mp_size = -r->_mp_size;
+}
+
+void mpz_abs(mpz_t r, const mpz_t a)
+{
+	mpz_set(r, a);
+	if (r->_mp_size < 0)
+		r->_mp_size = -r->_mp_size;
+}
+
+/**
+ * Computes r = a + b, where b is negated if negate_b is set
+ */
+static void fz_add(mpz_ptr r, mpz_srcptr a, mpz_srcptr b, int negate_b)
+{
+	mp_limb_t d[FIXEDMPZ_LIMBS];
+	int sa = mpz_sgn(a) < 0;
+	int sb = (mpz_sgn(b) < 0) ^ negate_b;
+
+	if (mpz_sgn(b) == 0) {
+		mpz_set(r, a);
+		return;
+	}
+	if (sa == sb) {
+		fz_add_abs(d, a->_mp_d, b->_mp_d);
+		fz_finish(r, d, sa);
+	} else if (fz_cmp_abs(a->_mp_d, b->_mp_d) >= 0) {
+		fz_sub_abs(d, a->_mp_d, b->_mp_d);
+		fz_finish(r, d, sa);
+	} else {
+		fz_sub_abs(d, b->_mp_d, a->_mp_d);
+		fz_finish(r, d, sb);
+	}
+}
+
+void mpz_add(mpz_t r, const mpz_t a, const mpz_t b)
+{
+	fz_add(r, a, b, 0);
+}
+
+void mpz_sub(mpz_t r, const mpz_t a, const mpz_t b)
+{
+	fz_add(r, a, b, 1);
+}
+
+void mpz_add_ui(mpz_t r, const mpz_t a, unsigned long b)
+{
+	mpz_t t;
+
+	mpz_set_ui(t, b);
+	fz_add(r, a, t, 0);
+}
+
+/**
+ * Computes r = ab, truncated to FIXEDMPZ_LIMBS limbs
+ */
+void mpz_mul(mpz_t r, const mpz_t a, const mpz_t b)
+{
+	mp_limb_t d[FIXEDMPZ_LIMBS] = { 0 };
+	fz_dlimb_t acc;
+	int na = mpz_size(a), nb = mpz_size(b);
+	int i, j;
+
+	for (i = 0; i < na; i++) {
+		acc = 0;
+		for (j = 0; j < nb && i + j < FIXEDMPZ_LIMBS; j++) {
+			acc += (fz_dlimb_t)a->_mp_d[i] * b->_mp_d[j]
+				+ d[i + j];
+			d[i + j] = (mp_limb_t)acc;
+			acc >>= GMP_NUMB_BITS;
+		}
+		if (i + j < FIXEDMPZ_LIMBS)
+			d[i + j] = (mp_limb_t)acc;
+	}
+	fz_finish(r, d, (mpz_sgn(a) < 0) ^ (mpz_sgn(b) < 0));
+}
+
+void mpz_addmul(mpz_t r, const mpz_t a, const mpz_t b)
+{
+	mpz_t t;
+
+	mpz_mul(t, a, b);
+	mpz_add(r, r, t);
+}
+
+void mpz_submul(mpz_t r, const mpz_t a, const mpz_t b)
+{
+	mpz_t t;
+
+	mpz_mul(t, a, b);
+	mpz_sub(r, r, t);
+}
+
+/**
+ * Computes r = a 2^bits, truncated to FIXEDMPZ_LIMBS limbs
+ */
+void mpz_mul_2exp(mpz_t r, const mpz_t a, mp_bitcnt_t bits)
+{
+	mp_limb_t d[FIXEDMPZ_LIMBS] = { 0 };
+	int limbs = bits / GMP_NUMB_BITS, shift = bits % GMP_NUMB_BITS;
+	int i;
+
+	for (i = FIXEDMPZ_LIMBS - 1; i >= limbs; i--) {
+		d[i] = a->_mp_d[i - limbs] << shift;
+		if (shift != 0 && i - limbs > 0)
+			d[i] |= a->_mp_d[i - limbs - 1]
+				>> (GMP_NUMB_BITS - shift);
+	}
+	fz_finish(r, d, mpz_sgn(a) < 0);
+}
+
+/**
+ * Divides the magnitudes, q = |n| / |d| and r = |n| mod |d|, with
+ * binary long division
+ *
+ * Either of q and r may be NULL. d must not be zero.
+ */
+static void fz_divmod_abs(mp_limb_t *q, mp_limb_t *r, mpz_srcptr n,
+				mpz_srcptr d)
+{
+	mp_limb_t rem[FIXEDMPZ_LIMBS] = { 0 };
+	mp_limb_t quo[FIXEDMPZ_LIMBS] = { 0 };
+	int len = mpz_size(d) + 1;
+	long bit;
+	int i, top;
+
+	if (len > FIXEDMPZ_LIMBS)
+		len = FIXEDMPZ_LIMBS;
+
+	for (bit = (long)mpz_sizeinbase(n, 2) - 1; bit >= 0; bit--) {
+		// rem = 2 rem + bit, which stays below 2d
+		top = rem[len - 1] >> (GMP_NUMB_BITS - 1);
+		for (i = len - 1; i > 0; i--)
+			rem[i] = (rem[i] << 1)
+				| (rem[i - 1] >> (GMP_NUMB_BITS - 1));
+		rem[0] = (rem[0] << 1) | mpz_tstbit(n, bit);
+
+		if (top || fz_cmp_abs(rem, d->_mp_d) >= 0) {
+			fz_sub_abs(rem, rem, d->_mp_d);
+			quo[bit / GMP_NUMB_BITS] |=
+				(mp_limb_t)1 << (bit % GMP_NUMB_BITS);
+		}
+	}
+	if (q != NULL)
+		memcpy(q, quo, sizeof(quo));
+	if (r != NULL)
+		memcpy(r, rem, sizeof(rem));
+}
+
+/**
+ * Computes the remainder of n / d rounded towards zero, which has the
+ * sign of n
+ */
+void mpz_tdiv_r(mpz_t r, const mpz_t n, const mpz_t d)
+{
+	mp_limb_t rem[FIXEDMPZ_LIMBS];
+
+	fz_divmod_abs(NULL, rem, n, d);
+	fz_finish(r, rem, mpz_sgn(n) < 0);
+}
+
+/**
+ * Computes n mod d, which is never negative
+ */
+void mpz_mod(mpz_t r, const mpz_t n, const mpz_t d)
+{
+	mpz_t abs_d;
+
+	mpz_abs(abs_d, d);
+	mpz_tdiv_r(r, n, abs_d);
+	if (mpz_sgn(r) < 0)
+		mpz_add(r, r, abs_d);
+}
+
+/**
+ * Computes the quotient of n / d rounded towards minus infinity
+ */
+void mpz_fdiv_q(mpz_t q, const mpz_t n, const mpz_t d)
+{
+	mp_limb_t quo[FIXEDMPZ_LIMBS], rem[FIXEDMPZ_LIMBS];
+	int negative = (mpz_sgn(n) < 0) ^ (mpz_sgn(d) < 0);
+	mpz_t one;
+
+	fz_divmod_abs(quo, rem, n, d);
+	fz_finish(q, quo, negative);
+	if (negative && fz_len(rem, FIXEDMPZ_LIMBS) != 0) {
+		mpz_set_ui(one, 1UL);
+		mpz_sub(q, q, one);
+	}
+}
+
+/**
+ * Writes |a| as count words of size bytes, see mpz_export in the GMP
+ * manual. nails must be 0.
+ */
+void *mpz_export(void *out, size_t *countp, int order, size_t size,
+			int endian, size_t nails, const mpz_t a)
+{
+	unsigned char *bytes = out;
+	size_t count, i, j, byte;
+
+	(void)nails;
+	count = (mpz_sizeinbase(a, 2) + 8 * size - 1) / (8 * size);
+	if (mpz_sgn(a) == 0)
+		count = 0;
+	if (endian == 0)
+		endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? 1 : -1;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < size; j++) {
+			byte = (order < 0 ? i : count - 1 - i) * size
+				+ (endian < 0 ? j : size - 1 - j);
+			bytes[i * size + j] = byte < FIXEDMPZ_BITS / 8
+				? a->_mp_d[byte / FIXEDMPZ_LIMB_BYTES]
+					>> (8 * (byte % FIXEDMPZ_LIMB_BYTES))
+				: 0;
+		}
+	}
+	if (countp != NULL)
+		*countp = count;
+	return out;
+}
+
+/**
+ * Sets r from count words of size bytes, see mpz_import in the GMP
+ * manual. nails must be 0.
+ */
+void mpz_import(mpz_t r, size_t count, int order, size_t size, int endian,
+			size_t nails, const void *in)
+{
+	const unsigned char *bytes = in;
+	size_t i, j, byte;
+
+	(void)nails;
+	if (endian == 0)
+		endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? 1 : -1;
+
+	mpz_init(r);
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < size; j++) {
+			byte = (order < 0 ? i : count - 1 - i) * size
+				+ (endian < 0 ? j : size - 1 - j);
+			if (byte < FIXEDMPZ_BITS / 8)
+				r->_mp_d[byte / FIXEDMPZ_LIMB_BYTES] |=
+					(mp_limb_t)bytes[i * size + j]
+					<< (8 * (byte % FIXEDMPZ_LIMB_BYTES));
+		}
+	}
+	fz_finish(r, r->_mp_d, 0);
+}
+
+/**
+ * Writes a in base 16 into str, which must have room for
+ * mpz_sizeinbase(a, 16) + 2 characters
+ *
+ * Returns str, or NULL if str is NULL or base is not 16
+ */
+char *mpz_get_str(char *str, int base, const mpz_t a)
+{
+	const char *digits = "0123456789abcdef";
+	size_t n, i;
+	char *p = str;
+
+	if (str == NULL || base != 16)
+		return NULL;
+	if (mpz_sgn(a) < 0)
+		*p++ = '-';
+	n = mpz_sizeinbase(a, 16);
+	for (i = 0; i < n; i++)
+		p[n - 1 - i] = digits[(a->_mp_d[i / FIXEDMPZ_LIMB_DIGITS]
+				>> (4 * (i % FIXEDMPZ_LIMB_DIGITS))) & 15];
+	p[n] = '\0';
+	return str;
+}
+
+const mp_limb_t *mpz_limbs_read(const mpz_t a)
+{
+	return a->_mp_d;
+}
+
+mp_limb_t *mpz_limbs_write(mpz_t r, size_t n)
+{
+	(void)n;
+	return r->_mp_d;
+}
+
+void mpz_limbs_finish(mpz_t r, size_t n)
+{
+	if (n < FIXEDMPZ_LIMBS)
+		memset(&r->_mp_d[n], 0,
+			(FIXEDMPZ_LIMBS - n) * sizeof(mp_limb_t));
+	fz_finish(r, r->_mp_d, 0);
+}
+
+#endif
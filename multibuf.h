@@ -0,0 +1,903 @@
+//by Aashish Dugar
+#ifndef __multibuf_header
+#define __multibuf_header
+
+/**
+ * Multi-buffer scalar multiplication with AVX2 and AVX-512 IFMA
+ *
+ * Several independent scalar multiplications run in lockstep, one in
+ * each 64-bit lane of the vector registers. A field element of all lanes
+ * is held in one register per limb, limb i of every lane in register i,
+ * so that one instruction computes a limb product for every lane. There
+ * are two engines:
+ *
+ * The AVX2 engine runs four lanes with eight 26-bit limbs, using
+ * _mm256_mul_epu32 for 26x26-bit limb products whose column sums fit in
+ * the 64-bit lanes without carrying.
+ *
+ * The IFMA engine runs eight lanes with four 52-bit limbs, using the
+ * vpmadd52luq and vpmadd52huq instructions of AVX-512 IFMA, which add
+ * the low and the high 52 bits of a 52x52-bit product to a 64-bit lane.
+ * A product needs 16 limb products of each half instead of 64.
+ *
+ * Both hold 208-bit elements in Montgomery form with R = 2^208, which
+ * works for any odd prime of up to 192 bits.
+ *
+ * Lanes cannot branch independently, so the points use the complete
+ * projective formulas of Renes, Costello and Batina, which are correct
+ * for every pair of inputs including equal points and the point at
+ * infinity, and the scalars are processed in fixed 4-bit windows whose
+ * table entries are picked with masks. The sequence of operations is
+ * the same for every scalar. This part is shared by the engines through
+ * multibuf_engine.h.
+ *
+ * The engines are compiled with target attributes, so the rest of the
+ * code needs no -mavx2 or -mavx512ifma. multibuf_x4_supported and
+ * multibuf_x8_supported tell at runtime whether the CPU can run them,
+ * and the backends of ecdh.c that use them are picked accordingly.
+ * Builds without runtime dispatch, see FIELD_DISPATCH, leave them out.
+ */
+#include "ecdh.h"
+#include "primefield.h"
+
+#if FIELD_DISPATCH && defined(__x86_64__) && defined(__GNUC__)
+#define MULTIBUF_AVX2 1
+#define MULTIBUF_IFMA 1
+#include <immintrin.h>
+#else
+#define MULTIBUF_AVX2 0
+#define MULTIBUF_IFMA 0
+#endif
+
+/**
+ * Largest number of scalar multiplications run in lockstep
+ */
+#define MULTIBUF_MAX_LANES 8
+
+/**
+ * Number of bits of the multi-buffer field elements, and the number of
+ * limb_t words holding them
+ */
+#define MB_BITS 208
+#define MB_WORDS ((MB_BITS + FIELD_LIMB_BITS - 1) / FIELD_LIMB_BITS)
+
+/**
+ * Width in bits of the windows of the scalars, and the number of
+ * windows covering a scalar reduced modulo a 192-bit order
+ */
+#define MB_WINDOW 4
+#define MB_WINDOWS (FIELD_BITS / MB_WINDOW)
+
+/**
+ * Unrolls a loop over limbs, which -O2 keeps rolled, so that the limb
+ * indices are constants and the limbs can live in registers
+ */
+#define MB_UNROLL _Pragma("GCC unroll 16")
+
+#if MULTIBUF_AVX2 || MULTIBUF_IFMA
+
+/**
+ * Splits an integer below 2^MB_BITS into limbs of the given width
+ *
+ * Returns 0, or -1 with r set to zero if a is negative or does not fit,
+ * which is checked before its limbs are copied
+ */
+static int mb_split_mpz(uint64_t *r, int limbs, int bits, mpz_t a)
+{
+	limb_t words[MB_WORDS] = { 0 };
+	int i, w, s;
+	uint64_t x;
+
+	if (mpz_sgn(a) < 0 || mpz_sizeinbase(a, 2) > MB_BITS) {
+		memset(r, 0, limbs * sizeof(*r));
+		return -1;
+	}
+	mpz_export(words, NULL, -1, sizeof(limb_t), 0, 0, a);
+	for (i = 0; i < limbs; i++) {
+		x = 0;
+		for (w = i * bits / FIELD_LIMB_BITS; w < MB_WORDS; w++) {
+			s = w * FIELD_LIMB_BITS - i * bits;
+			if (s >= bits)
+				break;
+			if (s < 0)
+				x |= (uint64_t)words[w] >> -s;
+			else
+				x |= (uint64_t)words[w] << s;
+		}
+		r[i] = x & ((1ULL << bits) - 1);
+	}
+	return 0;
+}
+
+/**
+ * Joins limbs of the given width back into limb_t words
+ *
+ * Every limb but the top one must be below 2^bits, and the number below
+ * 2^MB_BITS.
+ */
+static void mb_join(limb_t r[MB_WORDS], const uint64_t *a, int limbs,
+			int bits)
+{
+	int i, w, s;
+
+	memset(r, 0, MB_WORDS * sizeof(limb_t));
+	for (i = 0; i < limbs; i++) {
+		for (w = i * bits / FIELD_LIMB_BITS; w < MB_WORDS; w++) {
+			s = w * FIELD_LIMB_BITS - i * bits;
+			if (s >= 64)
+				break;
+			if (s < 0)
+				r[w] |= (limb_t)(a[i] << -s);
+			else
+				r[w] |= (limb_t)(a[i] >> s);
+		}
+	}
+}
+
+/**
+ * Returns -p0^-1 mod 2^bits for the odd number p0
+ */
+static uint64_t mb_n0(uint64_t p0, int bits)
+{
+	uint64_t inv = p0;
+	int i;
+
+	// Each Newton step doubles the correct low bits, from 3 to 96
+	for (i = 0; i < 5; i++)
+		inv *= 2 - p0 * inv;
+	return -inv & ((1ULL << bits) - 1);
+}
+
+/**
+ * Computes the constants of a curve for an engine whose field elements
+ * have limbs limbs of the given width, see struct Fe4Field
+ *
+ * Only GMP and scalar code are used, so this runs on any CPU, at curve
+ * setup.
+ */
+static void mb_field_init(struct MultiBufField *c, int limbs, int bits,
+				const struct Curve *ec)
+{
+	int64_t q[MULTIBUF_MAX_LIMBS];
+	mpz_t t;
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	mpz_init(t);
+	mb_split_mpz(c->p, limbs, bits, (mpz_ptr)ec->prime);
+	c->n0 = mb_n0(c->p[0], bits);
+
+	// 16p, moving 2^(bits + 2) into each limb from the one above it
+	mpz_mul_2exp(t, ec->prime, 4);
+	mb_split_mpz(c->q, limbs, bits, t);
+	for (i = 0; i < limbs; i++)
+		q[i] = c->q[i];
+	for (i = 0; i < limbs - 1; i++) {
+		q[i] += 1LL << (bits + 2);
+		q[i + 1] -= 4;
+	}
+	for (i = 0; i < limbs; i++)
+		c->q[i] = q[i];
+
+	mpz_set_ui(t, 0UL);
+	mpz_setbit(t, 2 * MB_BITS);
+	mpz_mod(t, t, ec->prime);
+	mb_split_mpz(c->r2, limbs, bits, t);
+
+	mpz_set_ui(t, 0UL);
+	mpz_setbit(t, MB_BITS);
+	mpz_mod(t, t, ec->prime);
+	mb_split_mpz(c->one, limbs, bits, t);
+
+	// a R and 3b R, in Montgomery form
+	mpz_mod(t, ec->a, ec->prime);
+	c->a_zero = mpz_sgn(t) == 0;
+	mpz_mul_2exp(t, t, MB_BITS);
+	mpz_mod(t, t, ec->prime);
+	mb_split_mpz(c->a, limbs, bits, t);
+
+	mpz_mul_2exp(t, ec->b, 1);
+	mpz_add(t, t, ec->b);
+	mpz_mul_2exp(t, t, MB_BITS);
+	mpz_mod(t, t, ec->prime);
+	mb_split_mpz(c->b3, limbs, bits, t);
+	mpz_clear(t);
+}
+
+/**
+ * Returns window w of the scalar k
+ */
+static long long mb_digit(const limb_t k[FIELD_LIMBS], int w)
+{
+	int bit = w * MB_WINDOW;
+
+	return (k[bit / FIELD_LIMB_BITS] >> (bit % FIELD_LIMB_BITS))
+		& ((1 << MB_WINDOW) - 1);
+}
+
+#endif
+
+#if MULTIBUF_AVX2
+
+#define FE4_TARGET __attribute__((target("avx2")))
+
+/**
+ * The field kernels are forced inline into the point formulas, so
+ * that independent multiplications can overlap
+ */
+#define FE4_INLINE inline __attribute__((always_inline, target("avx2")))
+
+/**
+ * Number of lanes, and number and width of the limbs of a field element
+ */
+#define FE4_LANES 4
+#define FE4_LIMBS 8
+#define FE4_BITS 26
+#define FE4_MASK ((1ULL << FE4_BITS) - 1)
+
+/**
+ * Four field elements, limb i of lane l in 64-bit element l of v[i]
+ *
+ * Limbs below the top one are kept below 2^26 between operations,
+ * the top one holds whatever is above bit 182.
+ */
+typedef __m256i fe4_t[FE4_LIMBS];
+
+/**
+ * Struct holding the constants of a prime field and a curve for the
+ * multi-buffer engines, each broadcast to all lanes
+ *
+ * p is the prime.
+ * q is 16p, with its limbs rebalanced so that every limb is larger than
+ * the matching limb of any element below 8p. fe4_sub adds it to keep
+ * results positive.
+ * n0 is -p^-1 mod 2^26.
+ * r2 is R^2 mod p, used to convert into Montgomery form.
+ * one is R mod p, the number 1 in Montgomery form.
+ * a is the curve parameter a, and b3 is 3b, in Montgomery form.
+ * a_zero is set if a = 0, which has cheaper formulas.
+ */
+struct Fe4Field {
+	fe4_t p;
+	fe4_t q;
+	fe4_t r2;
+	fe4_t one;
+	fe4_t a;
+	fe4_t b3;
+	__m256i n0;
+	int a_zero;
+};
+
+/**
+ * Sets all lanes of r to the limbs a
+ */
+static FE4_TARGET void fe4_broadcast(fe4_t r, const uint64_t a[FE4_LIMBS])
+{
+	int i;
+
+	for (i = 0; i < FE4_LIMBS; i++)
+		r[i] = _mm256_set1_epi64x((long long)a[i]);
+}
+
+/**
+ * Sets all lanes of r to the word a
+ */
+static FE4_TARGET void fe4_broadcast_word(__m256i *r, uint64_t a)
+{
+	*r = _mm256_set1_epi64x((long long)a);
+}
+
+/**
+ * Sets lane l of r to the limbs a[l]
+ */
+static FE4_TARGET void fe4_load(fe4_t r, uint64_t a[FE4_LANES][FE4_LIMBS])
+{
+	int i;
+
+	for (i = 0; i < FE4_LIMBS; i++)
+		r[i] = _mm256_set_epi64x((long long)a[3][i], (long long)a[2][i],
+					(long long)a[1][i], (long long)a[0][i]);
+}
+
+/**
+ * Stores lane l of a into the limbs r[l]
+ */
+static FE4_TARGET void fe4_store(uint64_t r[FE4_LANES][FE4_LIMBS],
+					const fe4_t a)
+{
+	uint64_t lanes[FE4_LANES];
+	int i, l;
+
+	for (i = 0; i < FE4_LIMBS; i++) {
+		_mm256_storeu_si256((__m256i *)lanes, a[i]);
+		for (l = 0; l < FE4_LANES; l++)
+			r[l][i] = lanes[l];
+	}
+}
+
+/**
+ * Propagates the carries of r so that every limb but the top one is
+ * below 2^26
+ */
+static FE4_INLINE void fe4_carry(fe4_t r)
+{
+	const __m256i mask = _mm256_set1_epi64x(FE4_MASK);
+	int i;
+
+	MB_UNROLL
+	for (i = 0; i < FE4_LIMBS - 1; i++) {
+		r[i + 1] = _mm256_add_epi64(r[i + 1],
+					_mm256_srli_epi64(r[i], FE4_BITS));
+		r[i] = _mm256_and_si256(r[i], mask);
+	}
+}
+
+/**
+ * Montgomery reduction of four double-width products
+ *
+ * Computes r = t / 2^208 mod p in each lane, column by column: each of
+ * the bottom eight columns picks the multiple m_k of p that clears its
+ * low 26 bits, and the top eight columns become the limbs of r. Working
+ * by columns keeps the running carry, which every step waits for, in a
+ * register instead of in the array of columns. If t is below 2^208 p,
+ * r is below 2p.
+ *
+ * t is the product as 2 * FE4_LIMBS columns of up to 58 bits.
+ */
+static FE4_INLINE void fe4_reduce(fe4_t r, const __m256i t[2 * FE4_LIMBS],
+					const struct Fe4Field *F)
+{
+	const __m256i mask = _mm256_set1_epi64x(FE4_MASK);
+	__m256i m[FE4_LIMBS];
+	__m256i acc, carry = _mm256_setzero_si256();
+	int i, k;
+
+	MB_UNROLL
+	for (k = 0; k < FE4_LIMBS; k++) {
+		acc = _mm256_add_epi64(t[k], carry);
+		MB_UNROLL
+		for (i = 0; i < k; i++)
+			acc = _mm256_add_epi64(acc,
+					_mm256_mul_epu32(m[i], F->p[k - i]));
+		m[k] = _mm256_and_si256(_mm256_mul_epu32(acc, F->n0), mask);
+		acc = _mm256_add_epi64(acc, _mm256_mul_epu32(m[k], F->p[0]));
+		carry = _mm256_srli_epi64(acc, FE4_BITS);
+	}
+
+	MB_UNROLL
+	for (k = FE4_LIMBS; k < 2 * FE4_LIMBS; k++) {
+		acc = _mm256_add_epi64(t[k], carry);
+		MB_UNROLL
+		for (i = k - FE4_LIMBS + 1; i < FE4_LIMBS; i++)
+			acc = _mm256_add_epi64(acc,
+					_mm256_mul_epu32(m[i], F->p[k - i]));
+		if (k < 2 * FE4_LIMBS - 1) {
+			r[k - FE4_LIMBS] = _mm256_and_si256(acc, mask);
+			carry = _mm256_srli_epi64(acc, FE4_BITS);
+		} else {
+			r[k - FE4_LIMBS] = acc;
+		}
+	}
+}
+
+/**
+ * Montgomery multiplication of four pairs of field elements
+ *
+ * Computes r = a b / 2^208 mod p in each lane, as a schoolbook product
+ * of 64 limb products followed by fe4_reduce. If a and b are below
+ * 256p, r is below 2p.
+ *
+ * r is the return variable. It may alias a or b.
+ */
+static FE4_INLINE void fe4_mul(fe4_t r, const fe4_t a, const fe4_t b,
+				const struct Fe4Field *F)
+{
+	__m256i t[2 * FE4_LIMBS];
+	int i, j;
+
+	MB_UNROLL
+	for (i = 0; i < 2 * FE4_LIMBS; i++)
+		t[i] = _mm256_setzero_si256();
+	MB_UNROLL
+	for (i = 0; i < FE4_LIMBS; i++)
+		MB_UNROLL
+		for (j = 0; j < FE4_LIMBS; j++)
+			t[i + j] = _mm256_add_epi64(t[i + j],
+						_mm256_mul_epu32(a[i], b[j]));
+	fe4_reduce(r, t, F);
+}
+
+/**
+ * Montgomery squaring of four field elements
+ *
+ * Like fe4_mul, with each cross product computed once against the
+ * doubled limbs, for 36 limb products instead of 64.
+ */
+static FE4_INLINE void fe4_sq(fe4_t r, const fe4_t a,
+				const struct Fe4Field *F)
+{
+	__m256i t[2 * FE4_LIMBS];
+	__m256i a2[FE4_LIMBS];
+	int i, j;
+
+	MB_UNROLL
+	for (i = 0; i < FE4_LIMBS; i++)
+		a2[i] = _mm256_add_epi64(a[i], a[i]);
+	MB_UNROLL
+	for (i = 0; i < 2 * FE4_LIMBS; i++)
+		t[i] = _mm256_setzero_si256();
+	MB_UNROLL
+	for (i = 0; i < FE4_LIMBS; i++) {
+		t[2 * i] = _mm256_add_epi64(t[2 * i],
+					_mm256_mul_epu32(a[i], a[i]));
+		MB_UNROLL
+		for (j = i + 1; j < FE4_LIMBS; j++)
+			t[i + j] = _mm256_add_epi64(t[i + j],
+						_mm256_mul_epu32(a[i], a2[j]));
+	}
+	fe4_reduce(r, t, F);
+}
+
+/**
+ * Computes r = a + b, without reducing modulo p
+ */
+static FE4_INLINE void fe4_add(fe4_t r, const fe4_t a, const fe4_t b)
+{
+	int i;
+
+	MB_UNROLL
+	for (i = 0; i < FE4_LIMBS; i++)
+		r[i] = _mm256_add_epi64(a[i], b[i]);
+	fe4_carry(r);
+}
+
+/**
+ * Computes r = a - b + 16p, which is positive for b below 8p
+ */
+static FE4_INLINE void fe4_sub(fe4_t r, const fe4_t a, const fe4_t b,
+				const struct Fe4Field *F)
+{
+	int i;
+
+	MB_UNROLL
+	for (i = 0; i < FE4_LIMBS; i++)
+		r[i] = _mm256_sub_epi64(_mm256_add_epi64(a[i], F->q[i]), b[i]);
+	fe4_carry(r);
+}
+
+/**
+ * Sets the lanes of r to those of a where mask is all ones
+ */
+static FE4_INLINE void fe4_select(fe4_t r, const fe4_t a, __m256i mask)
+{
+	int i;
+
+	MB_UNROLL
+	for (i = 0; i < FE4_LIMBS; i++)
+		r[i] = _mm256_blendv_epi8(r[i], a[i], mask);
+}
+
+/**
+ * Returns a mask of all ones in the lanes whose flag is set
+ */
+static FE4_TARGET __m256i fe4_lane_mask(const int flags[FE4_LANES])
+{
+	return _mm256_set_epi64x(-(long long)flags[3], -(long long)flags[2],
+				-(long long)flags[1], -(long long)flags[0]);
+}
+
+/**
+ * Returns a mask of all ones in the lanes of digit equal to i
+ */
+static FE4_INLINE __m256i fe4_equal_mask(__m256i digit, int i)
+{
+	return _mm256_cmpeq_epi64(digit, _mm256_set1_epi64x(i));
+}
+
+/**
+ * Returns the 4-bit window w of each of the four scalars
+ */
+static FE4_TARGET __m256i fe4_digits(limb_t k[FE4_LANES][FIELD_LIMBS],
+					int w)
+{
+	return _mm256_set_epi64x(mb_digit(k[3], w), mb_digit(k[2], w),
+				mb_digit(k[1], w), mb_digit(k[0], w));
+}
+
+#define FEV_LANES FE4_LANES
+#define FEV_LIMBS FE4_LIMBS
+#define FEV_BITS FE4_BITS
+#define FEV_TARGET FE4_TARGET
+#define fev_t fe4_t
+#define fev_word_t __m256i
+#define fev_mask_t __m256i
+#define fev_mul fe4_mul
+#define fev_sq fe4_sq
+#define fev_add fe4_add
+#define fev_sub fe4_sub
+#define fev_select fe4_select
+#define fev_broadcast fe4_broadcast
+#define fev_broadcast_word fe4_broadcast_word
+#define fev_load fe4_load
+#define fev_store fe4_store
+#define fev_lane_mask fe4_lane_mask
+#define fev_equal_mask fe4_equal_mask
+#define fev_digits fe4_digits
+#define FeVField Fe4Field
+#define PointV Point4
+#define FEV_CURVE_FIELD mb_x4
+#define fev_field_init fe4_field_init
+#define fev_get fe4_get
+#define pointv_add_generic point4_add_generic
+#define pointv_double_generic point4_double_generic
+#define pointv_add_a0 point4_add_a0
+#define pointv_double_a0 point4_double_a0
+#define pointv_add point4_add
+#define pointv_double point4_double
+#define pointv_lookup point4_lookup
+#define pointv_load point4_load
+#define pointv_store point4_store
+#define scalar_mult_xv scalar_mult_x4
+#include "multibuf_engine.h"
+
+/**
+ * Returns 1 if the CPU can run scalar_mult_x4, 0 otherwise
+ */
+static int multibuf_x4_supported(void)
+{
+	static int supported = -1;
+
+	if (supported < 0)
+		supported = __builtin_cpu_supports("avx2") != 0;
+	return supported;
+}
+
+#endif
+
+#if MULTIBUF_IFMA
+
+#define FE8_TARGET __attribute__((target("avx512f,avx512ifma")))
+#define FE8_INLINE inline \
+	__attribute__((always_inline, target("avx512f,avx512ifma")))
+
+/**
+ * Number of lanes, and number and width of the limbs of a field element
+ */
+#define FE8_LANES 8
+#define FE8_LIMBS 4
+#define FE8_BITS 52
+#define FE8_MASK ((1ULL << FE8_BITS) - 1)
+
+/**
+ * Eight field elements, limb i of lane l in 64-bit element l of v[i]
+ *
+ * The IFMA instructions read only the low 52 bits of their factors, so
+ * every limb, the top one included, is kept below 2^52 between
+ * operations. The elements stay far below 2^208, so the top limb never
+ * gets near that.
+ */
+typedef __m512i fe8_t[FE8_LIMBS];
+
+/**
+ * The constants of struct Fe4Field for the IFMA engine, with n0 =
+ * -p^-1 mod 2^52
+ */
+struct Fe8Field {
+	fe8_t p;
+	fe8_t q;
+	fe8_t r2;
+	fe8_t one;
+	fe8_t a;
+	fe8_t b3;
+	__m512i n0;
+	int a_zero;
+};
+
+/**
+ * Sets all lanes of r to the limbs a
+ */
+static FE8_TARGET void fe8_broadcast(fe8_t r, const uint64_t a[FE8_LIMBS])
+{
+	int i;
+
+	for (i = 0; i < FE8_LIMBS; i++)
+		r[i] = _mm512_set1_epi64((long long)a[i]);
+}
+
+/**
+ * Sets all lanes of r to the word a
+ */
+static FE8_TARGET void fe8_broadcast_word(__m512i *r, uint64_t a)
+{
+	*r = _mm512_set1_epi64((long long)a);
+}
+
+/**
+ * Sets lane l of r to the limbs a[l]
+ */
+static FE8_TARGET void fe8_load(fe8_t r, uint64_t a[FE8_LANES][FE8_LIMBS])
+{
+	int i;
+
+	for (i = 0; i < FE8_LIMBS; i++)
+		r[i] = _mm512_set_epi64((long long)a[7][i], (long long)a[6][i],
+					(long long)a[5][i], (long long)a[4][i],
+					(long long)a[3][i], (long long)a[2][i],
+					(long long)a[1][i], (long long)a[0][i]);
+}
+
+/**
+ * Stores lane l of a into the limbs r[l]
+ */
+static FE8_TARGET void fe8_store(uint64_t r[FE8_LANES][FE8_LIMBS],
+					const fe8_t a)
+{
+	uint64_t lanes[FE8_LANES];
+	int i, l;
+
+	for (i = 0; i < FE8_LIMBS; i++) {
+		_mm512_storeu_si512(lanes, a[i]);
+		for (l = 0; l < FE8_LANES; l++)
+			r[l][i] = lanes[l];
+	}
+}
+
+/**
+ * Propagates the carries of r so that every limb but the top one is
+ * below 2^52
+ */
+static FE8_INLINE void fe8_carry(fe8_t r)
+{
+	const __m512i mask = _mm512_set1_epi64(FE8_MASK);
+	int i;
+
+	MB_UNROLL
+	for (i = 0; i < FE8_LIMBS - 1; i++) {
+		r[i + 1] = _mm512_add_epi64(r[i + 1],
+					_mm512_srli_epi64(r[i], FE8_BITS));
+		r[i] = _mm512_and_si512(r[i], mask);
+	}
+}
+
+/**
+ * Montgomery reduction of eight double-width products
+ *
+ * Works like fe4_reduce, with the low and high halves of each 52x52-bit
+ * product m_i p_j going into columns i + j and i + j + 1. If t is below
+ * 2^208 p, r is below 2p.
+ *
+ * t is the product as 2 * FE8_LIMBS columns of up to 56 bits.
+ */
+static FE8_INLINE void fe8_reduce(fe8_t r, const __m512i t[2 * FE8_LIMBS],
+					const struct Fe8Field *F)
+{
+	const __m512i mask = _mm512_set1_epi64(FE8_MASK);
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i m[FE8_LIMBS];
+	__m512i acc, carry = zero;
+	int i, k;
+
+	MB_UNROLL
+	for (k = 0; k < FE8_LIMBS; k++) {
+		acc = _mm512_add_epi64(t[k], carry);
+		MB_UNROLL
+		for (i = 0; i < k; i++) {
+			acc = _mm512_madd52lo_epu64(acc, m[i], F->p[k - i]);
+			acc = _mm512_madd52hi_epu64(acc, m[i],
+							F->p[k - 1 - i]);
+		}
+		m[k] = _mm512_madd52lo_epu64(zero, acc, F->n0);
+		acc = _mm512_madd52lo_epu64(acc, m[k], F->p[0]);
+		carry = _mm512_srli_epi64(acc, FE8_BITS);
+	}
+
+	MB_UNROLL
+	for (k = FE8_LIMBS; k < 2 * FE8_LIMBS; k++) {
+		acc = _mm512_add_epi64(t[k], carry);
+		MB_UNROLL
+		for (i = k - FE8_LIMBS + 1; i < FE8_LIMBS; i++)
+			acc = _mm512_madd52lo_epu64(acc, m[i], F->p[k - i]);
+		MB_UNROLL
+		for (i = k - FE8_LIMBS; i < FE8_LIMBS; i++)
+			acc = _mm512_madd52hi_epu64(acc, m[i],
+							F->p[k - 1 - i]);
+		if (k < 2 * FE8_LIMBS - 1) {
+			r[k - FE8_LIMBS] = _mm512_and_si512(acc, mask);
+			carry = _mm512_srli_epi64(acc, FE8_BITS);
+		} else {
+			r[k - FE8_LIMBS] = acc;
+		}
+	}
+}
+
+/**
+ * Montgomery multiplication of eight pairs of field elements
+ *
+ * Computes r = a b / 2^208 mod p in each lane, as a schoolbook product
+ * of 16 limb products, each split into its low and high 52 bits,
+ * followed by fe8_reduce. If a and b are below 256p, r is below 2p.
+ *
+ * r is the return variable. It may alias a or b.
+ */
+static FE8_INLINE void fe8_mul(fe8_t r, const fe8_t a, const fe8_t b,
+				const struct Fe8Field *F)
+{
+	__m512i t[2 * FE8_LIMBS];
+	int i, j;
+
+	MB_UNROLL
+	for (i = 0; i < 2 * FE8_LIMBS; i++)
+		t[i] = _mm512_setzero_si512();
+	MB_UNROLL
+	for (i = 0; i < FE8_LIMBS; i++) {
+		MB_UNROLL
+		for (j = 0; j < FE8_LIMBS; j++) {
+			t[i + j] = _mm512_madd52lo_epu64(t[i + j], a[i], b[j]);
+			t[i + j + 1] = _mm512_madd52hi_epu64(t[i + j + 1],
+								a[i], b[j]);
+		}
+	}
+	fe8_reduce(r, t, F);
+}
+
+/**
+ * Montgomery squaring of eight field elements
+ *
+ * Like fe8_mul, with each cross product computed once and the columns
+ * doubled before adding the squares, for 10 limb products instead of
+ * 16. Doubling the limbs instead, as fe4_sq does, could take them past
+ * the 52 bits IFMA reads.
+ */
+static FE8_INLINE void fe8_sq(fe8_t r, const fe8_t a,
+				const struct Fe8Field *F)
+{
+	__m512i t[2 * FE8_LIMBS];
+	int i, j;
+
+	MB_UNROLL
+	for (i = 0; i < 2 * FE8_LIMBS; i++)
+		t[i] = _mm512_setzero_si512();
+	MB_UNROLL
+	for (i = 0; i < FE8_LIMBS; i++) {
+		MB_UNROLL
+		for (j = i + 1; j < FE8_LIMBS; j++) {
+			t[i + j] = _mm512_madd52lo_epu64(t[i + j], a[i], a[j]);
+			t[i + j + 1] = _mm512_madd52hi_epu64(t[i + j + 1],
+								a[i], a[j]);
+		}
+	}
+	MB_UNROLL
+	for (i = 0; i < 2 * FE8_LIMBS; i++)
+		t[i] = _mm512_add_epi64(t[i], t[i]);
+	MB_UNROLL
+	for (i = 0; i < FE8_LIMBS; i++) {
+		t[2 * i] = _mm512_madd52lo_epu64(t[2 * i], a[i], a[i]);
+		t[2 * i + 1] = _mm512_madd52hi_epu64(t[2 * i + 1], a[i], a[i]);
+	}
+	fe8_reduce(r, t, F);
+}
+
+/**
+ * Computes r = a + b, without reducing modulo p
+ */
+static FE8_INLINE void fe8_add(fe8_t r, const fe8_t a, const fe8_t b)
+{
+	int i;
+
+	MB_UNROLL
+	for (i = 0; i < FE8_LIMBS; i++)
+		r[i] = _mm512_add_epi64(a[i], b[i]);
+	fe8_carry(r);
+}
+
+/**
+ * Computes r = a - b + 16p, which is positive for b below 8p
+ */
+static FE8_INLINE void fe8_sub(fe8_t r, const fe8_t a, const fe8_t b,
+				const struct Fe8Field *F)
+{
+	int i;
+
+	MB_UNROLL
+	for (i = 0; i < FE8_LIMBS; i++)
+		r[i] = _mm512_sub_epi64(_mm512_add_epi64(a[i], F->q[i]), b[i]);
+	fe8_carry(r);
+}
+
+/**
+ * Sets the lanes of r to those of a where the bit of mask is set
+ */
+static FE8_INLINE void fe8_select(fe8_t r, const fe8_t a, __mmask8 mask)
+{
+	int i;
+
+	MB_UNROLL
+	for (i = 0; i < FE8_LIMBS; i++)
+		r[i] = _mm512_mask_blend_epi64(mask, r[i], a[i]);
+}
+
+/**
+ * Returns a mask with the bits of the lanes whose flag is set
+ */
+static FE8_TARGET __mmask8 fe8_lane_mask(const int flags[FE8_LANES])
+{
+	unsigned int mask = 0;
+	int l;
+
+	for (l = 0; l < FE8_LANES; l++)
+		mask |= (flags[l] != 0) << l;
+	return (__mmask8)mask;
+}
+
+/**
+ * Returns a mask with the bits of the lanes of digit equal to i
+ */
+static FE8_INLINE __mmask8 fe8_equal_mask(__m512i digit, int i)
+{
+	return _mm512_cmpeq_epi64_mask(digit, _mm512_set1_epi64(i));
+}
+
+/**
+ * Returns the 4-bit window w of each of the eight scalars
+ */
+static FE8_TARGET __m512i fe8_digits(limb_t k[FE8_LANES][FIELD_LIMBS],
+					int w)
+{
+	return _mm512_set_epi64(mb_digit(k[7], w), mb_digit(k[6], w),
+				mb_digit(k[5], w), mb_digit(k[4], w),
+				mb_digit(k[3], w), mb_digit(k[2], w),
+				mb_digit(k[1], w), mb_digit(k[0], w));
+}
+
+#define FEV_LANES FE8_LANES
+#define FEV_LIMBS FE8_LIMBS
+#define FEV_BITS FE8_BITS
+#define FEV_TARGET FE8_TARGET
+#define fev_t fe8_t
+#define fev_word_t __m512i
+#define fev_mask_t __mmask8
+#define fev_mul fe8_mul
+#define fev_sq fe8_sq
+#define fev_add fe8_add
+#define fev_sub fe8_sub
+#define fev_select fe8_select
+#define fev_broadcast fe8_broadcast
+#define fev_broadcast_word fe8_broadcast_word
+#define fev_load fe8_load
+#define fev_store fe8_store
+#define fev_lane_mask fe8_lane_mask
+#define fev_equal_mask fe8_equal_mask
+#define fev_digits fe8_digits
+#define FeVField Fe8Field
+#define PointV Point8
+#define FEV_CURVE_FIELD mb_x8
+#define fev_field_init fe8_field_init
+#define fev_get fe8_get
+#define pointv_add_generic point8_add_generic
+#define pointv_double_generic point8_double_generic
+#define pointv_add_a0 point8_add_a0
+#define pointv_double_a0 point8_double_a0
+#define pointv_add point8_add
+#define pointv_double point8_double
+#define pointv_lookup point8_lookup
+#define pointv_load point8_load
+#define pointv_store point8_store
+#define scalar_mult_xv scalar_mult_x8
+#include "multibuf_engine.h"
+
+/**
+ * Returns 1 if the CPU can run scalar_mult_x8, 0 otherwise
+ */
+static int multibuf_x8_supported(void)
+{
+	static int supported = -1;
+
+	if (supported < 0)
+		supported = __builtin_cpu_supports("avx512f")
+				&& __builtin_cpu_supports("avx512ifma");
+	return supported;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,487 @@
+//by Aashish Dugar
+/**
+ * Lane-independent part of a multi-buffer engine
+ *
+ * This file is included by multibuf.h once per engine, after the field
+ * kernels of the engine, with the following macros naming them:
+ *
+ * FEV_LANES, FEV_LIMBS and FEV_BITS are the number of lanes, and the
+ * number and width of the limbs of a field element.
+ * FEV_TARGET is the target attribute of the engine's instruction set.
+ * fev_t is the type of a field element of all lanes, fev_word_t that of
+ * one 64-bit word in each lane and fev_mask_t that of a lane mask.
+ * FeVField is the struct of the constants of the engine, see struct
+ * Fe4Field, which the kernels take.
+ * fev_mul, fev_sq, fev_add, fev_sub and fev_select are the field
+ * kernels, fev_broadcast, fev_broadcast_word, fev_load and fev_store
+ * move limbs in and out of the lanes, fev_lane_mask builds a lane mask
+ * from flags and fev_equal_mask compares the words of all lanes with a
+ * number.
+ * FEV_CURVE_FIELD is the member of struct Curve holding the constants
+ * of the engine, see mb_field_init.
+ * PointV, fev_field_init, fev_get, pointv_* and scalar_mult_xv are the
+ * names given to what this file defines.
+ *
+ * All of the macros are undefined at the end of the file.
+ */
+
+/**
+ * The points of all lanes in projective co-ordinates, (X : Y : Z)
+ * standing for the affine point (X / Z, Y / Z) and (0 : 1 : 0) for
+ * infinity
+ */
+struct PointV {
+	fev_t X;
+	fev_t Y;
+	fev_t Z;
+};
+
+/**
+ * Sets up the constants of the engine for a curve, broadcasting the
+ * ones computed at curve setup to all lanes
+ */
+static FEV_TARGET void fev_field_init(struct FeVField *F,
+					const struct Curve *ec)
+{
+	const struct MultiBufField *c = &ec->FEV_CURVE_FIELD;
+
+	fev_broadcast(F->p, c->p);
+	fev_broadcast(F->q, c->q);
+	fev_broadcast(F->r2, c->r2);
+	fev_broadcast(F->one, c->one);
+	fev_broadcast(F->a, c->a);
+	fev_broadcast(F->b3, c->b3);
+	fev_broadcast_word(&F->n0, c->n0);
+	F->a_zero = c->a_zero;
+}
+
+/**
+ * Adds the points of each lane, r = p + q
+ *
+ * This is algorithm 1 of Renes, Costello and Batina, "Complete addition
+ * formulas for prime order elliptic curves", for any a, at a cost of
+ * 12M + 3m_a + 2m_3b. The bounds on the right are the largest value of
+ * each variable in multiples of p, for inputs below 32p: products are
+ * below 2p, and no subtrahend reaches 8p.
+ *
+ * r is the return variable. It may alias p or q.
+ */
+static FEV_TARGET void pointv_add_generic(struct PointV *r,
+				const struct PointV *p,
+				const struct PointV *q,
+				const struct FeVField *F)
+{
+	fev_t t0, t1, t2, t3, t4, t5, X3, Y3, Z3;
+
+	fev_mul(t0, p->X, q->X, F);		// 2
+	fev_mul(t1, p->Y, q->Y, F);		// 2
+	fev_mul(t2, p->Z, q->Z, F);		// 2
+	fev_add(t3, p->X, p->Y);
+	fev_add(t4, q->X, q->Y);
+	fev_mul(t3, t3, t4, F);			// 2
+	fev_add(t4, t0, t1);			// 4
+	fev_sub(t3, t3, t4, F);			// 18
+	fev_add(t4, p->X, p->Z);
+	fev_add(t5, q->X, q->Z);
+	fev_mul(t4, t4, t5, F);			// 2
+	fev_add(t5, t0, t2);			// 4
+	fev_sub(t4, t4, t5, F);			// 18
+	fev_add(t5, p->Y, p->Z);
+	fev_add(X3, q->Y, q->Z);
+	fev_mul(t5, t5, X3, F);			// 2
+	fev_add(X3, t1, t2);			// 4
+	fev_sub(t5, t5, X3, F);			// 18
+	fev_mul(Z3, F->a, t4, F);		// 2
+	fev_mul(X3, F->b3, t2, F);		// 2
+	fev_add(Z3, X3, Z3);			// 4
+	fev_sub(X3, t1, Z3, F);			// 18
+	fev_add(Z3, t1, Z3);			// 6
+	fev_mul(Y3, X3, Z3, F);			// 2
+	fev_add(t1, t0, t0);			// 4
+	fev_add(t1, t1, t0);			// 6
+	fev_mul(t2, F->a, t2, F);		// 2
+	fev_mul(t4, F->b3, t4, F);		// 2
+	fev_add(t1, t1, t2);			// 8
+	fev_sub(t2, t0, t2, F);			// 18
+	fev_mul(t2, F->a, t2, F);		// 2
+	fev_add(t4, t4, t2);			// 4
+	fev_mul(t0, t1, t4, F);			// 2
+	fev_add(Y3, Y3, t0);			// 4
+	fev_mul(t0, t5, t4, F);			// 2
+	fev_mul(X3, t3, X3, F);			// 2
+	fev_sub(X3, X3, t0, F);			// 18
+	fev_mul(t0, t3, t1, F);			// 2
+	fev_mul(Z3, t5, Z3, F);			// 2
+	fev_add(Z3, Z3, t0);			// 4
+
+	memcpy(r->X, X3, sizeof(fev_t));
+	memcpy(r->Y, Y3, sizeof(fev_t));
+	memcpy(r->Z, Z3, sizeof(fev_t));
+}
+
+/**
+ * Doubles the point of each lane, r = 2p
+ *
+ * This is algorithm 3 of Renes, Costello and Batina, for any a, at a
+ * cost of 8M + 3S + 3m_a + 2m_3b. See pointv_add_generic for the
+ * bounds.
+ *
+ * r is the return variable. It may alias p.
+ */
+static FEV_TARGET void pointv_double_generic(struct PointV *r,
+					const struct PointV *p,
+					const struct FeVField *F)
+{
+	fev_t t0, t1, t2, t3, X3, Y3, Z3;
+
+	fev_sq(t0, p->X, F);			// 2
+	fev_sq(t1, p->Y, F);			// 2
+	fev_sq(t2, p->Z, F);			// 2
+	fev_mul(t3, p->X, p->Y, F);		// 2
+	fev_add(t3, t3, t3);			// 4
+	fev_mul(Z3, p->X, p->Z, F);		// 2
+	fev_add(Z3, Z3, Z3);			// 4
+	fev_mul(X3, F->a, Z3, F);		// 2
+	fev_mul(Y3, F->b3, t2, F);		// 2
+	fev_add(Y3, X3, Y3);			// 4
+	fev_sub(X3, t1, Y3, F);			// 18
+	fev_add(Y3, t1, Y3);			// 6
+	fev_mul(Y3, X3, Y3, F);			// 2
+	fev_mul(X3, t3, X3, F);			// 2
+	fev_mul(Z3, F->b3, Z3, F);		// 2
+	fev_mul(t2, F->a, t2, F);		// 2
+	fev_sub(t3, t0, t2, F);			// 18
+	fev_mul(t3, F->a, t3, F);		// 2
+	fev_add(t3, t3, Z3);			// 4
+	fev_add(Z3, t0, t0);			// 4
+	fev_add(t0, Z3, t0);			// 6
+	fev_add(t0, t0, t2);			// 8
+	fev_mul(t0, t0, t3, F);			// 2
+	fev_add(Y3, Y3, t0);			// 4
+	fev_mul(t2, p->Y, p->Z, F);		// 2
+	fev_add(t2, t2, t2);			// 4
+	fev_mul(t0, t2, t3, F);			// 2
+	fev_sub(X3, X3, t0, F);			// 18
+	fev_mul(Z3, t2, t1, F);			// 2
+	fev_add(Z3, Z3, Z3);			// 4
+	fev_add(Z3, Z3, Z3);			// 8
+
+	memcpy(r->X, X3, sizeof(fev_t));
+	memcpy(r->Y, Y3, sizeof(fev_t));
+	memcpy(r->Z, Z3, sizeof(fev_t));
+}
+
+/**
+ * Adds the points of each lane on a curve with a = 0, r = p + q
+ *
+ * This is algorithm 7 of Renes, Costello and Batina, at a cost of
+ * 12M + 2m_3b. The bounds are as in pointv_add_generic.
+ *
+ * r is the return variable. It may alias p or q.
+ */
+static FEV_TARGET void pointv_add_a0(struct PointV *r, const struct PointV *p,
+				const struct PointV *q,
+				const struct FeVField *F)
+{
+	fev_t t0, t1, t2, t3, t4, X3, Y3, Z3;
+
+	fev_mul(t0, p->X, q->X, F);		// 2
+	fev_mul(t1, p->Y, q->Y, F);		// 2
+	fev_mul(t2, p->Z, q->Z, F);		// 2
+	fev_add(t3, p->X, p->Y);
+	fev_add(t4, q->X, q->Y);
+	fev_mul(t3, t3, t4, F);			// 2
+	fev_add(t4, t0, t1);			// 4
+	fev_sub(t3, t3, t4, F);			// 18
+	fev_add(t4, p->Y, p->Z);
+	fev_add(X3, q->Y, q->Z);
+	fev_mul(t4, t4, X3, F);			// 2
+	fev_add(X3, t1, t2);			// 4
+	fev_sub(t4, t4, X3, F);			// 18
+	fev_add(X3, p->X, p->Z);
+	fev_add(Y3, q->X, q->Z);
+	fev_mul(X3, X3, Y3, F);			// 2
+	fev_add(Y3, t0, t2);			// 4
+	fev_sub(Y3, X3, Y3, F);			// 18
+	fev_add(X3, t0, t0);			// 4
+	fev_add(t0, X3, t0);			// 6
+	fev_mul(t2, F->b3, t2, F);		// 2
+	fev_add(Z3, t1, t2);			// 4
+	fev_sub(t1, t1, t2, F);			// 18
+	fev_mul(Y3, F->b3, Y3, F);		// 2
+	fev_mul(X3, t4, Y3, F);			// 2
+	fev_mul(t2, t3, t1, F);			// 2
+	fev_sub(X3, t2, X3, F);			// 18
+	fev_mul(Y3, Y3, t0, F);			// 2
+	fev_mul(t1, t1, Z3, F);			// 2
+	fev_add(Y3, t1, Y3);			// 4
+	fev_mul(t0, t0, t3, F);			// 2
+	fev_mul(Z3, Z3, t4, F);			// 2
+	fev_add(Z3, Z3, t0);			// 4
+
+	memcpy(r->X, X3, sizeof(fev_t));
+	memcpy(r->Y, Y3, sizeof(fev_t));
+	memcpy(r->Z, Z3, sizeof(fev_t));
+}
+
+/**
+ * Doubles the point of each lane on a curve with a = 0, r = 2p
+ *
+ * This is algorithm 9 of Renes, Costello and Batina, at a cost of
+ * 6M + 2S + 1m_3b.
+ *
+ * r is the return variable. It may alias p.
+ */
+static FEV_TARGET void pointv_double_a0(struct PointV *r,
+					const struct PointV *p,
+					const struct FeVField *F)
+{
+	fev_t t0, t1, t2, X3, Y3, Z3;
+
+	fev_sq(t0, p->Y, F);			// 2
+	fev_add(Z3, t0, t0);			// 4
+	fev_add(Z3, Z3, Z3);			// 8
+	fev_add(Z3, Z3, Z3);			// 16
+	fev_mul(t1, p->Y, p->Z, F);		// 2
+	fev_sq(t2, p->Z, F);			// 2
+	fev_mul(t2, F->b3, t2, F);		// 2
+	fev_mul(X3, t2, Z3, F);			// 2
+	fev_add(Y3, t0, t2);			// 4
+	fev_mul(Z3, t1, Z3, F);			// 2
+	fev_add(t1, t2, t2);			// 4
+	fev_add(t2, t1, t2);			// 6
+	fev_sub(t0, t0, t2, F);			// 18
+	fev_mul(Y3, t0, Y3, F);			// 2
+	fev_add(Y3, X3, Y3);			// 4
+	fev_mul(t1, p->X, p->Y, F);		// 2
+	fev_mul(X3, t0, t1, F);			// 2
+	fev_add(X3, X3, X3);			// 4
+
+	memcpy(r->X, X3, sizeof(fev_t));
+	memcpy(r->Y, Y3, sizeof(fev_t));
+	memcpy(r->Z, Z3, sizeof(fev_t));
+}
+
+/**
+ * Adds the points of each lane, using the formula for the curve
+ */
+static FEV_TARGET void pointv_add(struct PointV *r, const struct PointV *p,
+				const struct PointV *q,
+				const struct FeVField *F)
+{
+	if (F->a_zero)
+		pointv_add_a0(r, p, q, F);
+	else
+		pointv_add_generic(r, p, q, F);
+}
+
+/**
+ * Doubles the point of each lane, using the formula for the curve
+ */
+static FEV_TARGET void pointv_double(struct PointV *r, const struct PointV *p,
+					const struct FeVField *F)
+{
+	if (F->a_zero)
+		pointv_double_a0(r, p, F);
+	else
+		pointv_double_generic(r, p, F);
+}
+
+/**
+ * Sets the lanes of r to table[digit] of the same lane, reading every
+ * entry of the table
+ */
+static FEV_TARGET void pointv_lookup(struct PointV *r,
+				const struct PointV table[1 << MB_WINDOW],
+				fev_word_t digit)
+{
+	fev_mask_t mask;
+	int i;
+
+	*r = table[0];
+	for (i = 1; i < 1 << MB_WINDOW; i++) {
+		mask = fev_equal_mask(digit, i);
+		fev_select(r->X, table[i].X, mask);
+		fev_select(r->Y, table[i].Y, mask);
+		fev_select(r->Z, table[i].Z, mask);
+	}
+}
+
+/**
+ * Converts the affine points of all lanes into the engine's form
+ *
+ * p[l] is the point of lane l, with (0, 0) standing for infinity. It
+ * must be a point of the curve, which scalar_mult_batch_into checks
+ * before calling the engine.
+ */
+static FEV_TARGET void pointv_load(struct PointV *r,
+				struct Point *const p[FEV_LANES],
+				const struct FeVField *F)
+{
+	uint64_t x[FEV_LANES][FEV_LIMBS], y[FEV_LANES][FEV_LIMBS];
+	int inf[FEV_LANES];
+	fev_t zero;
+	fev_mask_t mask;
+	int l;
+
+	for (l = 0; l < FEV_LANES; l++) {
+		mb_split_mpz(x[l], FEV_LIMBS, FEV_BITS, p[l]->x);
+		mb_split_mpz(y[l], FEV_LIMBS, FEV_BITS, p[l]->y);
+		inf[l] = mpz_sgn(p[l]->x) == 0 && mpz_sgn(p[l]->y) == 0;
+	}
+	fev_load(r->X, x);
+	fev_load(r->Y, y);
+	fev_mul(r->X, r->X, F->r2, F);
+	fev_mul(r->Y, r->Y, F->r2, F);
+	memcpy(r->Z, F->one, sizeof(fev_t));
+	memset(zero, 0, sizeof(fev_t));
+
+	// Infinity becomes (0 : 1 : 0)
+	mask = fev_lane_mask(inf);
+	fev_select(r->Y, F->one, mask);
+	fev_select(r->Z, zero, mask);
+}
+
+/**
+ * Converts a field element of all lanes out of Montgomery form into
+ * plain fixed-limb field elements, one per lane, fully reduced
+ */
+static FEV_TARGET void fev_get(fe_t r[FEV_LANES], const fev_t a,
+				const struct FeVField *F, const struct Field *f)
+{
+	uint64_t limbs[FEV_LANES][FEV_LIMBS];
+	uint64_t plain_one[FEV_LIMBS] = { 1 };
+	limb_t words[MB_WORDS];
+	fev_t one, t;
+	int l;
+
+	fev_broadcast(one, plain_one);
+	fev_mul(t, a, one, F);
+	fev_store(limbs, t);
+	for (l = 0; l < FEV_LANES; l++) {
+		// The value is below 2p, so at most one bit above 2^192
+		mb_join(words, limbs[l], FEV_LIMBS, FEV_BITS);
+		fe_reduce_once(r[l], words, words[FIELD_LIMBS], f);
+	}
+}
+
+/**
+ * Converts the projective points of all lanes into affine points
+ *
+ * The Z co-ordinates are inverted together with fe_batch_inv. Lanes at
+ * infinity have Z = 0, whose inverse is zero, so they come out as
+ * (0, 0).
+ */
+static FEV_TARGET void pointv_store(struct Point *const r[FEV_LANES],
+					const struct PointV *p,
+					const struct FeVField *F,
+					const struct Field *f)
+{
+	fe_t x[FEV_LANES], y[FEV_LANES], z[FEV_LANES], zinv[FEV_LANES];
+	int l;
+
+	fev_get(x, p->X, F, f);
+	fev_get(y, p->Y, F, f);
+	fev_get(z, p->Z, F, f);
+	for (l = 0; l < FEV_LANES; l++) {
+		if (f->montgomery) {
+			fe_mul(x[l], x[l], f->r2, f);
+			fe_mul(y[l], y[l], f->r2, f);
+			fe_mul(z[l], z[l], f->r2, f);
+		}
+	}
+	fe_batch_inv(zinv, (const fe_t *)z, FEV_LANES, f);
+	for (l = 0; l < FEV_LANES; l++) {
+		fe_mul(x[l], x[l], zinv[l], f);
+		fe_mul(y[l], y[l], zinv[l], f);
+		fe_get_mpz(r[l]->x, x[l], f);
+		fe_get_mpz(r[l]->y, y[l], f);
+	}
+}
+
+/**
+ * Multiplies the point of each lane by its scalar, r[l] = k[l] p[l]
+ *
+ * The scalars are read in fixed windows of MB_WINDOW bits from the top,
+ * with MB_WINDOW doublings and one addition of a table entry per
+ * window, so every lane runs the same sequence of operations.
+ *
+ * r[l] are the return variables. They must be initialized and may be
+ * the same as p[l].
+ * p[l] are the points to multiply, with (0, 0) standing for infinity.
+ * k[l] are the scalars. They are reduced modulo the order of the curve,
+ * so p[l] must lie in the group generated by G.
+ * s is the scratch space of the calling thread.
+ */
+static FEV_TARGET void scalar_mult_xv(struct Point *const r[FEV_LANES],
+				struct Point *const p[FEV_LANES],
+				mpz_ptr const k[FEV_LANES],
+				const struct Curve *ec, struct Scratch *s)
+{
+	struct FeVField F;
+	struct PointV table[1 << MB_WINDOW];
+	struct PointV acc, t;
+	limb_t digits[FEV_LANES][FIELD_LIMBS];
+	int i, j, l;
+
+	fev_field_init(&F, ec);
+
+	for (l = 0; l < FEV_LANES; l++) {
+		memset(digits[l], 0, sizeof(digits[l]));
+		mpz_mod(s->e, k[l], ec->order);
+		mpz_export(digits[l], NULL, -1, sizeof(limb_t), 0, 0, s->e);
+	}
+
+	// table[i] = i p, with table[0] at infinity
+	memset(&table[0], 0, sizeof(table[0]));
+	memcpy(table[0].Y, F.one, sizeof(fev_t));
+	pointv_load(&table[1], p, &F);
+	pointv_double(&table[2], &table[1], &F);
+	for (i = 3; i < 1 << MB_WINDOW; i++)
+		pointv_add(&table[i], &table[i - 1], &table[1], &F);
+
+	pointv_lookup(&acc, table, fev_digits(digits, MB_WINDOWS - 1));
+	for (i = MB_WINDOWS - 2; i >= 0; i--) {
+		for (j = 0; j < MB_WINDOW; j++)
+			pointv_double(&acc, &acc, &F);
+		pointv_lookup(&t, table, fev_digits(digits, i));
+		pointv_add(&acc, &acc, &t, &F);
+	}
+
+	pointv_store(r, &acc, &F, &ec->field);
+}
+
+#undef FEV_LANES
+#undef FEV_LIMBS
+#undef FEV_BITS
+#undef FEV_TARGET
+#undef fev_t
+#undef fev_word_t
+#undef fev_mask_t
+#undef fev_mul
+#undef fev_sq
+#undef fev_add
+#undef fev_sub
+#undef fev_select
+#undef fev_broadcast
+#undef fev_broadcast_word
+#undef fev_load
+#undef fev_store
+#undef fev_lane_mask
+#undef fev_equal_mask
+#undef fev_digits
+#undef FeVField
+#undef PointV
+#undef FEV_CURVE_FIELD
+#undef fev_field_init
+#undef fev_get
+#undef pointv_add_generic
+#undef pointv_double_generic
+#undef pointv_add_a0
+#undef pointv_double_a0
+#undef pointv_add
+#undef pointv_double
+#undef pointv_lookup
+#undef pointv_load
+#undef pointv_store
+#undef scalar_mult_xv
@@ -2,7 +2,1599 @@
 #ifndef __primefield_header
 #define __primefield_header
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ECDH_NO_GMP
+#include "fixedmpz.h"
+#else
 #include <gmp.h>
+#endif
+
+/**
+ * Width in bits of the limbs of field elements, 64 or 32
+ *
+ * 64-bit limbs need 64x64->128 multiplies (unsigned __int128). Targets
+ * without them, e.g. 32-bit ARM or x86 with -m32, default to 32-bit
+ * limbs and 32x32->64 multiplies. -DFIELD_LIMB_BITS=32 selects them on
+ * a 64-bit host too, to compare the two.
+ */
+#ifndef FIELD_LIMB_BITS
+#ifdef __SIZEOF_INT128__
+#define FIELD_LIMB_BITS 64
+#else
+#define FIELD_LIMB_BITS 32
+#endif
+#endif
+
+/**
+ * A limb of a field element, and the double-width type holding the
+ * product of two limbs
+ */
+#if FIELD_LIMB_BITS == 64
+typedef uint64_t limb_t;
+typedef unsigned __int128 dlimb_t;
+#elif FIELD_LIMB_BITS == 32
+typedef uint32_t limb_t;
+typedef uint64_t dlimb_t;
+#else
+#error "FIELD_LIMB_BITS must be 64 or 32"
+#endif
+
+/**
+ * Number of bits and of limbs in an element of the 192-bit fields
+ */
+#define FIELD_BITS 192
+#define FIELD_LIMBS (FIELD_BITS / FIELD_LIMB_BITS)
+
+/**
+ * Set to 1 (e.g. with -DFIELD_MONTGOMERY) to use Montgomery form even
+ * for the primes that have a dedicated reduction kernel
+ */
+#ifndef FIELD_MONTGOMERY
+#define FIELD_MONTGOMERY 0
+#endif
+
+/**
+ * Counters of fixed-limb field operations, compiled in only with
+ * -DFIELD_COUNT_OPS (as the benchmark does) to report operation counts
+ */
+#ifdef FIELD_COUNT_OPS
+unsigned long field_mul_count;
+unsigned long field_sq_count;
+unsigned long field_inv_count;
+#define FIELD_COUNT(counter) ((counter)++)
+#else
+#define FIELD_COUNT(counter)
+#endif
+
+/**
+ * A collection of primes with a dedicated reduction kernel
+ *
+ * FIELD_GENERIC is used for any other prime, and is reduced with
+ * ordinary GMP division.
+ */
+enum Fields {
+	FIELD_GENERIC,
+	FIELD_P192K1,
+	FIELD_P192R1
+};
+
+/**
+ * Returns which of the fields in enum Fields is defined by p
+ *
+ * Only the limbs of p are compared, so this is cheap enough to call
+ * on every multiplication.
+ */
+enum Fields prime_field_type(mpz_t p)
+{
+	const mp_limb_t *l = mpz_limbs_read(p);
+
+#if GMP_NUMB_BITS == 64
+	if (mpz_size(p) != 3 || l[2] != 0xffffffffffffffffUL)
+		return FIELD_GENERIC;
+	if (l[1] == 0xffffffffffffffffUL && l[0] == 0xfffffffeffffee37UL)
+		return FIELD_P192K1;
+	if (l[1] == 0xfffffffffffffffeUL && l[0] == 0xffffffffffffffffUL)
+		return FIELD_P192R1;
+#elif GMP_NUMB_BITS == 32
+	if (mpz_size(p) != 6 || l[5] != 0xffffffffUL || l[4] != 0xffffffffUL
+	    || l[3] != 0xffffffffUL)
+		return FIELD_GENERIC;
+	if (l[2] == 0xffffffffUL && l[1] == 0xfffffffeUL
+	    && l[0] == 0xffffee37UL)
+		return FIELD_P192K1;
+	if (l[2] == 0xfffffffeUL && l[1] == 0xffffffffUL
+	    && l[0] == 0xffffffffUL)
+		return FIELD_P192R1;
+#endif
+	return FIELD_GENERIC;
+}
+
+#if FIELD_LIMB_BITS == 64
+/**
+ * Reduces a 384-bit number modulo p = 2^192 - 2^32 - 4553 (secp192k1)
+ *
+ * Since 2^192 = 2^32 + 4553 mod p, writing t = h * 2^192 + l gives
+ * t = l + h * (2^32 + 4553) mod p. The fold is applied twice, as the
+ * first one leaves at most 34 bits above 2^192, followed by one
+ * conditional subtraction of p.
+ *
+ * r is the return variable holding three limbs, least significant first.
+ * t is the number to reduce as six limbs, least significant first.
+ */
+void p192k1_reduce(limb_t r[FIELD_LIMBS], const limb_t t[2 * FIELD_LIMBS])
+{
+	const uint64_t c = 0x1000011c9UL;
+	unsigned __int128 acc;
+	uint64_t r0, r1, r2, h;
+
+	// r = l + h * c, leaving h as the part above 2^192
+	acc = (unsigned __int128)t[3] * c + t[0];
+	r0 = (uint64_t)acc;
+	acc = (acc >> 64) + (unsigned __int128)t[4] * c + t[1];
+	r1 = (uint64_t)acc;
+	acc = (acc >> 64) + (unsigned __int128)t[5] * c + t[2];
+	r2 = (uint64_t)acc;
+	h = (uint64_t)(acc >> 64);
+
+	// Second fold, h * c is less than 2^67
+	acc = (unsigned __int128)h * c + r0;
+	r0 = (uint64_t)acc;
+	acc = (acc >> 64) + r1;
+	r1 = (uint64_t)acc;
+	acc = (acc >> 64) + r2;
+	r2 = (uint64_t)acc;
+
+	// A carry out of the top limb leaves r small, so adding c is safe
+	if ((uint64_t)(acc >> 64) != 0) {
+		acc = (unsigned __int128)r0 + c;
+		r0 = (uint64_t)acc;
+		acc = (acc >> 64) + r1;
+		r1 = (uint64_t)acc;
+		r2 += (uint64_t)(acc >> 64);
+	}
+
+	// r < 2^192 < 2p, so one subtraction of p is enough
+	if (r2 == 0xffffffffffffffffUL && r1 == 0xffffffffffffffffUL
+	    && r0 >= 0xfffffffeffffee37UL) {
+		// r - p = r + c - 2^192
+		r0 += c;
+		r1 = 0;
+		r2 = 0;
+	}
+
+	r[0] = r0;
+	r[1] = r1;
+	r[2] = r2;
+}
+
+/**
+ * Reduces a 384-bit number modulo p = 2^192 - 2^64 - 1 (secp192r1)
+ *
+ * Since 2^192 = 2^64 + 1 mod p, the upper three limbs of t can be
+ * folded back onto the lower three with a few word shuffles and adds,
+ * without any division. This is the NIST fast reduction, see FIPS 186-4
+ * section D.2.1 for details.
+ *
+ * r is the return variable holding three limbs, least significant first.
+ * t is the number to reduce as six limbs, least significant first.
+ */
+void p192r1_reduce(limb_t r[FIELD_LIMBS], const limb_t t[2 * FIELD_LIMBS])
+{
+	unsigned __int128 acc;
+	uint64_t r0, r1, r2, c;
+
+	// r = (t2, t1, t0) + (0, t3, t3) + (t4, t4, 0) + (t5, t5, t5)
+	acc = (unsigned __int128)t[0] + t[3] + t[5];
+	r0 = (uint64_t)acc;
+	acc = (acc >> 64) + t[1] + t[3] + t[4] + t[5];
+	r1 = (uint64_t)acc;
+	acc = (acc >> 64) + t[2] + t[4] + t[5];
+	r2 = (uint64_t)acc;
+	c = (uint64_t)(acc >> 64);
+
+	// Fold the carry, c * 2^192 = c * (2^64 + 1)
+	while (c != 0) {
+		acc = (unsigned __int128)r0 + c;
+		r0 = (uint64_t)acc;
+		acc = (acc >> 64) + r1 + c;
+		r1 = (uint64_t)acc;
+		acc = (acc >> 64) + r2;
+		r2 = (uint64_t)acc;
+		c = (uint64_t)(acc >> 64);
+	}
+
+	// At this point r < 2^192 < 2p, so one subtraction of p is enough
+	if (r2 == 0xffffffffffffffffUL
+	    && (r1 == 0xffffffffffffffffUL
+		|| (r1 == 0xfffffffffffffffeUL && r0 == 0xffffffffffffffffUL))) {
+		// r - p = r + 2^64 + 1 - 2^192
+		acc = (unsigned __int128)r0 + 1;
+		r0 = (uint64_t)acc;
+		acc = (acc >> 64) + r1 + 1;
+		r1 = (uint64_t)acc;
+		r2 = 0;
+	}
+
+	r[0] = r0;
+	r[1] = r1;
+	r[2] = r2;
+}
+
+#else
+/**
+ * Subtracts p = 2^192 - c from r if r >= p, without branching on r
+ *
+ * r >= p exactly when r + c carries out of the top limb, and then
+ * r + c - 2^192 is the result.
+ *
+ * r is the number to reduce, which must be less than 2p.
+ * c is 2^192 - p.
+ */
+void p192_reduce_once(limb_t r[FIELD_LIMBS], const limb_t c[FIELD_LIMBS])
+{
+	limb_t s[FIELD_LIMBS];
+	limb_t mask;
+	dlimb_t acc = 0;
+	int i;
+
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		acc = (acc >> FIELD_LIMB_BITS) + r[i] + c[i];
+		s[i] = (limb_t)acc;
+	}
+	mask = -(limb_t)(acc >> FIELD_LIMB_BITS);
+	for (i = 0; i < FIELD_LIMBS; i++)
+		r[i] = (s[i] & mask) | (r[i] & ~mask);
+}
+
+/**
+ * Reduces a 384-bit number modulo p = 2^192 - 2^32 - 4553 (secp192k1),
+ * on 32-bit limbs
+ *
+ * This is the fold of the 64-bit version: 2^192 = 2^32 + 4553 mod p,
+ * so the upper half h of t is added back as h * 4553 plus h shifted up
+ * by one limb.
+ *
+ * r is the return variable holding six limbs, least significant first.
+ * t is the number to reduce as twelve limbs, least significant first.
+ */
+void p192k1_reduce(limb_t r[FIELD_LIMBS], const limb_t t[2 * FIELD_LIMBS])
+{
+	const limb_t c[FIELD_LIMBS] = { 0x11c9, 1 };
+	const limb_t *h = &t[FIELD_LIMBS];
+	dlimb_t acc = 0, top, x;
+	int i;
+
+	// r = l + h * c, leaving top as the part above 2^192
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		acc += (dlimb_t)h[i] * c[0] + t[i];
+		if (i > 0)
+			acc += h[i - 1];
+		r[i] = (limb_t)acc;
+		acc >>= FIELD_LIMB_BITS;
+	}
+	top = acc + h[FIELD_LIMBS - 1];
+
+	// Second fold, top * c is less than 2^67
+	x = top * c[0];
+	acc = (dlimb_t)r[0] + (limb_t)x;
+	r[0] = (limb_t)acc;
+	acc = (acc >> FIELD_LIMB_BITS) + r[1] + (x >> FIELD_LIMB_BITS)
+		+ (limb_t)top;
+	r[1] = (limb_t)acc;
+	acc = (acc >> FIELD_LIMB_BITS) + r[2] + (top >> FIELD_LIMB_BITS);
+	r[2] = (limb_t)acc;
+	for (i = 3; i < FIELD_LIMBS; i++) {
+		acc = (acc >> FIELD_LIMB_BITS) + r[i];
+		r[i] = (limb_t)acc;
+	}
+
+	// A carry out of the top limb leaves r small, so adding c is safe
+	if ((acc >> FIELD_LIMB_BITS) != 0) {
+		acc = 0;
+		for (i = 0; i < FIELD_LIMBS; i++) {
+			acc = (acc >> FIELD_LIMB_BITS) + r[i] + c[i];
+			r[i] = (limb_t)acc;
+		}
+	}
+
+	// r < 2^192 < 2p, so one subtraction of p is enough
+	p192_reduce_once(r, c);
+}
+
+/**
+ * Reduces a 384-bit number modulo p = 2^192 - 2^64 - 1 (secp192r1),
+ * on 32-bit limbs
+ *
+ * This is the NIST fast reduction of the 64-bit version, with each of
+ * its 64-bit words split into two limbs.
+ *
+ * r is the return variable holding six limbs, least significant first.
+ * t is the number to reduce as twelve limbs, least significant first.
+ */
+void p192r1_reduce(limb_t r[FIELD_LIMBS], const limb_t t[2 * FIELD_LIMBS])
+{
+	const limb_t c[FIELD_LIMBS] = { 1, 0, 1 };
+	dlimb_t acc = 0;
+	limb_t carry;
+	int i, half;
+
+	// Words: r = (t2, t1, t0) + (0, t3, t3) + (t4, t4, 0) + (t5, t5, t5)
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		half = i % 2;
+		acc += (dlimb_t)t[i] + t[10 + half];
+		if (i < 4)
+			acc += t[6 + half];
+		if (i >= 2)
+			acc += t[8 + half];
+		r[i] = (limb_t)acc;
+		acc >>= FIELD_LIMB_BITS;
+	}
+	carry = (limb_t)acc;
+
+	// Fold the carry, carry * 2^192 = carry * (2^64 + 1)
+	while (carry != 0) {
+		acc = 0;
+		for (i = 0; i < FIELD_LIMBS; i++) {
+			acc = (acc >> FIELD_LIMB_BITS) + r[i] + c[i] * carry;
+			r[i] = (limb_t)acc;
+		}
+		carry = (limb_t)(acc >> FIELD_LIMB_BITS);
+	}
+
+	// At this point r < 2^192 < 2p, so one subtraction of p is enough
+	p192_reduce_once(r, c);
+}
+#endif
+
+/**
+ * A field element of the 192-bit fields
+ *
+ * The element is held in FIELD_LIMBS fixed limbs of FIELD_LIMB_BITS,
+ * least significant first, so it needs no heap allocation and can live on
+ * the stack or inline in other structs. Like mpz_t, it is an array
+ * type and is passed by reference.
+ */
+typedef limb_t fe_t[FIELD_LIMBS];
+
+/**
+ * A collection of field inversion algorithms
+ *
+ * INVERSION_SAFEGCD is the divstep algorithm of safegcd_inv.
+ * INVERSION_FERMAT is exponentiation to p - 2, see fe_inv_fermat.
+ */
+enum Inversions {
+	INVERSION_SAFEGCD,
+	INVERSION_FERMAT
+};
+
+/**
+ * Struct holding everything the fixed-limb arithmetic needs to know
+ * about a prime field
+ *
+ * Elements are kept either in plain form, reduced with the dedicated
+ * kernel for the prime, or in Montgomery form a * 2^192 mod p, reduced
+ * with Montgomery reduction. Montgomery form is always used for a prime
+ * without a dedicated kernel.
+ *
+ * The members read by every multiplication and reduction come first, so
+ * that they share the first cache line of the struct.
+ *
+ * prime is the prime number defining the field.
+ * n0 is -p^-1 mod 2^FIELD_LIMB_BITS, used by Montgomery reduction.
+ * type is the dedicated reduction kernel for the prime, if any.
+ * montgomery is set if elements are held in Montgomery form.
+ * inversion is the algorithm used by fe_inv. It can be changed at any
+ * time, e.g. to compare the two.
+ * one is the number 1 in the representation used by the field.
+ * r2 is 2^384 mod p, used to convert into Montgomery form.
+ * r3 is 2^576 mod p, used to bring an inverse back into Montgomery form.
+ */
+struct Field {
+	fe_t prime;
+	limb_t n0;
+	enum Fields type;
+	int montgomery;
+	enum Inversions inversion;
+	fe_t one;
+	fe_t r2;
+	fe_t r3;
+};
+
+/**
+ * Returns -p^-1 mod 2^FIELD_LIMB_BITS for an odd p, given its least
+ * significant limb
+ */
+limb_t field_n0(limb_t p0)
+{
+	limb_t inv = 1;
+	int i;
+
+	// Newton iteration doubles the number of correct bits each step
+	for (i = 0; i < 6; i++)
+		inv *= 2 - p0 * inv;
+	return -inv;
+}
+
+/**
+ * Initializes the fixed-limb arithmetic context for the prime p
+ *
+ * f is the context to initialize.
+ * p is the prime number defining the field. It must fit in FIELD_LIMBS
+ * limbs and be odd.
+ * montgomery requests Montgomery form even if p has a dedicated kernel.
+ */
+void field_init(struct Field *f, mpz_t p, int montgomery)
+{
+	mpz_t tmp;
+
+	mpz_init(tmp);
+	memset(f, 0, sizeof(*f));
+	mpz_export(f->prime, NULL, -1, sizeof(limb_t), 0, 0, p);
+	f->n0 = field_n0(f->prime[0]);
+
+	f->type = prime_field_type(p);
+	f->montgomery = montgomery || f->type == FIELD_GENERIC;
+	f->inversion = INVERSION_SAFEGCD;
+
+	mpz_setbit(tmp, 2 * FIELD_BITS);
+	mpz_mod(tmp, tmp, p);
+	mpz_export(f->r2, NULL, -1, sizeof(limb_t), 0, 0, tmp);
+
+	mpz_set_ui(tmp, 0UL);
+	mpz_setbit(tmp, 3 * FIELD_BITS);
+	mpz_mod(tmp, tmp, p);
+	mpz_export(f->r3, NULL, -1, sizeof(limb_t), 0, 0, tmp);
+
+	if (f->montgomery) {
+		mpz_set_ui(tmp, 0UL);
+		mpz_setbit(tmp, FIELD_BITS);
+		mpz_mod(tmp, tmp, p);
+		mpz_export(f->one, NULL, -1, sizeof(limb_t), 0, 0, tmp);
+	} else {
+		f->one[0] = 1;
+	}
+	mpz_clear(tmp);
+}
+
+/**
+ * Computes r = a - p if a >= p, else r = a, without branching on a
+ *
+ * carry is the bit above the most significant limb of a.
+ */
+void fe_reduce_once(fe_t r, const fe_t a, limb_t carry,
+			const struct Field *f)
+{
+	fe_t d;
+	dlimb_t acc;
+	limb_t borrow = 0;
+	limb_t mask;
+	int i;
+
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		acc = (dlimb_t)a[i] - f->prime[i] - borrow;
+		d[i] = (limb_t)acc;
+		borrow = (limb_t)(acc >> FIELD_LIMB_BITS) & 1;
+	}
+
+	// Keep a only if the subtraction borrowed more than the carry
+	mask = -(limb_t)(borrow > carry);
+	for (i = 0; i < FIELD_LIMBS; i++)
+		r[i] = (a[i] & mask) | (d[i] & ~mask);
+}
+
+/**
+ * Montgomery reduction of a 384-bit number
+ *
+ * Computes r = t * 2^-192 mod p with one multiply-add pass per limb.
+ * See https://en.wikipedia.org/wiki/Montgomery_modular_multiplication
+ * for details.
+ *
+ * r is the return variable.
+ * t is the number to reduce as 2 * FIELD_LIMBS limbs, least significant
+ * first.
+ * It must be less than p * 2^192.
+ * f is the field.
+ */
+void montgomery_reduce(fe_t r, const limb_t t[2 * FIELD_LIMBS],
+			const struct Field *f)
+{
+	limb_t w[2 * FIELD_LIMBS];
+	dlimb_t acc;
+	limb_t m, carry, top = 0;
+	int i, j;
+
+	memcpy(w, t, sizeof(w));
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		// Adding m * p clears limb i
+		m = w[i] * f->n0;
+		carry = 0;
+		for (j = 0; j < FIELD_LIMBS; j++) {
+			acc = (dlimb_t)m * f->prime[j] + w[i + j] + carry;
+			w[i + j] = (limb_t)acc;
+			carry = (limb_t)(acc >> FIELD_LIMB_BITS);
+		}
+		for (j = i + FIELD_LIMBS; j < 2 * FIELD_LIMBS; j++) {
+			acc = (dlimb_t)w[j] + carry;
+			w[j] = (limb_t)acc;
+			carry = (limb_t)(acc >> FIELD_LIMB_BITS);
+		}
+		top += carry;
+	}
+	fe_reduce_once(r, &w[FIELD_LIMBS], top, f);
+}
+
+/**
+ * Reduces a 384-bit product into the representation used by the field
+ *
+ * r is the return variable.
+ * t is the number to reduce as 2 * FIELD_LIMBS limbs, least significant
+ * first.
+ * f is the field.
+ */
+void fe_reduce(fe_t r, const limb_t t[2 * FIELD_LIMBS], const struct Field *f)
+{
+	if (f->montgomery) {
+		montgomery_reduce(r, t, f);
+		return;
+	}
+
+	switch (f->type) {
+	case FIELD_P192K1:
+		p192k1_reduce(r, t);
+		break;
+	case FIELD_P192R1:
+	default:
+		p192r1_reduce(r, t);
+	}
+}
+
+/**
+ * Multiplies two field elements, in portable C
+ *
+ * The full 384-bit product is computed with schoolbook multiply-add
+ * carry chains of double-width limb products and then reduced with
+ * fe_reduce.
+ *
+ * r is the return variable. It may alias a or b.
+ * a and b are the numbers to multiply.
+ * f is the field.
+ */
+void fe_mul_generic(fe_t r, const fe_t a, const fe_t b,
+			const struct Field *f)
+{
+	limb_t t[2 * FIELD_LIMBS];
+	dlimb_t acc;
+	limb_t carry;
+	int i, j;
+
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		carry = 0;
+		for (j = 0; j < FIELD_LIMBS; j++) {
+			acc = (dlimb_t)a[i] * b[j] + carry;
+			if (i > 0)
+				acc += t[i + j];
+			t[i + j] = (limb_t)acc;
+			carry = (limb_t)(acc >> FIELD_LIMB_BITS);
+		}
+		t[i + FIELD_LIMBS] = carry;
+	}
+	fe_reduce(r, t, f);
+}
+
+/**
+ * Squares a field element, in portable C
+ *
+ * Each cross product a[i] * a[j] with i != j appears twice in a square,
+ * so they are computed once and doubled with a shift before adding the
+ * diagonal squares a[i]^2. This takes n(n + 1)/2 limb multiplications
+ * instead of the n^2 of fe_mul, and shares its reduction.
+ *
+ * r is the return variable. It may alias a.
+ * a is the number to square.
+ * f is the field.
+ */
+void fe_sq_generic(fe_t r, const fe_t a, const struct Field *f)
+{
+	limb_t t[2 * FIELD_LIMBS] = { 0 };
+	dlimb_t acc, d;
+	limb_t carry;
+	int i, j;
+
+	// Cross products a[i] a[j] with i < j
+	for (i = 0; i < FIELD_LIMBS - 1; i++) {
+		carry = 0;
+		for (j = i + 1; j < FIELD_LIMBS; j++) {
+			acc = (dlimb_t)a[i] * a[j] + t[i + j] + carry;
+			t[i + j] = (limb_t)acc;
+			carry = (limb_t)(acc >> FIELD_LIMB_BITS);
+		}
+		t[i + FIELD_LIMBS] = carry;
+	}
+
+	// Double them
+	for (i = 2 * FIELD_LIMBS - 1; i > 0; i--)
+		t[i] = (t[i] << 1) | (t[i - 1] >> (FIELD_LIMB_BITS - 1));
+
+	// Add the diagonal squares
+	acc = 0;
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		d = (dlimb_t)a[i] * a[i];
+		acc = (acc >> FIELD_LIMB_BITS) + t[2 * i] + (limb_t)d;
+		t[2 * i] = (limb_t)acc;
+		acc = (acc >> FIELD_LIMB_BITS) + t[2 * i + 1]
+			+ (limb_t)(d >> FIELD_LIMB_BITS);
+		t[2 * i + 1] = (limb_t)acc;
+	}
+	fe_reduce(r, t, f);
+}
+
+/**
+ * Set if the backend is picked at runtime, see struct Backend
+ *
+ * Builds with -DECDH_NO_GMP are for small targets, so they leave out
+ * the dispatch and the backends needing CPU detection, and run on the
+ * portable backend only. -DFIELD_DISPATCH=0 does the same elsewhere.
+ */
+#ifndef FIELD_DISPATCH
+#ifdef ECDH_NO_GMP
+#define FIELD_DISPATCH 0
+#else
+#define FIELD_DISPATCH 1
+#endif
+#endif
+
+/**
+ * Set if the MULX/ADX field kernels are compiled in, which needs 64-bit
+ * limbs on x86-64, GNU C inline assembly and the runtime dispatch
+ */
+#if FIELD_DISPATCH && FIELD_LIMB_BITS == 64 && defined(__x86_64__) \
+	&& defined(__GNUC__)
+#define FIELD_MULX 1
+#else
+#define FIELD_MULX 0
+#endif
+
+#if FIELD_MULX
+/**
+ * Computes the 384-bit product t = a b with MULX, ADCX and ADOX
+ *
+ * Each row of limb products a[j] b[i] is added into t with two carry
+ * chains, one through the carry flag for the high halves and one
+ * through the overflow flag for the low halves, so the additions of a
+ * row do not wait on each other. MULX leaves both flags alone.
+ */
+static inline void fe_product_mulx(limb_t t[2 * FIELD_LIMBS], const fe_t a,
+					const fe_t b)
+{
+	limb_t t0, t1, t2, t3, t4, t5, lo, hi;
+
+	__asm__(
+		// Row 0, with a single carry chain
+		"movq 0(%[b]), %%rdx\n\t"
+		"mulxq 0(%[a]), %[t0], %[t1]\n\t"
+		"mulxq 8(%[a]), %[lo], %[t2]\n\t"
+		"addq %[lo], %[t1]\n\t"
+		"mulxq 16(%[a]), %[lo], %[t3]\n\t"
+		"adcq %[lo], %[t2]\n\t"
+		"adcq $0, %[t3]\n\t"
+
+		// Row 1, xor clears both flags
+		"xorl %k[t4], %k[t4]\n\t"
+		"movq 8(%[b]), %%rdx\n\t"
+		"mulxq 0(%[a]), %[lo], %[hi]\n\t"
+		"adoxq %[lo], %[t1]\n\t"
+		"adcxq %[hi], %[t2]\n\t"
+		"mulxq 8(%[a]), %[lo], %[hi]\n\t"
+		"adoxq %[lo], %[t2]\n\t"
+		"adcxq %[hi], %[t3]\n\t"
+		"mulxq 16(%[a]), %[lo], %[hi]\n\t"
+		"adoxq %[lo], %[t3]\n\t"
+		"adcxq %[hi], %[t4]\n\t"
+		"movl $0, %k[lo]\n\t"
+		"adoxq %[lo], %[t4]\n\t"
+
+		// Row 2
+		"xorl %k[t5], %k[t5]\n\t"
+		"movq 16(%[b]), %%rdx\n\t"
+		"mulxq 0(%[a]), %[lo], %[hi]\n\t"
+		"adoxq %[lo], %[t2]\n\t"
+		"adcxq %[hi], %[t3]\n\t"
+		"mulxq 8(%[a]), %[lo], %[hi]\n\t"
+		"adoxq %[lo], %[t3]\n\t"
+		"adcxq %[hi], %[t4]\n\t"
+		"mulxq 16(%[a]), %[lo], %[hi]\n\t"
+		"adoxq %[lo], %[t4]\n\t"
+		"adcxq %[hi], %[t5]\n\t"
+		"movl $0, %k[lo]\n\t"
+		"adoxq %[lo], %[t5]\n\t"
+		: [t0] "=&r" (t0), [t1] "=&r" (t1), [t2] "=&r" (t2),
+		  [t3] "=&r" (t3), [t4] "=&r" (t4), [t5] "=&r" (t5),
+		  [lo] "=&r" (lo), [hi] "=&r" (hi)
+		: [a] "r" (a), [b] "r" (b),
+		  "m" (*(const fe_t *)a), "m" (*(const fe_t *)b)
+		: "rdx", "cc");
+
+	t[0] = t0;
+	t[1] = t1;
+	t[2] = t2;
+	t[3] = t3;
+	t[4] = t4;
+	t[5] = t5;
+}
+
+/**
+ * Multiplies two field elements with MULX and ADX, like fe_mul_generic
+ */
+void fe_mul_mulx(fe_t r, const fe_t a, const fe_t b, const struct Field *f)
+{
+	limb_t t[2 * FIELD_LIMBS];
+
+	fe_product_mulx(t, a, b);
+	fe_reduce(r, t, f);
+}
+
+/**
+ * Squares a field element with MULX and ADX
+ *
+ * This is a full product: with three limbs the three products saved by
+ * squaring do not pay for the extra carry chain of the doubling.
+ */
+void fe_sq_mulx(fe_t r, const fe_t a, const struct Field *f)
+{
+	limb_t t[2 * FIELD_LIMBS];
+
+	fe_product_mulx(t, a, a);
+	fe_reduce(r, t, f);
+}
+
+/**
+ * Returns 1 if the CPU can run the MULX/ADX field kernels
+ */
+static int field_mulx_supported(void)
+{
+	return __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("adx");
+}
+#endif
+
+struct Point;
+struct Curve;
+struct Scratch;
+
+/**
+ * Largest number of multi-buffer engines of a backend
+ */
+#define BACKEND_ENGINES 2
+
+/**
+ * A multi-buffer engine of a backend, see multibuf.h
+ *
+ * lanes is the number of scalar multiplications run in lockstep, or 0
+ * if there is no engine.
+ * scalar_mult computes r[l] = k[l] p[l] for every lane l.
+ */
+struct MultiBufEngine {
+	int lanes;
+	void (*scalar_mult)(struct Point *const r[], struct Point *const p[],
+				mpz_ptr const k[], const struct Curve *ec,
+				struct Scratch *s);
+};
+
+/**
+ * An entry of the dispatch table of the arithmetic backends
+ *
+ * One backend is picked at startup, from the CPU features or from the
+ * ECDH_BACKEND environment variable, see get_backend in ecdh.c. All of
+ * them compute the same results.
+ *
+ * name is the name of the backend, as given in ECDH_BACKEND.
+ * supported returns 1 if the CPU can run the backend, or is NULL if
+ * every CPU can.
+ * fe_mul and fe_sq are the field multiplication and squaring behind
+ * fe_mul and fe_sq.
+ * engines are the multi-buffer engines used by scalar_mult_batch_into,
+ * from the most lanes down.
+ */
+struct Backend {
+	const char *name;
+	int (*supported)(void);
+	void (*fe_mul)(fe_t r, const fe_t a, const fe_t b,
+			const struct Field *f);
+	void (*fe_sq)(fe_t r, const fe_t a, const struct Field *f);
+	struct MultiBufEngine engines[BACKEND_ENGINES];
+};
+
+/**
+ * The portable backend, which every CPU can run
+ */
+static const struct Backend backend_generic = {
+	"generic", NULL, fe_mul_generic, fe_sq_generic, { { 0, NULL } }
+};
+
+#if FIELD_MULX
+/**
+ * The fixed-limb backend for x86-64 CPUs with BMI2 and ADX
+ */
+static const struct Backend backend_mulx = {
+	"mulx", field_mulx_supported, fe_mul_mulx, fe_sq_mulx, { { 0, NULL } }
+};
+#endif
+
+#if FIELD_DISPATCH
+/**
+ * The backend in use
+ *
+ * It starts out as the portable backend, and is set once by get_backend
+ * in ecdh.c, at startup where the compiler supports it.
+ */
+static const struct Backend *backend = &backend_generic;
+#endif
+
+/**
+ * Multiplies two field elements with the kernel of the backend
+ *
+ * r is the return variable. It may alias a or b.
+ * a and b are the numbers to multiply.
+ * f is the field.
+ */
+void fe_mul(fe_t r, const fe_t a, const fe_t b, const struct Field *f)
+{
+	FIELD_COUNT(field_mul_count);
+#if FIELD_DISPATCH
+	backend->fe_mul(r, a, b, f);
+#else
+	fe_mul_generic(r, a, b, f);
+#endif
+}
+
+/**
+ * Squares a field element with the kernel of the backend
+ *
+ * r is the return variable. It may alias a.
+ * a is the number to square.
+ * f is the field.
+ */
+void fe_sq(fe_t r, const fe_t a, const struct Field *f)
+{
+	FIELD_COUNT(field_sq_count);
+#if FIELD_DISPATCH
+	backend->fe_sq(r, a, f);
+#else
+	fe_sq_generic(r, a, f);
+#endif
+}
+
+/**
+ * Adds two field elements
+ *
+ * r is the return variable. It may alias a or b.
+ * a and b are the numbers to add.
+ * f is the field.
+ */
+void fe_add(fe_t r, const fe_t a, const fe_t b, const struct Field *f)
+{
+	fe_t s;
+	dlimb_t acc = 0;
+	int i;
+
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		acc = (acc >> FIELD_LIMB_BITS) + a[i] + b[i];
+		s[i] = (limb_t)acc;
+	}
+	fe_reduce_once(r, s, (limb_t)(acc >> FIELD_LIMB_BITS), f);
+}
+
+/**
+ * Subtracts two field elements
+ *
+ * r is the return variable. It may alias a or b.
+ * a and b are the numbers to subtract.
+ * f is the field.
+ */
+void fe_sub(fe_t r, const fe_t a, const fe_t b, const struct Field *f)
+{
+	dlimb_t acc;
+	limb_t borrow = 0;
+	limb_t mask;
+	int i;
+
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		acc = (dlimb_t)a[i] - b[i] - borrow;
+		r[i] = (limb_t)acc;
+		borrow = (limb_t)(acc >> FIELD_LIMB_BITS) & 1;
+	}
+
+	// Add p back if the subtraction went below zero
+	mask = -borrow;
+	acc = 0;
+	for (i = 0; i < FIELD_LIMBS; i++) {
+		acc = (acc >> FIELD_LIMB_BITS) + r[i] + (f->prime[i] & mask);
+		r[i] = (limb_t)acc;
+	}
+}
+
+/**
+ * Returns 1 if the field element is zero, 0 otherwise
+ */
+int fe_is_zero(const fe_t a)
+{
+	limb_t acc = 0;
+	int i;
+
+	for (i = 0; i < FIELD_LIMBS; i++)
+		acc |= a[i];
+	return acc == 0;
+}
+
+/**
+ * Returns 1 if the two field elements are equal, 0 otherwise
+ */
+int fe_equal(const fe_t a, const fe_t b)
+{
+	limb_t acc = 0;
+	int i;
+
+	for (i = 0; i < FIELD_LIMBS; i++)
+		acc |= a[i] ^ b[i];
+	return acc == 0;
+}
+
+/**
+ * Sets r to a if flag is 1 and leaves it unchanged if flag is 0,
+ * without branching on flag
+ */
+void fe_cmov(fe_t r, const fe_t a, int flag)
+{
+	limb_t mask = -(limb_t)flag;
+	int i;
+
+	for (i = 0; i < FIELD_LIMBS; i++)
+		r[i] ^= (r[i] ^ a[i]) & mask;
+}
+
+/**
+ * Squares a field element n times in a row, computing a^(2^n)
+ *
+ * r is the return variable. It may alias a.
+ */
+void fe_sq_n(fe_t r, const fe_t a, int n, const struct Field *f)
+{
+	int i;
+
+	memcpy(r, a, sizeof(fe_t));
+	for (i = 0; i < n; i++)
+		fe_sq(r, r, f);
+}
+
+/**
+ * Computes a^(p - 2) for p = 2^192 - 2^32 - 4553 (secp192k1)
+ *
+ * In binary, p - 2 is 159 ones, 0, 19 ones, 0, 111, 000, 11, 01, 01.
+ * x[n] below stands for a^(2^n - 1), i.e. n ones, and the blocks are
+ * built from each other with 191 squarings and 16 multiplications.
+ */
+void p192k1_inv_chain(fe_t r, const fe_t a, const struct Field *f)
+{
+	fe_t x2, x3, x6, x7, x8, x11, x19, t;
+
+	fe_sq(x2, a, f);
+	fe_mul(x2, x2, a, f);
+	fe_sq(x3, x2, f);
+	fe_mul(x3, x3, a, f);
+	fe_sq_n(x6, x3, 3, f);
+	fe_mul(x6, x6, x3, f);
+	fe_sq(x7, x6, f);
+	fe_mul(x7, x7, a, f);
+	fe_sq(x8, x7, f);
+	fe_mul(x8, x8, a, f);
+	fe_sq_n(x11, x8, 3, f);
+	fe_mul(x11, x11, x3, f);
+	fe_sq_n(x19, x11, 8, f);
+	fe_mul(x19, x19, x8, f);
+
+	// t = x38, x76, x152 and then x159
+	fe_sq_n(t, x19, 19, f);
+	fe_mul(t, t, x19, f);
+	fe_sq_n(r, t, 38, f);
+	fe_mul(t, r, t, f);
+	fe_sq_n(r, t, 76, f);
+	fe_mul(t, r, t, f);
+	fe_sq_n(t, t, 7, f);
+	fe_mul(t, t, x7, f);
+
+	// Append the low 33 bits of p - 2
+	fe_sq_n(t, t, 20, f);
+	fe_mul(t, t, x19, f);
+	fe_sq_n(t, t, 4, f);
+	fe_mul(t, t, x3, f);
+	fe_sq_n(t, t, 5, f);
+	fe_mul(t, t, x2, f);
+	fe_sq_n(t, t, 2, f);
+	fe_mul(t, t, a, f);
+	fe_sq_n(t, t, 2, f);
+	fe_mul(r, t, a, f);
+}
+
+/**
+ * Computes a^(p - 2) for p = 2^192 - 2^64 - 1 (secp192r1)
+ *
+ * In binary, p - 2 is 127 ones, 0, 62 ones, 01. x[n] below stands for
+ * a^(2^n - 1), and the blocks are built from each other with 191
+ * squarings and 12 multiplications.
+ */
+void p192r1_inv_chain(fe_t r, const fe_t a, const struct Field *f)
+{
+	fe_t x2, x3, x6, x12, x62, t;
+
+	fe_sq(x2, a, f);
+	fe_mul(x2, x2, a, f);
+	fe_sq(x3, x2, f);
+	fe_mul(x3, x3, a, f);
+	fe_sq_n(x6, x3, 3, f);
+	fe_mul(x6, x6, x3, f);
+	fe_sq_n(x12, x6, 6, f);
+	fe_mul(x12, x12, x6, f);
+
+	// t = x24, x48, x60 and then x62
+	fe_sq_n(t, x12, 12, f);
+	fe_mul(t, t, x12, f);
+	fe_sq_n(r, t, 24, f);
+	fe_mul(t, r, t, f);
+	fe_sq_n(t, t, 12, f);
+	fe_mul(t, t, x12, f);
+	fe_sq_n(x62, t, 2, f);
+	fe_mul(x62, x62, x2, f);
+
+	// t = x124 and then x127
+	fe_sq_n(t, x62, 62, f);
+	fe_mul(t, t, x62, f);
+	fe_sq_n(t, t, 3, f);
+	fe_mul(t, t, x3, f);
+
+	// Append the low 65 bits of p - 2
+	fe_sq_n(t, t, 63, f);
+	fe_mul(t, t, x62, f);
+	fe_sq_n(t, t, 2, f);
+	fe_mul(r, t, a, f);
+}
+
+/**
+ * Computes the inverse of a field element by exponentiation
+ *
+ * The inverse is computed as a^(p - 2) using Fermat's little theorem.
+ * secp192k1 and secp192r1 use a fixed addition chain for their p - 2,
+ * any other prime a left-to-right square-and-multiply over the bits of
+ * p - 2. Either way, the sequence of operations only depends on p, not
+ * on a, and works unchanged in Montgomery form.
+ *
+ * r is the return variable. It may alias a.
+ * a is the number to invert. The inverse of zero is zero.
+ * f is the field.
+ */
+void fe_inv_fermat(fe_t r, const fe_t a, const struct Field *f)
+{
+	fe_t e;
+	fe_t base;
+	fe_t acc;
+	int i;
+
+	switch (f->type) {
+	case FIELD_P192K1:
+		p192k1_inv_chain(r, a, f);
+		return;
+	case FIELD_P192R1:
+		p192r1_inv_chain(r, a, f);
+		return;
+	case FIELD_GENERIC:
+	default:
+		break;
+	}
+
+	// p is odd and larger than 2, so this never borrows
+	memcpy(e, f->prime, sizeof(e));
+	e[0] -= 2;
+
+	memcpy(base, a, sizeof(base));
+	memcpy(acc, f->one, sizeof(acc));
+	for (i = FIELD_BITS - 1; i >= 0; i--) {
+		fe_sq(acc, acc, f);
+		if ((e[i / FIELD_LIMB_BITS] >> (i % FIELD_LIMB_BITS)) & 1)
+			fe_mul(acc, acc, base, f);
+	}
+	memcpy(r, acc, sizeof(acc));
+}
+
+/**
+ * Limbs of the inversion engine
+ *
+ * safegcd_inv works on signed limbs of SAFEGCD_BITS bits, two less than
+ * the machine word holding them, and multiplies them into double-width
+ * accumulators. With 64-bit field limbs these are signed 62-bit limbs
+ * in int64_t and __int128, with 32-bit field limbs signed 30-bit limbs
+ * in int32_t and int64_t, as in the modinv64 and modinv32 modules of
+ * libsecp256k1.
+ *
+ * Four 62-bit or seven 30-bit limbs hold any value of up to 247 or 211
+ * bits, which leaves enough room above a 192-bit prime for the signed
+ * intermediates of fe_inv.
+ *
+ * Bernstein and Yang prove that floor((49 * 192 + 57) / 17) = 556
+ * divsteps are always enough for inputs below 2^192, which rounds up
+ * to SAFEGCD_BATCHES batches of SAFEGCD_BITS divsteps.
+ */
+#if FIELD_LIMB_BITS == 64
+#define SAFEGCD_BITS 62
+#define SAFEGCD_LIMBS 4
+#define SAFEGCD_BATCHES 9
+typedef int64_t sg_limb_t;
+typedef uint64_t sg_ulimb_t;
+typedef __int128 sg_dlimb_t;
+#else
+#define SAFEGCD_BITS 30
+#define SAFEGCD_LIMBS 7
+#define SAFEGCD_BATCHES 19
+typedef int32_t sg_limb_t;
+typedef uint32_t sg_ulimb_t;
+typedef int64_t sg_dlimb_t;
+#endif
+
+/**
+ * Mask of the low SAFEGCD_BITS bits of a limb, and the shift moving
+ * the sign bit of a limb down to bit 0
+ */
+#define SAFEGCD_MASK ((sg_ulimb_t)-1 >> 2)
+#define SAFEGCD_SIGN (SAFEGCD_BITS + 1)
+
+/**
+ * Struct holding the transition matrix of a batch of SAFEGCD_BITS
+ * divsteps
+ *
+ * After the batch, 2^SAFEGCD_BITS [f, g] = [u v; q r] [f, g] for the
+ * values of f and g before the batch.
+ */
+struct Trans2x2 {
+	sg_limb_t u;
+	sg_limb_t v;
+	sg_limb_t q;
+	sg_limb_t r;
+};
+
+/**
+ * Runs SAFEGCD_BITS divsteps on the low bits of f and g, without
+ * branching
+ *
+ * A divstep maps (delta, f, g) to (1 - delta, g, (g - f) / 2) if
+ * delta > 0 and g is odd, and to (1 + delta, f, (g + (g mod 2) f) / 2)
+ * otherwise. Only the bottom SAFEGCD_BITS bits of f and g decide the
+ * transition matrix of SAFEGCD_BITS divsteps, so they run on single
+ * machine words. See https://gcd.cr.yp.to/safegcd-20190413.pdf for
+ * details.
+ *
+ * delta is the value of delta before the batch.
+ * f and g are the bottom limbs of f and g. f must be odd.
+ * *t will hold the transition matrix.
+ *
+ * Returns the value of delta after the batch
+ */
+sg_limb_t safegcd_divsteps(sg_limb_t delta, sg_ulimb_t f, sg_ulimb_t g,
+				struct Trans2x2 *t)
+{
+	// Entries are signed, kept unsigned so that the shifts are defined
+	sg_ulimb_t u = 1, v = 0, q = 0, r = 1;
+	sg_ulimb_t c1, c2, x, y, z;
+	int i;
+
+	for (i = 0; i < SAFEGCD_BITS; i++) {
+		// c1 is all ones if delta > 0, c2 is all ones if g is odd
+		c1 = (sg_ulimb_t)(-delta >> SAFEGCD_SIGN);
+		c2 = -(g & 1);
+
+		// g becomes g - f if both hold, g + f if only g is odd
+		x = (f ^ c1) - c1;
+		y = (u ^ c1) - c1;
+		z = (v ^ c1) - c1;
+		g += x & c2;
+		q += y & c2;
+		r += z & c2;
+
+		// On a swap, f becomes the old g and delta becomes -delta
+		c1 &= c2;
+		delta = (delta ^ (sg_limb_t)c1) - (sg_limb_t)c1 + 1;
+		f += g & c1;
+		u += q & c1;
+		v += r & c1;
+
+		g >>= 1;
+		u <<= 1;
+		v <<= 1;
+	}
+
+	t->u = (sg_limb_t)u;
+	t->v = (sg_limb_t)v;
+	t->q = (sg_limb_t)q;
+	t->r = (sg_limb_t)r;
+	return delta;
+}
+
+/**
+ * Computes [f, g] = t [f, g] / 2^SAFEGCD_BITS on signed limbs
+ *
+ * The division is exact by construction of t.
+ */
+void safegcd_update_fg(sg_limb_t f[SAFEGCD_LIMBS], sg_limb_t g[SAFEGCD_LIMBS],
+			const struct Trans2x2 *t)
+{
+	sg_dlimb_t cf, cg;
+	int i;
+
+	cf = (sg_dlimb_t)t->u * f[0] + (sg_dlimb_t)t->v * g[0];
+	cg = (sg_dlimb_t)t->q * f[0] + (sg_dlimb_t)t->r * g[0];
+	cf >>= SAFEGCD_BITS;
+	cg >>= SAFEGCD_BITS;
+	for (i = 1; i < SAFEGCD_LIMBS; i++) {
+		cf += (sg_dlimb_t)t->u * f[i] + (sg_dlimb_t)t->v * g[i];
+		cg += (sg_dlimb_t)t->q * f[i] + (sg_dlimb_t)t->r * g[i];
+		f[i - 1] = (sg_limb_t)((sg_ulimb_t)cf & SAFEGCD_MASK);
+		g[i - 1] = (sg_limb_t)((sg_ulimb_t)cg & SAFEGCD_MASK);
+		cf >>= SAFEGCD_BITS;
+		cg >>= SAFEGCD_BITS;
+	}
+	f[SAFEGCD_LIMBS - 1] = (sg_limb_t)cf;
+	g[SAFEGCD_LIMBS - 1] = (sg_limb_t)cg;
+}
+
+/**
+ * Computes [d, e] = t [d, e] / 2^SAFEGCD_BITS mod p on signed limbs
+ *
+ * Multiples of p are added first so that the division is exact. If d
+ * and e are in (-2p, p) before the update, they are afterwards too.
+ * This follows the modinv64 module of libsecp256k1.
+ *
+ * m is p as signed limbs and m_inv is p^-1 mod 2^SAFEGCD_BITS.
+ */
+void safegcd_update_de(sg_limb_t d[SAFEGCD_LIMBS], sg_limb_t e[SAFEGCD_LIMBS],
+			const struct Trans2x2 *t,
+			const sg_limb_t m[SAFEGCD_LIMBS], sg_ulimb_t m_inv)
+{
+	sg_limb_t sd, se, md, me;
+	sg_dlimb_t cd, ce;
+	int i;
+
+	// Start from t's columns for negative inputs, to keep d, e above -2p
+	sd = d[SAFEGCD_LIMBS - 1] >> SAFEGCD_SIGN;
+	se = e[SAFEGCD_LIMBS - 1] >> SAFEGCD_SIGN;
+	md = (t->u & sd) + (t->v & se);
+	me = (t->q & sd) + (t->r & se);
+
+	cd = (sg_dlimb_t)t->u * d[0] + (sg_dlimb_t)t->v * e[0];
+	ce = (sg_dlimb_t)t->q * d[0] + (sg_dlimb_t)t->r * e[0];
+
+	// Pick md, me so that the bottom bits of cd + p md, ce + p me vanish
+	md -= (m_inv * (sg_ulimb_t)cd + md) & SAFEGCD_MASK;
+	me -= (m_inv * (sg_ulimb_t)ce + me) & SAFEGCD_MASK;
+	cd += (sg_dlimb_t)m[0] * md;
+	ce += (sg_dlimb_t)m[0] * me;
+	cd >>= SAFEGCD_BITS;
+	ce >>= SAFEGCD_BITS;
+
+	for (i = 1; i < SAFEGCD_LIMBS; i++) {
+		cd += (sg_dlimb_t)t->u * d[i] + (sg_dlimb_t)t->v * e[i]
+			+ (sg_dlimb_t)m[i] * md;
+		ce += (sg_dlimb_t)t->q * d[i] + (sg_dlimb_t)t->r * e[i]
+			+ (sg_dlimb_t)m[i] * me;
+		d[i - 1] = (sg_limb_t)((sg_ulimb_t)cd & SAFEGCD_MASK);
+		e[i - 1] = (sg_limb_t)((sg_ulimb_t)ce & SAFEGCD_MASK);
+		cd >>= SAFEGCD_BITS;
+		ce >>= SAFEGCD_BITS;
+	}
+	d[SAFEGCD_LIMBS - 1] = (sg_limb_t)cd;
+	e[SAFEGCD_LIMBS - 1] = (sg_limb_t)ce;
+}
+
+/**
+ * Brings d from (-2p, p) into [0, p), negating it first if sign < 0
+ */
+void safegcd_normalize(sg_limb_t d[SAFEGCD_LIMBS], sg_limb_t sign,
+			const sg_limb_t m[SAFEGCD_LIMBS])
+{
+	const sg_limb_t mask = (sg_limb_t)SAFEGCD_MASK;
+	sg_limb_t cond;
+	int i;
+
+	// Add p if negative and then negate if requested, giving (-p, p)
+	cond = d[SAFEGCD_LIMBS - 1] >> SAFEGCD_SIGN;
+	for (i = 0; i < SAFEGCD_LIMBS; i++)
+		d[i] += m[i] & cond;
+	cond = sign >> SAFEGCD_SIGN;
+	for (i = 0; i < SAFEGCD_LIMBS; i++)
+		d[i] = (d[i] ^ cond) - cond;
+	for (i = 0; i < SAFEGCD_LIMBS - 1; i++) {
+		d[i + 1] += d[i] >> SAFEGCD_BITS;
+		d[i] &= mask;
+	}
+
+	// Add p again if still negative, giving [0, p)
+	cond = d[SAFEGCD_LIMBS - 1] >> SAFEGCD_SIGN;
+	for (i = 0; i < SAFEGCD_LIMBS; i++)
+		d[i] += m[i] & cond;
+	for (i = 0; i < SAFEGCD_LIMBS - 1; i++) {
+		d[i + 1] += d[i] >> SAFEGCD_BITS;
+		d[i] &= mask;
+	}
+}
+
+/**
+ * Converts a field element into signed limbs of the inversion engine
+ */
+void fe_to_safegcd(sg_limb_t r[SAFEGCD_LIMBS], const fe_t a)
+{
+	int i, bit, w, s;
+	sg_ulimb_t x;
+
+	for (i = 0; i < SAFEGCD_LIMBS; i++) {
+		bit = i * SAFEGCD_BITS;
+		w = bit / FIELD_LIMB_BITS;
+		s = bit % FIELD_LIMB_BITS;
+		x = w < FIELD_LIMBS ? a[w] >> s : 0;
+		if (s > FIELD_LIMB_BITS - SAFEGCD_BITS && w + 1 < FIELD_LIMBS)
+			x |= (sg_ulimb_t)a[w + 1] << (FIELD_LIMB_BITS - s);
+		r[i] = (sg_limb_t)(x & SAFEGCD_MASK);
+	}
+}
+
+/**
+ * Converts non-negative signed limbs of the inversion engine back into
+ * a field element
+ */
+void fe_from_safegcd(fe_t r, const sg_limb_t a[SAFEGCD_LIMBS])
+{
+	int i, bit, w, s;
+
+	memset(r, 0, sizeof(fe_t));
+	for (i = 0; i < SAFEGCD_LIMBS; i++) {
+		bit = i * SAFEGCD_BITS;
+		w = bit / FIELD_LIMB_BITS;
+		s = bit % FIELD_LIMB_BITS;
+		if (w >= FIELD_LIMBS)
+			break;
+		r[w] |= (limb_t)a[i] << s;
+		if (s > FIELD_LIMB_BITS - SAFEGCD_BITS && w + 1 < FIELD_LIMBS)
+			r[w + 1] |= (limb_t)a[i] >> (FIELD_LIMB_BITS - s);
+	}
+}
+
+/**
+ * Computes the inverse of a plain number modulo a 192-bit prime
+ *
+ * This is the safegcd algorithm of Bernstein and Yang: a fixed number
+ * of batches of divsteps drive g = a to zero and f = p to +-1, while
+ * d and e track the matching multiples of a^-1 modulo p. The sequence
+ * of operations does not depend on a.
+ *
+ * r is the return variable. It may alias a.
+ * a is the number to invert, in [0, p). The inverse of zero is zero.
+ * p is the prime, and n0 is -p^-1 mod 2^FIELD_LIMB_BITS (see field_init).
+ */
+void safegcd_inv(fe_t r, const fe_t a, const fe_t p, limb_t n0)
+{
+	sg_limb_t m[SAFEGCD_LIMBS];
+	sg_limb_t f[SAFEGCD_LIMBS];
+	sg_limb_t g[SAFEGCD_LIMBS];
+	sg_limb_t d[SAFEGCD_LIMBS] = { 0 };
+	sg_limb_t e[SAFEGCD_LIMBS] = { 1 };
+	const sg_ulimb_t m_inv = (sg_ulimb_t)-n0 & SAFEGCD_MASK;
+	struct Trans2x2 t;
+	sg_limb_t delta = 1;
+	int i;
+
+	fe_to_safegcd(m, p);
+	fe_to_safegcd(f, p);
+	fe_to_safegcd(g, a);
+
+	for (i = 0; i < SAFEGCD_BATCHES; i++) {
+		delta = safegcd_divsteps(delta, f[0], g[0], &t);
+		safegcd_update_de(d, e, &t, m, m_inv);
+		safegcd_update_fg(f, g, &t);
+	}
+
+	// f is now +-1, and d * a = f mod p
+	safegcd_normalize(d, f[SAFEGCD_LIMBS - 1], m);
+	fe_from_safegcd(r, d);
+}
+
+/**
+ * Computes the inverse of a field element
+ *
+ * The inverse is computed with the algorithm selected in the field,
+ * safegcd_inv by default. In Montgomery form the input to safegcd_inv
+ * is a * 2^192, so its result is brought back with a multiplication by
+ * 2^576 mod p.
+ *
+ * r is the return variable. It may alias a.
+ * a is the number to invert. The inverse of zero is zero.
+ * f is the field.
+ */
+void fe_inv(fe_t r, const fe_t a, const struct Field *f)
+{
+	FIELD_COUNT(field_inv_count);
+	if (f->inversion == INVERSION_FERMAT) {
+		fe_inv_fermat(r, a, f);
+		return;
+	}
+
+	safegcd_inv(r, a, f->prime, f->n0);
+	if (f->montgomery)
+		fe_mul(r, r, f->r3, f);
+}
+
+/**
+ * Inverts many field elements at once
+ *
+ * This is Montgomery's simultaneous inversion: the running products
+ * a[0], a[0] a[1], ..., a[0] ... a[n - 1] are inverted with a single
+ * fe_inv, and the individual inverses are peeled off walking back,
+ * for a total of one inversion and 3(n - 1) multiplications. Zero
+ * elements are skipped in the products and come out as zero.
+ *
+ * r is the array of results. It must not overlap a.
+ * a is the array of n elements to invert.
+ * f is the field.
+ */
+void fe_batch_inv(fe_t r[], const fe_t a[], size_t n, const struct Field *f)
+{
+	const fe_t zero = { 0 };
+	fe_t acc, x, tmp;
+	size_t i;
+
+	if (n == 0)
+		return;
+
+	memcpy(acc, f->one, sizeof(acc));
+	for (i = 0; i < n; i++) {
+		memcpy(x, a[i], sizeof(x));
+		fe_cmov(x, f->one, fe_is_zero(a[i]));
+		fe_mul(acc, acc, x, f);
+		memcpy(r[i], acc, sizeof(acc));
+	}
+
+	fe_inv(acc, acc, f);
+
+	for (i = n - 1; i > 0; i--) {
+		// acc is the inverse of a[0] ... a[i] here
+		memcpy(x, a[i], sizeof(x));
+		fe_cmov(x, f->one, fe_is_zero(a[i]));
+		fe_mul(tmp, acc, r[i - 1], f);
+		fe_mul(acc, acc, x, f);
+		fe_cmov(tmp, zero, fe_is_zero(a[i]));
+		memcpy(r[i], tmp, sizeof(tmp));
+	}
+	fe_cmov(acc, zero, fe_is_zero(a[0]));
+	memcpy(r[0], acc, sizeof(acc));
+}
+
+/**
+ * Converts a GMP integer into a field element
+ *
+ * The size of a is checked before its limbs are copied, so numbers
+ * from untrusted input of any size can be passed.
+ *
+ * r is the return variable. It is set to zero if a is out of range.
+ * a is the number to convert. It has to be within the prime field.
+ * f is the field.
+ *
+ * Returns 0 on success, or -1 if a is negative or not below the prime
+ */
+int fe_set_mpz(fe_t r, mpz_t a, const struct Field *f)
+{
+	fe_t reduced;
+
+	memset(r, 0, sizeof(fe_t));
+	if (mpz_sgn(a) < 0 || mpz_sizeinbase(a, 2) > FIELD_BITS)
+		return -1;
+	mpz_export(r, NULL, -1, sizeof(limb_t), 0, 0, a);
+	fe_reduce_once(reduced, r, 0, f);
+	if (!fe_equal(reduced, r)) {
+		memset(r, 0, sizeof(fe_t));
+		return -1;
+	}
+	if (f->montgomery)
+		fe_mul(r, r, f->r2, f);
+	return 0;
+}
+
+/**
+ * Converts a field element into a GMP integer
+ *
+ * r is the return variable. It must be initialized.
+ * a is the field element to convert.
+ * f is the field.
+ */
+void fe_get_mpz(mpz_t r, const fe_t a, const struct Field *f)
+{
+	limb_t t[2 * FIELD_LIMBS] = { 0 };
+	fe_t plain;
+
+	memcpy(t, a, sizeof(fe_t));
+	if (f->montgomery)
+		montgomery_reduce(plain, t, f);
+	else
+		memcpy(plain, a, sizeof(plain));
+	mpz_import(r, FIELD_LIMBS, -1, sizeof(limb_t), 0, 0, plain);
+}
+
+/**
+ * Struct holding the temporaries of the scalar and field arithmetic
+ *
+ * This is the one caller-owned context of the code: scalar_mult_into,
+ * scalar_mult_base_into and the batches in ecdh.c use the scalar
+ * temporaries, and the prime_field functions below the field ones. The
+ * temporaries are allocated once, by init_scratch, and reused by every
+ * call, so neither layer allocates memory. A scratch space must only
+ * be used by one thread at a time; each thread should own one.
+ *
+ * e is the scalar reduced modulo the order.
+ * k1, k2, c1 and c2 hold the GLV split of the scalar.
+ * wide holds double-width products before reduction.
+ * inv holds the inverse computed by prime_field_div.
+ * acc is the running product of prime_field_batch_inv.
+ * prefix holds the prefix products of prime_field_batch_inv, and grows
+ * to the largest batch seen. prefix_size is its number of entries.
+ */
+struct Scratch {
+	mpz_t e;
+	mpz_t k1;
+	mpz_t k2;
+	mpz_t c1;
+	mpz_t c2;
+	mpz_t wide;
+	mpz_t inv;
+	mpz_t acc;
+	mpz_t *prefix;
+	size_t prefix_size;
+};
+
+/**
+ * Initializes a scratch space
+ *
+ * The temporaries are sized for scalars up to the size of the field,
+ * so no memory is allocated while the scratch space is in use, apart
+ * from the prefix array of prime_field_batch_inv when it grows.
+ */
+void init_scratch(struct Scratch *s)
+{
+	mpz_init2(s->e, 4 * FIELD_BITS);
+	mpz_init2(s->k1, 4 * FIELD_BITS);
+	mpz_init2(s->k2, 4 * FIELD_BITS);
+	mpz_init2(s->c1, 4 * FIELD_BITS);
+	mpz_init2(s->c2, 4 * FIELD_BITS);
+	mpz_init2(s->wide, 2 * FIELD_BITS);
+	mpz_init2(s->inv, FIELD_BITS);
+	mpz_init2(s->acc, 2 * FIELD_BITS);
+	s->prefix = NULL;
+	s->prefix_size = 0;
+}
+
+/**
+ * Releases the memory of a scratch space
+ */
+void clear_scratch(struct Scratch *s)
+{
+	size_t i;
+
+	mpz_clear(s->e);
+	mpz_clear(s->k1);
+	mpz_clear(s->k2);
+	mpz_clear(s->c1);
+	mpz_clear(s->c2);
+	mpz_clear(s->wide);
+	mpz_clear(s->inv);
+	mpz_clear(s->acc);
+	for (i = 0; i < s->prefix_size; i++)
+		mpz_clear(s->prefix[i]);
+	free(s->prefix);
+}
 
 /**
  * Adds two numbers which are in the prime field
@@ -17,18 +1609,11 @@
  */
 void prime_field_add(mpz_t res, mpz_t a, mpz_t b, mpz_t p)
 {
-	mpz_t tmp;
-	mpz_init(tmp);
-
-	mpz_add(tmp, a, b);
-	if (mpz_cmp(tmp, p) >= 0)
-		mpz_sub(res, tmp, p);
-	else if (mpz_cmp_ui(tmp, 0UL) < 0)
-		mpz_add(res, tmp, p);
-	else
-		mpz_set(res, tmp);
-
-	mpz_clear(tmp);
+	mpz_add(res, a, b);
+	if (mpz_cmp(res, p) >= 0)
+		mpz_sub(res, res, p);
+	else if (mpz_cmp_ui(res, 0UL) < 0)
+		mpz_add(res, res, p);
 }
 
 /**
@@ -44,50 +1629,174 @@ void prime_field_add(mpz_t res, mpz_t a, mpz_t b, mpz_t p)
  */
 void prime_field_sub(mpz_t res, mpz_t a, mpz_t b, mpz_t p)
 {
-	mpz_t tmp;
-	mpz_init(tmp);
-	mpz_neg(tmp, b);
-	prime_field_add(res, a, tmp, p);
-	mpz_clear(tmp);
+	mpz_sub(res, a, b);
+	if (mpz_cmp(res, p) >= 0)
+		mpz_sub(res, res, p);
+	else if (mpz_cmp_ui(res, 0UL) < 0)
+		mpz_add(res, res, p);
+}
+
+/**
+ * Reduces a number modulo the prime defining the field
+ *
+ * This is the reduction step shared by multiplication and squaring.
+ * t is the full double-width product of two field elements, i.e.
+ * 0 <= t < p^2. Primes listed in enum Fields use their dedicated
+ * kernel, any other prime is reduced with a single division by p.
+ *
+ * res is the return variable. It must be initialized.
+ * t is the number to reduce.
+ * p is the prime number defining the field.
+ */
+void prime_field_reduce(mpz_t res, mpz_t t, mpz_t p)
+{
+#if GMP_NUMB_BITS == FIELD_LIMB_BITS
+	limb_t wide[2 * FIELD_LIMBS] = { 0 };
+	limb_t *out;
+	size_t n = mpz_size(t);
+
+	if (n <= 2 * FIELD_LIMBS && mpz_sgn(t) >= 0) {
+		switch (prime_field_type(p)) {
+		case FIELD_P192K1:
+			memcpy(wide, mpz_limbs_read(t), n * sizeof(*wide));
+			out = (limb_t *)mpz_limbs_write(res, FIELD_LIMBS);
+			p192k1_reduce(out, wide);
+			mpz_limbs_finish(res, FIELD_LIMBS);
+			return;
+		case FIELD_P192R1:
+			memcpy(wide, mpz_limbs_read(t), n * sizeof(*wide));
+			out = (limb_t *)mpz_limbs_write(res, FIELD_LIMBS);
+			p192r1_reduce(out, wide);
+			mpz_limbs_finish(res, FIELD_LIMBS);
+			return;
+		case FIELD_GENERIC:
+		default:
+			break;
+		}
+	}
+#endif
+	mpz_tdiv_r(res, t, p);
 }
 
 /**
  * Multiplies two numbers which are in the prime field
  *
- * The function loops copies b into a throwaway variable and loops
- * over the bits of b, starting with most significant bit. If the
- * bit is set, it adds the value of the copied throwaway to the result.
- * Then it doubles the value of the throwaway. All operations are
- * prime field operations.
+ * The full product of a and b is computed first, and then reduced
+ * back into the field with prime_field_reduce.
  * See https://www.johannes-bauer.com/compsci/ecc/#anchor05 for details.
  *
  * res is the return variable. It must be initialized.
  * a and b are the numbers to multiply. They have to be within the prime field.
  * p is the prime number defining the field.
+ * s is the scratch space holding the temporaries, see init_scratch.
  */
-void prime_field_mul(mpz_t res, mpz_t a, mpz_t b, mpz_t p)
+void prime_field_mul(mpz_t res, mpz_t a, mpz_t b, mpz_t p,
+			struct Scratch *s)
 {
-	mpz_t copy;
-	mpz_t tmp;
-	mpz_init_set(copy, a);
-	mpz_init(tmp);
-	mpz_set_ui(res, 0UL);
+	mpz_mul(s->wide, a, b);
+	prime_field_reduce(res, s->wide, p);
+}
+
+/**
+ * Inverts a number which is in the prime field
+ *
+ * For primes that fit in FIELD_LIMBS limbs, the inverse is computed on
+ * fixed limbs with safegcd_inv, in time independent of a. Larger primes
+ * fall back to GMP's extended Euclid, which is not available when
+ * building with -DECDH_NO_GMP, so there res is set to zero instead.
+ *
+ * res is the return variable. It must be initialized.
+ * a is the number to invert, of any size and sign. Numbers outside the
+ * prime field are reduced modulo p first. The inverse of zero is zero.
+ * p is the prime number defining the field.
+ */
+void prime_field_inv(mpz_t res, mpz_t a, mpz_t p)
+{
+	fe_t x, prime;
+	mpz_t t;
+
+	if (mpz_sizeinbase(p, 2) > FIELD_BITS) {
+#ifndef ECDH_NO_GMP
+		if (mpz_invert(res, a, p) == 0)
+			mpz_set_ui(res, 0UL);
+#else
+		mpz_set_ui(res, 0UL);
+#endif
+		return;
+	}
+
+	memset(x, 0, sizeof(x));
+	memset(prime, 0, sizeof(prime));
+	if (mpz_sgn(a) < 0 || mpz_cmp(a, p) >= 0) {
+		mpz_init(t);
+		mpz_mod(t, a, p);
+		mpz_export(x, NULL, -1, sizeof(limb_t), 0, 0, t);
+		mpz_clear(t);
+	} else {
+		mpz_export(x, NULL, -1, sizeof(limb_t), 0, 0, a);
+	}
+	mpz_export(prime, NULL, -1, sizeof(limb_t), 0, 0, p);
+	safegcd_inv(x, x, prime, field_n0(prime[0]));
+	mpz_import(res, FIELD_LIMBS, -1, sizeof(limb_t), 0, 0, x);
+}
+
+/**
+ * Inverts many numbers which are in the prime field, in place
+ *
+ * Uses Montgomery's simultaneous inversion (see fe_batch_inv), so n
+ * elements cost one prime_field_inv and 3(n - 1) multiplications.
+ * Elements which are zero are left as zero.
+ *
+ * elements is the array of n numbers to invert. They have to be within
+ * the prime field.
+ * p is the prime number defining the field.
+ * s is the scratch space holding the temporaries. Its prefix array
+ * is grown to n entries if it is smaller. If that runs out of memory,
+ * the elements are inverted one at a time with prime_field_inv
+ * instead, so they are always inverted on return.
+ */
+void prime_field_batch_inv(mpz_t elements[], size_t n, mpz_t p,
+				struct Scratch *s)
+{
+	mpz_t *prefix;
+	size_t i;
 
-	char *bits = mpz_get_str(NULL, 2, b);
-	size_t bitlength = strlen(bits);
+	if (n == 0)
+		return;
 
-        int i;
-	for (i = bitlength - 1; i >= 0; i--) {
-		if (bits[i] == '1') {
-			prime_field_add(tmp, res, copy, p);
-			mpz_set(res, tmp);
+	if (s->prefix_size < n) {
+		prefix = realloc(s->prefix, n * sizeof(*prefix));
+		if (prefix == NULL) {
+			for (i = 0; i < n; i++)
+				prime_field_inv(elements[i], elements[i], p);
+			return;
 		}
-		prime_field_add(tmp, copy, copy, p);
-		mpz_set(copy, tmp);
+		for (i = s->prefix_size; i < n; i++)
+			mpz_init2(prefix[i], FIELD_BITS);
+		s->prefix = prefix;
+		s->prefix_size = n;
 	}
-	mpz_clear(copy);
-	mpz_clear(tmp);
-	free(bits);
+	prefix = s->prefix;
+
+	mpz_set_ui(s->acc, 1UL);
+	for (i = 0; i < n; i++) {
+		if (mpz_sgn(elements[i]) != 0)
+			prime_field_mul(s->acc, s->acc, elements[i], p, s);
+		mpz_set(prefix[i], s->acc);
+	}
+
+	prime_field_inv(s->acc, s->acc, p);
+
+	for (i = n - 1; i > 0; i--) {
+		if (mpz_sgn(elements[i]) == 0)
+			continue;
+		// acc is the inverse of the product of elements[0..i] here
+		prime_field_mul(prefix[i - 1], s->acc, prefix[i - 1], p, s);
+		prime_field_mul(s->acc, s->acc, elements[i], p, s);
+		mpz_swap(elements[i], prefix[i - 1]);
+	}
+	if (mpz_sgn(elements[0]) != 0)
+		mpz_set(elements[0], s->acc);
 }
 
 /**
@@ -100,81 +1809,31 @@ void prime_field_mul(mpz_t res, mpz_t a, mpz_t b, mpz_t p)
  * res is the return variable. It must be initialized.
  * a is the dividend and b is the divisor. Both must be in the prime field.
  * p is the prime number defining the field.
+ * s is the scratch space holding the temporaries, see init_scratch.
  */
-void prime_field_div(mpz_t res, mpz_t a, mpz_t b, mpz_t p)
-{
-	mpz_t q, r, s, t, u, v, copy_b, copy_p, u_new, v_new, tmp;
-	mpz_init(q);
-	mpz_init(r);
-	mpz_init_set_ui(s, 1UL);
-	mpz_init_set_ui(t, 0UL);
-	mpz_init_set_ui(u, 0UL);
-	mpz_init_set_ui(v, 1UL);
-	mpz_init_set(copy_b, b);
-	mpz_init_set(copy_p, p);
-	mpz_init(u_new);
-	mpz_init(v_new);
-	mpz_init(tmp);
-
-	while (mpz_cmp_ui(copy_p, 0UL) != 0) {
-		mpz_fdiv_qr(q, r, a, copy_p);
-		mpz_set(u_new, s);
-		mpz_set(v_new, t);
-		mpz_mul(tmp, q, s);
-		mpz_sub(s, u, tmp);
-		mpz_mul(tmp, q, t);
-		mpz_sub(t, v, tmp);
-		mpz_set(copy_b, copy_p);
-		mpz_set(copy_p, r);
-		mpz_set(u, u_new);
-		mpz_set(v, v_new);
-	}
-	prime_field_mul(res, a, u, p);
-
-	mpz_clear(q);
-	mpz_clear(r);
-	mpz_clear(s);
-	mpz_clear(t);
-	mpz_clear(u);
-	mpz_clear(v);
-	mpz_clear(copy_p);
-	mpz_clear(copy_b);
-	mpz_clear(u_new);
-	mpz_clear(v_new);
-	mpz_clear(tmp);
+void prime_field_div(mpz_t res, mpz_t a, mpz_t b, mpz_t p,
+			struct Scratch *s)
+{
+	prime_field_inv(s->inv, b, p);
+	prime_field_mul(res, a, s->inv, p, s);
 }
 
 /**
  * Squares a number in the prime field
  *
- * This is uses the same approach as multiplication.
+ * The square is computed with a single GMP squaring, which exploits the
+ * symmetric cross products, and reduced with prime_field_reduce.
  * See https://www.johannes-bauer.com/compsci/ecc/#anchor09 for details
  *
  * res is the return variable. It must be initialized.
  * a is the number to square.
  * p is the prime number defining the field.
+ * s is the scratch space holding the temporaries, see init_scratch.
  */
-void prime_field_sq(mpz_t res, mpz_t a, mpz_t p)
+void prime_field_sq(mpz_t res, mpz_t a, mpz_t p, struct Scratch *s)
 {
-	mpz_t copy;
-	mpz_t tmp;
-	mpz_init_set(copy, a);
-	mpz_init(tmp);
-	mpz_set_ui(res, 1UL);
-
-	char *bits = "10";
-
-        int i;
-	for (i = 1; i >= 0; i--) {
-		if (bits[i] == '1') {
-			prime_field_mul(tmp, res, copy, p);
-			mpz_set(res, tmp);
-		}
-		prime_field_mul(tmp, copy, copy, p);
-		mpz_set(copy, tmp);
-	}
-	mpz_clear(tmp);
-	mpz_clear(copy);
+	mpz_mul(s->wide, a, a);
+	prime_field_reduce(res, s->wide, p);
 }
 
 /**
@@ -197,11 +1856,15 @@ int str_to_scalar(mpz_t scalar, const char *str)
  *
  * scalar is the number to convert
  * *len is a pointer which will hold the length of the result
+ *
+ * Returns a new string, or NULL if memory ran out
  */
 char *scalar_to_str(mpz_t scalar, size_t *len)
 {
 	*len = mpz_sizeinbase(scalar, 16) + 2;
 	char *str = malloc((*len) * sizeof(*str));
+	if (str == NULL)
+		return NULL;
 	mpz_get_str(str, 16, scalar);
 	*len = strlen(str);
 	return str;
@@ -0,0 +1,933 @@
+/**
+ * Microbenchmarks for the prime field and point arithmetic
+ *
+ * The benchmark is built from the same sources as ``ecdh`` by including
+ * ecdh.c with its main function disabled. Every operation is timed in a
+ * dependent chain (the result of one call is the input of the next), so
+ * the numbers reported are latencies per operation, in nanoseconds and,
+ * on x86, in time-stamp counter cycles.
+ *
+ * Build with ``make bench`` and run ``./bench [iterations]``.
+ */
+#define _GNU_SOURCE
+#define ECDH_NO_MAIN
+#define FIELD_COUNT_OPS
+
+#include <stdlib.h>
+#include <time.h>
+#include <gmp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Number of heap allocations made by ecdh.c and by GMP
+ *
+ * ecdh.c is compiled with malloc and calloc redirected to the counting
+ * versions below, and GMP is given counting memory functions in main.
+ */
+static unsigned long alloc_count;
+static void *(*gmp_alloc)(size_t);
+static void *(*gmp_realloc)(void *, size_t, size_t);
+
+static void *counted_malloc(size_t n)
+{
+	alloc_count++;
+	return malloc(n);
+}
+
+static void *counted_calloc(size_t n, size_t size)
+{
+	alloc_count++;
+	return calloc(n, size);
+}
+
+static void *counted_gmp_alloc(size_t n)
+{
+	alloc_count++;
+	return gmp_alloc(n);
+}
+
+static void *counted_gmp_realloc(void *p, size_t old, size_t n)
+{
+	alloc_count++;
+	return gmp_realloc(p, old, n);
+}
+
+#define malloc(n) counted_malloc(n)
+#define calloc(n, size) counted_calloc(n, size)
+
+#include "../ecdh.c"
+
+/**
+ * Returns a monotonic timestamp in nanoseconds
+ */
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Returns the time-stamp counter, or 0 where there is none
+ */
+static double now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (double)__rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Struct holding the start of a timed run
+ */
+struct Timer {
+	double ns;
+	double cycles;
+};
+
+/**
+ * Starts a timed run
+ */
+static struct Timer start(void)
+{
+	struct Timer t;
+	t.ns = now_ns();
+	t.cycles = now_cycles();
+	return t;
+}
+
+/**
+ * Prints a single benchmark result line for the run started at t
+ */
+static void report(const char *curve, const char *op, struct Timer t,
+			long iters)
+{
+	double ns = now_ns() - t.ns;
+	double cycles = now_cycles() - t.cycles;
+
+	printf("%-10s %-26s %12.1f ns/op %14.0f cycles/op\n", curve, op,
+		ns / iters, cycles / iters);
+}
+
+/**
+ * Hardware cache events counted around the point arithmetic
+ */
+#if defined(__linux__)
+static const struct {
+	const char *name;
+	unsigned long long config;
+} cache_events[] = {
+	{ "L1d misses", PERF_COUNT_HW_CACHE_L1D
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ "LLC misses", PERF_COUNT_HW_CACHE_LL
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+#define CACHE_EVENTS (sizeof(cache_events) / sizeof(cache_events[0]))
+
+/**
+ * Opens a counter for the cache event i on this thread
+ *
+ * Returns the file descriptor, or -1 if the kernel or the machine does
+ * not provide the event, e.g. in most virtual machines
+ */
+static int open_cache_event(size_t i)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = cache_events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/**
+ * Prints the cache misses per call of scalar_mult and scalar_mult_base
+ * on the curve ec
+ */
+static void bench_cache(const char *name, const struct Curve *ec,
+			long iters, gmp_randstate_t rs)
+{
+#if defined(__linux__)
+	struct Point r;
+	struct Scratch s;
+	mpz_t k;
+	char label[40];
+	long long misses;
+	size_t i;
+	long j;
+	int fd;
+
+	init_point(&r);
+	init_scratch(&s);
+	mpz_init(k);
+	mpz_urandomb(k, rs, ec->key_size_bits);
+
+	for (i = 0; i < CACHE_EVENTS; i++) {
+		fd = open_cache_event(i);
+		if (fd < 0) {
+			printf("%-10s %-26s %12s\n", name, cache_events[i].name,
+				"unavailable");
+			continue;
+		}
+
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		for (j = 0; j < iters; j++)
+			scalar_mult_into(&r, (struct Point *)&ec->G, k, ec, &s);
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+			snprintf(label, sizeof(label), "scalar_mult %s",
+				cache_events[i].name);
+			printf("%-10s %-26s %12.1f /op\n", name, label,
+				(double)misses / iters);
+		}
+
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		for (j = 0; j < iters; j++)
+			scalar_mult_base_into(&r, k, ec, &s);
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+			snprintf(label, sizeof(label), "scalar_mult_base %s",
+				cache_events[i].name);
+			printf("%-10s %-26s %12.1f /op\n", name, label,
+				(double)misses / iters);
+		}
+		close(fd);
+	}
+
+	mpz_clear(k);
+	clear_scratch(&s);
+	clear_point(&r);
+#endif
+}
+
+/**
+ * Prints the heap allocations per operation since count
+ */
+static void report_allocs(const char *curve, const char *op,
+				unsigned long count, long iters)
+{
+	printf("%-10s %-26s %12.1f allocs/op\n", curve, op,
+		(double)(alloc_count - count) / iters);
+}
+
+/**
+ * Times the prime field primitives on random elements of the field of ec
+ */
+static void bench_field(const char *name, struct Curve *ec, long iters,
+			gmp_randstate_t rs)
+{
+	struct Scratch s;
+	mpz_t a, b, r;
+	unsigned long count;
+	struct Timer t;
+	long i;
+
+	init_scratch(&s);
+	mpz_init(a);
+	mpz_init(b);
+	mpz_init(r);
+	mpz_urandomm(a, rs, ec->prime);
+	mpz_urandomm(b, rs, ec->prime);
+
+	count = alloc_count;
+	t = start();
+	for (i = 0; i < iters; i++) {
+		prime_field_mul(r, a, b, ec->prime, &s);
+		mpz_swap(a, r);
+	}
+	report(name, "prime_field_mul", t, iters);
+	report_allocs(name, "prime_field_mul", count, iters);
+
+	count = alloc_count;
+	t = start();
+	for (i = 0; i < iters; i++) {
+		prime_field_sq(r, a, ec->prime, &s);
+		mpz_swap(a, r);
+	}
+	report(name, "prime_field_sq", t, iters);
+	report_allocs(name, "prime_field_sq", count, iters);
+
+	count = alloc_count;
+	for (i = 0; i < iters; i++) {
+		prime_field_add(r, a, b, ec->prime);
+		prime_field_sub(a, r, b, ec->prime);
+		prime_field_div(r, a, b, ec->prime, &s);
+		mpz_swap(a, r);
+	}
+	report_allocs(name, "prime_field_add+sub+div", count, iters);
+
+	mpz_clear(a);
+	mpz_clear(b);
+	mpz_clear(r);
+	clear_scratch(&s);
+}
+
+/**
+ * Times the fixed-limb field multiplication and squaring of ec, using
+ * the dedicated reduction kernel and Montgomery form
+ */
+static void bench_fe(const char *name, struct Curve *ec, long iters,
+			gmp_randstate_t rs)
+{
+	struct Field fields[2];
+	const char *labels[2][2] = {
+		{ "fe_mul", "fe_sq" },
+		{ "fe_mul (montgomery)", "fe_sq (montgomery)" }
+	};
+	fe_t a, b;
+	mpz_t tmp;
+	struct Timer t;
+	long i;
+	int j;
+
+	mpz_init(tmp);
+	field_init(&fields[0], ec->prime, 0);
+	field_init(&fields[1], ec->prime, 1);
+
+	for (j = 0; j < 2; j++) {
+		mpz_urandomm(tmp, rs, ec->prime);
+		fe_set_mpz(a, tmp, &fields[j]);
+		mpz_urandomm(tmp, rs, ec->prime);
+		fe_set_mpz(b, tmp, &fields[j]);
+
+		t = start();
+		for (i = 0; i < iters; i++)
+			fe_mul(a, a, b, &fields[j]);
+		report(name, labels[j][0], t, iters);
+
+		t = start();
+		for (i = 0; i < iters; i++)
+			fe_sq(a, a, &fields[j]);
+		report(name, labels[j][1], t, iters);
+	}
+	mpz_clear(tmp);
+}
+
+/**
+ * Times the field multiplication and squaring of every backend in the
+ * dispatch table that the CPU can run
+ */
+static void bench_backends(const char *name, struct Curve *ec, long iters,
+				gmp_randstate_t rs)
+{
+	const struct Backend *b;
+	char label[32];
+	fe_t a, c;
+	mpz_t tmp;
+	struct Timer t;
+	size_t j;
+	long i;
+
+	mpz_init(tmp);
+	for (j = 0; j < BACKENDS; j++) {
+		b = backends[j];
+		if (b->supported != NULL && !b->supported())
+			continue;
+		mpz_urandomm(tmp, rs, ec->prime);
+		fe_set_mpz(a, tmp, &ec->field);
+		mpz_urandomm(tmp, rs, ec->prime);
+		fe_set_mpz(c, tmp, &ec->field);
+
+		snprintf(label, sizeof(label), "fe_mul (%s)", b->name);
+		t = start();
+		for (i = 0; i < iters; i++)
+			b->fe_mul(a, a, c, &ec->field);
+		report(name, label, t, iters);
+
+		snprintf(label, sizeof(label), "fe_sq (%s)", b->name);
+		t = start();
+		for (i = 0; i < iters; i++)
+			b->fe_sq(a, a, &ec->field);
+		report(name, label, t, iters);
+	}
+	mpz_clear(tmp);
+}
+
+/**
+ * Times the fixed-limb and mpz field inversions of ec
+ */
+static void bench_inv(const char *name, struct Curve *ec, long iters,
+			gmp_randstate_t rs)
+{
+	const struct Field *f = &ec->field;
+	fe_t a;
+	mpz_t x, r;
+	struct Timer t;
+	long i;
+
+	mpz_init(x);
+	mpz_init(r);
+	mpz_urandomm(x, rs, ec->prime);
+	fe_set_mpz(a, x, f);
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		fe_inv(a, a, f);
+	report(name, "fe_inv (safegcd)", t, iters);
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		fe_inv_fermat(a, a, f);
+	report(name, "fe_inv_fermat (chain)", t, iters);
+
+	t = start();
+	for (i = 0; i < iters; i++) {
+		prime_field_inv(r, x, ec->prime);
+		mpz_swap(x, r);
+	}
+	report(name, "prime_field_inv", t, iters);
+
+	t = start();
+	for (i = 0; i < iters; i++) {
+		mpz_invert(r, x, ec->prime);
+		mpz_swap(x, r);
+	}
+	report(name, "mpz_invert", t, iters);
+
+	mpz_clear(x);
+	mpz_clear(r);
+}
+
+/**
+ * Times batch inversion of n = 1 to 4096 elements of the field of ec,
+ * reporting the cost per element
+ */
+static void bench_batch_inv(const char *name, struct Curve *ec, long iters,
+				gmp_randstate_t rs)
+{
+	const size_t max = 4096;
+	const struct Field *f = &ec->field;
+	struct Scratch s;
+	fe_t *a = malloc(max * sizeof(*a));
+	fe_t *r = malloc(max * sizeof(*r));
+	mpz_t *m = malloc(max * sizeof(*m));
+	char label[32];
+	struct Timer t;
+	size_t i, n;
+	long j, reps;
+
+	init_scratch(&s);
+	for (i = 0; i < max; i++) {
+		mpz_init(m[i]);
+		mpz_urandomm(m[i], rs, ec->prime);
+		fe_set_mpz(a[i], m[i], f);
+	}
+
+	for (n = 1; n <= max; n *= 4) {
+		reps = iters / n + 1;
+
+		t = start();
+		for (j = 0; j < reps; j++)
+			fe_batch_inv(r, a, n, f);
+		snprintf(label, sizeof(label), "fe_batch_inv n=%zu", n);
+		report(name, label, t, reps * n);
+
+		t = start();
+		for (j = 0; j < reps; j++)
+			prime_field_batch_inv(m, n, ec->prime, &s);
+		snprintf(label, sizeof(label), "prime_field_batch n=%zu", n);
+		report(name, label, t, reps * n);
+	}
+
+	for (i = 0; i < max; i++)
+		mpz_clear(m[i]);
+	clear_scratch(&s);
+	free(a);
+	free(r);
+	free(m);
+}
+
+/**
+ * Times the dedicated fixed-limb reduction kernel of the field of ec
+ */
+static void bench_reduce(const char *name, struct Curve *ec, long iters)
+{
+	limb_t wide[2 * FIELD_LIMBS];
+	limb_t r[FIELD_LIMBS];
+	void (*reduce)(limb_t *, const limb_t *);
+	struct Timer t;
+	long i;
+
+	switch (prime_field_type(ec->prime)) {
+	case FIELD_P192K1:
+		reduce = p192k1_reduce;
+		break;
+	case FIELD_P192R1:
+		reduce = p192r1_reduce;
+		break;
+	default:
+		return;
+	}
+
+	for (i = 0; i < 2 * FIELD_LIMBS; i++)
+		wide[i] = (limb_t)(0x0123456789abcdefULL * (i + 1));
+
+	t = start();
+	for (i = 0; i < iters; i++) {
+		reduce(r, wide);
+		memcpy(wide, r, sizeof(r));
+	}
+	report(name, "reduce kernel", t, iters);
+}
+
+/**
+ * Times variable-base scalar multiplication and a full key exchange
+ */
+static void bench_point(const char *name, enum Curves curve,
+			struct Curve *ec, long iters, gmp_randstate_t rs)
+{
+	struct Point *p, *r;
+	mpz_t k;
+	struct Timer t;
+	char label[32];
+	long i;
+	int w;
+
+	mpz_init(k);
+	mpz_urandomb(k, rs, ec->key_size_bits);
+	p = copy_point(&ec->G);
+
+	t = start();
+	for (i = 0; i < iters; i++) {
+		r = scalar_mult(p, k, ec);
+		free_point(p);
+		p = r;
+	}
+	report(name, "scalar_mult", t, iters);
+
+	field_mul_count = field_sq_count = field_inv_count = 0;
+	r = scalar_mult(p, k, ec);
+	free_point(p);
+	p = r;
+	printf("%-10s %-26s %8lu M %8lu S %8lu I\n", name, "scalar_mult field ops",
+		field_mul_count, field_sq_count, field_inv_count);
+
+	ec->field.inversion = INVERSION_FERMAT;
+	t = start();
+	for (i = 0; i < iters; i++) {
+		r = scalar_mult(p, k, ec);
+		free_point(p);
+		p = r;
+	}
+	report(name, "scalar_mult (fermat)", t, iters);
+	ec->field.inversion = INVERSION_SAFEGCD;
+
+	if (ec->glv.enabled) {
+		ec->glv.enabled = 0;
+		t = start();
+		for (i = 0; i < iters; i++) {
+			r = scalar_mult(p, k, ec);
+			free_point(p);
+			p = r;
+		}
+		report(name, "scalar_mult (no glv)", t, iters);
+		ec->glv.enabled = 1;
+	}
+
+	for (w = 2; w <= 7; w++) {
+		ec->window = w;
+		snprintf(label, sizeof(label), "scalar_mult (w = %d)", w);
+		t = start();
+		for (i = 0; i < iters; i++) {
+			r = scalar_mult(p, k, ec);
+			free_point(p);
+			p = r;
+		}
+		report(name, label, t, iters);
+	}
+	ec->window = SCALAR_MULT_WINDOW;
+
+	t = start();
+	for (i = 0; i < iters; i++) {
+		r = scalar_mult(&ec->G, k, ec);
+		free_point(r);
+	}
+	report(name, "scalar_mult (G)", t, iters);
+
+	t = start();
+	for (i = 0; i < iters; i++) {
+		r = scalar_mult_base(k, ec);
+		free_point(r);
+	}
+	report(name, "scalar_mult_base", t, iters);
+
+	field_mul_count = field_sq_count = field_inv_count = 0;
+	r = scalar_mult_base(k, ec);
+	free_point(r);
+	printf("%-10s %-26s %8lu M %8lu S %8lu I\n", name,
+		"scalar_mult_base field ops", field_mul_count, field_sq_count,
+		field_inv_count);
+
+	t = start();
+	for (i = 0; i < iters; i++) {
+		size_t len;
+		struct KeyPair *alice = gen_key_pair(curve);
+		struct KeyPair *bob = gen_key_pair(curve);
+		char *secret = get_secret(alice, bob->public, &len);
+		free(secret);
+		free_key(alice);
+		free_key(bob);
+	}
+	report(name, "key_exchange", t, iters);
+
+	free_point(p);
+	mpz_clear(k);
+}
+
+/**
+ * Counts the heap allocations of a key exchange through the allocating
+ * API and through the in-place API with caller-owned points and a
+ * reused scratch space, and times the latter
+ */
+static void bench_alloc(const char *name, enum Curves curve, long iters,
+			gmp_randstate_t rs)
+{
+	const struct Curve *ec = get_curve(curve);
+	struct Point pa, pb, sa, sb;
+	struct Scratch s;
+	mpz_t ka, kb;
+	unsigned long count;
+	struct Timer t;
+	long i;
+
+	count = alloc_count;
+	for (i = 0; i < iters; i++) {
+		size_t len;
+		struct KeyPair *alice = gen_key_pair(curve);
+		struct KeyPair *bob = gen_key_pair(curve);
+		char *secret = get_secret(alice, bob->public, &len);
+		free(secret);
+		secret = get_secret(bob, alice->public, &len);
+		free(secret);
+		free_key(alice);
+		free_key(bob);
+	}
+	report_allocs(name, "key_exchange", count, iters);
+
+	mpz_init2(ka, ec->key_size_bits);
+	mpz_init2(kb, ec->key_size_bits);
+	mpz_urandomb(ka, rs, ec->key_size_bits);
+	mpz_urandomb(kb, rs, ec->key_size_bits);
+	init_point(&pa);
+	init_point(&pb);
+	init_point(&sa);
+	init_point(&sb);
+	init_scratch(&s);
+
+	count = alloc_count;
+	t = start();
+	for (i = 0; i < iters; i++) {
+		scalar_mult_base_into(&pa, ka, ec, &s);
+		scalar_mult_base_into(&pb, kb, ec, &s);
+		scalar_mult_into(&sa, &pb, ka, ec, &s);
+		scalar_mult_into(&sb, &pa, kb, ec, &s);
+	}
+	report(name, "key_exchange (in place)", t, iters);
+	report_allocs(name, "key_exchange (in place)", count, iters);
+
+	clear_scratch(&s);
+	clear_point(&pa);
+	clear_point(&pb);
+	clear_point(&sa);
+	clear_point(&sb);
+	mpz_clear(ka);
+	mpz_clear(kb);
+}
+
+/**
+ * Receives a limb of the results of benchmarks whose results are not
+ * otherwise used, so that the compiler keeps the work
+ */
+static volatile uint64_t bench_sink;
+
+#if MULTIBUF_AVX2
+/**
+ * Times the field kernels of the AVX2 engine, reporting the cost per
+ * lane
+ */
+static FE4_TARGET void bench_fe4(const char *name, const struct Curve *ec,
+					long iters)
+{
+	struct Fe4Field F;
+	uint64_t limbs[FE4_LANES][FE4_LIMBS];
+	fe4_t a;
+	struct Timer t;
+	long i;
+
+	fe4_field_init(&F, ec);
+	memcpy(a, F.r2, sizeof(a));
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		fe4_mul(a, a, F.b3, &F);
+	report(name, "fe4_mul per lane", t, iters * FE4_LANES);
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		fe4_sq(a, a, &F);
+	report(name, "fe4_sq per lane", t, iters * FE4_LANES);
+
+	fe4_store(limbs, a);
+	bench_sink = limbs[0][0];
+}
+#endif
+
+#if MULTIBUF_IFMA
+/**
+ * Times the field kernels of the IFMA engine, reporting the cost per
+ * lane
+ */
+static FE8_TARGET void bench_fe8(const char *name, const struct Curve *ec,
+					long iters)
+{
+	struct Fe8Field F;
+	uint64_t limbs[FE8_LANES][FE8_LIMBS];
+	fe8_t a;
+	struct Timer t;
+	long i;
+
+	fe8_field_init(&F, ec);
+	memcpy(a, F.r2, sizeof(a));
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		fe8_mul(a, a, F.b3, &F);
+	report(name, "fe8_mul per lane", t, iters * FE8_LANES);
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		fe8_sq(a, a, &F);
+	report(name, "fe8_sq per lane", t, iters * FE8_LANES);
+
+	fe8_store(limbs, a);
+	bench_sink = limbs[0][0];
+}
+#endif
+
+/**
+ * Times the field kernels of each multi-buffer engine the CPU supports
+ * and the scalar multiplication of each engine of the backend, per lane,
+ * against the scalar path
+ */
+static void bench_lanes(const char *name, const struct Curve *ec,
+			long iters, gmp_randstate_t rs)
+{
+	struct Point p[MULTIBUF_MAX_LANES];
+	struct Point *pl[MULTIBUF_MAX_LANES];
+	mpz_t k[MULTIBUF_MAX_LANES];
+	mpz_ptr kl[MULTIBUF_MAX_LANES];
+	const struct MultiBufEngine *e;
+	struct Scratch s;
+	char label[32];
+	fe_t a, b;
+	struct Timer t;
+	size_t j;
+	long i;
+	int l;
+
+	init_scratch(&s);
+	for (l = 0; l < MULTIBUF_MAX_LANES; l++) {
+		mpz_init(k[l]);
+		mpz_urandomb(k[l], rs, ec->key_size_bits);
+		init_point(&p[l]);
+		scalar_mult_base_into(&p[l], k[l], ec, &s);
+		pl[l] = &p[l];
+		kl[l] = k[l];
+	}
+
+	mpz_urandomm(s.e, rs, ec->prime);
+	fe_set_mpz(a, s.e, &ec->field);
+	mpz_urandomm(s.e, rs, ec->prime);
+	fe_set_mpz(b, s.e, &ec->field);
+	t = start();
+	for (i = 0; i < 100 * iters; i++)
+		fe_mul(a, a, b, &ec->field);
+	report(name, "fe_mul", t, 100 * iters);
+
+	t = start();
+	for (i = 0; i < iters / 100 + 1; i++)
+		scalar_mult_into(&p[0], &p[0], k[0], ec, &s);
+	report(name, "scalar_mult_into", t, iters / 100 + 1);
+
+#if MULTIBUF_AVX2
+	if (multibuf_x4_supported())
+		bench_fe4(name, ec, 100 * iters);
+#endif
+#if MULTIBUF_IFMA
+	if (multibuf_x8_supported())
+		bench_fe8(name, ec, 100 * iters);
+#endif
+	for (j = 0; j < BACKEND_ENGINES; j++) {
+		e = &get_backend()->engines[j];
+		if (e->lanes == 0)
+			continue;
+		snprintf(label, sizeof(label), "scalar_mult_x%d per lane",
+			e->lanes);
+		t = start();
+		for (i = 0; i < iters / 100 + 1; i++)
+			e->scalar_mult(pl, pl, kl, ec, &s);
+		report(name, label, t, (iters / 100 + 1) * e->lanes);
+	}
+
+	for (l = 0; l < MULTIBUF_MAX_LANES; l++) {
+		mpz_clear(k[l]);
+		clear_point(&p[l]);
+	}
+	clear_scratch(&s);
+}
+
+/**
+ * Times batches of scalar multiplications and key exchanges against the
+ * same work done one at a time, reporting the cost per operation
+ */
+static void bench_batch(const char *name, enum Curves curve,
+			const struct Curve *ec, long iters, gmp_randstate_t rs)
+{
+	enum { BATCH = 16 };
+	struct Point p[BATCH];
+	struct KeyPair *keys[BATCH], *peers[BATCH];
+	char *publics[BATCH], *secrets[BATCH];
+	size_t lens[BATCH];
+	mpz_t k[BATCH];
+	struct Scratch s;
+	struct Timer t;
+	long i;
+	int j;
+
+	init_scratch(&s);
+	for (j = 0; j < BATCH; j++) {
+		mpz_init(k[j]);
+		mpz_urandomb(k[j], rs, ec->key_size_bits);
+		init_point(&p[j]);
+		scalar_mult_base_into(&p[j], k[j], ec, &s);
+	}
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		for (j = 0; j < BATCH; j++)
+			scalar_mult_into(&p[j], &p[j], k[j], ec, &s);
+	report(name, "scalar_mult_into x16", t, iters * BATCH);
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		scalar_mult_batch_into(p, p, k, BATCH, ec, &s);
+	report(name, "scalar_mult_batch_into", t, iters * BATCH);
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		scalar_mult_base_batch_into(p, k, BATCH, ec, &s);
+	report(name, "scalar_mult_base_batch", t, iters * BATCH);
+
+	t = start();
+	for (i = 0; i < iters; i++) {
+		gen_key_pairs(keys, BATCH, curve);
+		gen_key_pairs(peers, BATCH, curve);
+		for (j = 0; j < BATCH; j++)
+			publics[j] = peers[j]->public;
+		get_secrets(secrets, lens, keys, publics, BATCH);
+		for (j = 0; j < BATCH; j++) {
+			free(secrets[j]);
+			free_key(keys[j]);
+			free_key(peers[j]);
+		}
+	}
+	report(name, "key_exchange (batch)", t, iters * BATCH);
+
+	for (j = 0; j < BATCH; j++) {
+		mpz_clear(k[j]);
+		clear_point(&p[j]);
+	}
+	clear_scratch(&s);
+}
+
+static void bench_curve(long iters)
+{
+	struct Timer t;
+	long i;
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		free_curve(get_secp192k1_curve());
+	report("secp192k1", "curve construction", t, iters);
+
+	t = start();
+	get_curve(SECP_192_K1);
+	report("all", "get_curve (first call)", t, 1);
+
+	t = start();
+	for (i = 0; i < iters; i++)
+		get_curve(SECP_192_K1);
+	report("all", "get_curve", t, iters);
+}
+
+int main(int argc, char *argv[])
+{
+	long iters = 1000;
+	gmp_randstate_t rs;
+
+	if (argc == 2)
+		iters = atol(argv[1]);
+	if (iters <= 0)
+		iters = 1000;
+
+	mp_get_memory_functions(&gmp_alloc, &gmp_realloc, NULL);
+	mp_set_memory_functions(counted_gmp_alloc, counted_gmp_realloc, NULL);
+
+	gmp_randinit_default(rs);
+	gmp_randseed_ui(rs, 1UL);
+
+	struct Curve *k1 = get_secp192k1_curve();
+	struct Curve *r1 = get_secp192r1_curve();
+
+	printf("Field elements of %d %d-bit limbs, backend %s\n", FIELD_LIMBS,
+		FIELD_LIMB_BITS, get_backend()->name);
+	bench_field("secp192k1", k1, 100 * iters, rs);
+	bench_field("secp192r1", r1, 100 * iters, rs);
+	bench_reduce("secp192k1", k1, 1000 * iters);
+	bench_reduce("secp192r1", r1, 1000 * iters);
+	bench_fe("secp192k1", k1, 1000 * iters, rs);
+	bench_fe("secp192r1", r1, 1000 * iters, rs);
+	bench_backends("secp192k1", k1, 1000 * iters, rs);
+	bench_backends("secp192r1", r1, 1000 * iters, rs);
+	bench_inv("secp192k1", k1, 10 * iters, rs);
+	bench_inv("secp192r1", r1, 10 * iters, rs);
+	bench_batch_inv("secp192k1", k1, 10 * iters, rs);
+	bench_batch_inv("secp192r1", r1, 10 * iters, rs);
+	bench_curve(iters / 100 + 1);
+	bench_point("secp192k1", SECP_192_K1, k1, iters / 100 + 1, rs);
+	bench_point("secp192r1", SECP_192_R1, r1, iters / 100 + 1, rs);
+	bench_lanes("secp192k1", get_curve(SECP_192_K1), iters, rs);
+	bench_lanes("secp192r1", get_curve(SECP_192_R1), iters, rs);
+	bench_batch("secp192k1", SECP_192_K1, get_curve(SECP_192_K1),
+			iters / 1000 + 1, rs);
+	bench_batch("secp192r1", SECP_192_R1, get_curve(SECP_192_R1),
+			iters / 1000 + 1, rs);
+	bench_alloc("secp192k1", SECP_192_K1, iters / 100 + 1, rs);
+	bench_alloc("secp192r1", SECP_192_R1, iters / 100 + 1, rs);
+	bench_cache("secp192k1", get_curve(SECP_192_K1), iters / 100 + 1, rs);
+	bench_cache("secp192r1", get_curve(SECP_192_R1), iters / 100 + 1, rs);
+
+	free_curve(k1);
+	free_curve(r1);
+	gmp_randclear(rs);
+	return 0;
+}
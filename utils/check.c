@@ -0,0 +1,472 @@
+/**
+ * Known-answer and negative tests of the key exchange
+ *
+ * The tests are built from the same sources as ``ecdh`` by including
+ * ecdh.c with its main function disabled, and exercise whichever backend
+ * get_backend picks. ``make check`` runs them once for every backend
+ * that ``check -l`` lists as compiled in and runnable on the CPU, forced
+ * with ECDH_BACKEND, and fails if another backend runs instead. It does
+ * so for the 64-bit and 32-bit limb builds, and once for the GMP-free
+ * build.
+ *
+ * For both curves, every vector gives two private keys, their public
+ * keys and the shared secret, as written by point_to_str. The vectors
+ * were computed independently of this code, with affine arithmetic on
+ * Python integers, and include the scalars 1, 2 and n - 1 and one above
+ * the order. They are checked through scalar_mult_base_into,
+ * scalar_mult_into, get_secret and the batched versions of each, whose
+ * batches are wide enough to fill the lanes of every multi-buffer engine.
+ *
+ * The negative tests pass malformed, oversized, non-canonical and
+ * off-curve peer keys to get_secret and get_secrets, which must reject
+ * each of them without affecting the other exchanges of a batch, and
+ * points with a co-ordinate outside the prime field to the point
+ * operations, which must return an error.
+ *
+ * Build and run with ``make check``.
+ */
+#define ECDH_NO_MAIN
+
+#include "../ecdh.c"
+
+/**
+ * Struct holding a known-answer vector, as hexadecimal strings
+ *
+ * a and b are the private keys, pub_a and pub_b the public keys and
+ * secret the secret shared by the two keys.
+ */
+struct Vector {
+	const char *a;
+	const char *b;
+	const char *pub_a;
+	const char *pub_b;
+	const char *secret;
+};
+
+static const struct Vector k1_vectors[] = {
+	{
+		"1",
+		"a9f7e03c83c9e5db8f89697fba6dd33e22266a0b",
+		"04db4ff10ec057e9ae26b07d0280b7f4341da5d1b1eae06c7d"
+			"9b2f2f6d9c5628a7844163d015be86344082aa88d95e2f9d",
+		"0401e20cb99a517fd626bbb249d8d2066e02502751cba96a04"
+			"36b48a27c86b18bda6e7107474c655559c328dbd347f6fd6",
+		"0401e20cb99a517fd626bbb249d8d2066e02502751cba96a04"
+			"36b48a27c86b18bda6e7107474c655559c328dbd347f6fd6"
+	},
+	{
+		"fffffffffffffffffffffffe26f2fc170f69466a74defd8c",
+		"2",
+		"04db4ff10ec057e9ae26b07d0280b7f4341da5d1b1eae06c7d"
+			"64d0d09263a9d7587bbe9c2fea4179cbbf7d557626a1be9a",
+		"04f091cf6331b1747684f5d2549cd1d4b3a8bed93b94f93cb6"
+			"fd7af42e1e7565a02e6268661c5e42e603da2d98a18f2ed5",
+		"04f091cf6331b1747684f5d2549cd1d4b3a8bed93b94f93cb6"
+			"02850bd1e18a9a5fd19d9799e3a1bd19fc25d2665e70bf62"
+	},
+	{
+		"71ad04cf4be4be018c39d2ee690383a8ae5b7a7d",
+		"36535ff7f41c2ed896256bbeb51f55bf1939b0172c97bfa5",
+		"0482f1914660a5225c09a6ee525bd0fa61c3d0bc23ae2c6dd8"
+			"e31b469de3a643e963aa75d6fdf6db618fb624edb3c19be6",
+		"048f34ebb9f26cf1900ea177f92ff6c7862dee857f9019032c"
+			"40799bfba9d962b31f75eed41405a59075dd09633bda6798",
+		"0430eab3fdbb0f61ea8b5316823b8ba5df007921a804d81bd9"
+			"b5f867c5f720ea8464016e0e8d9f0f37dde2078ad859e21d"
+	},
+	{
+		"ffffffffffffffffffffffffffffffffffffffffffffffff",
+		"2a9028a20d9604ae44e607c587b8d17b3b0b01d086bfc778",
+		"0406e517bbd479ac6ee25df3236a7c2285dbc2d534cb21d265"
+			"d551d4ee6dc45a97638a22a68509071260c44c55d54a35fa",
+		"044732a682e75829eb4a18d0709417db876348f56717ba5968"
+			"5c40fb2877c31f6a4db8dc1523553061e1a8079415a9c135",
+		"049231c45cd5f977cc9527c9b466710b9b39030b0080217bbd"
+			"1725f5a361aac78f84c7caae45180435cbc33524d3153b6d"
+	},
+};
+
+static const struct Vector r1_vectors[] = {
+	{
+		"1",
+		"a0ab26acfcc18536cfc647f1c34457d6ba0fc478",
+		"04188da80eb03090f67cbf20eb43a18800f4ff0afd82ff1012"
+			"07192b95ffc8da78631011ed6b24cdd573f977a11e794811",
+		"0492625c06ab9573818d17588653aa616320f194ca1aa74250"
+			"881c390ac8fe1884e3d048b2fe43f83d16cb3e95f48446b3",
+		"0492625c06ab9573818d17588653aa616320f194ca1aa74250"
+			"881c390ac8fe1884e3d048b2fe43f83d16cb3e95f48446b3"
+	},
+	{
+		"ffffffffffffffffffffffff99def836146bc9b1b4d22830",
+		"2",
+		"04188da80eb03090f67cbf20eb43a18800f4ff0afd82ff1012"
+			"f8e6d46a003725879cefee1294db32298c06885ee186b7ee",
+		"04dafebf5828783f2ad35534631588a3f629a70fb16982a888"
+			"dd6bda0d993da0fa46b27bbc141b868f59331afa5c7e93ab",
+		"04dafebf5828783f2ad35534631588a3f629a70fb16982a888"
+			"229425f266c25f05b94d8443ebe4796fa6cce505a3816c54"
+	},
+	{
+		"a7f5050da4a714d3a22116b9c3fd9d7fbea235b2",
+		"26819a59e4811b6abe89d0ff00d38174afd524fb0fbbc1b9",
+		"04254c21cac346af26257f7773c33a29399efdb61d9f2f13db"
+			"fe5b88ebd7c454d7af2d425c93f3d8123ae820d3b79778c7",
+		"04f0d53f96df46934b9ad73d895b29a2854b3fc64686f5ef72"
+			"93b717edf2a4e5137f71b00dee33443c4315558754768bba",
+		"04476fe12cddca40fb476e80f90fdc7ecc801afdc093d8727d"
+			"d48d55955b68dba8ffa1a8e7aa727fc41ed5751a97a8ae74"
+	},
+	{
+		"ffffffffffffffffffffffffffffffffffffffffffffffff",
+		"a43916b9aa13107968eaed9e903a586d5ba1bd9878db4c1e",
+		"04cc4af403e777b4a47284e6d41b3dc3cf857911353f213ecf"
+			"968e702164e1d23e468db706c30497a9125e875ef15d1810",
+		"04e22f283cf026bcd075533b4ec7e57e547dbfd7e78a323c75"
+			"a84888af3108fb77dbb645807de16bf08e615d7ad9029ac5",
+		"044972b065ba2e0ba0d0f87b780237193b0175ed264019b1fc"
+			"b5025917cf86e4feaeb5b698a8d9802fe0d4361bec7cd9ca"
+	},
+};
+
+/**
+ * Number of vectors of each curve
+ */
+#define VECTORS 4
+
+/**
+ * Number of exchanges in a batch, two for each vector and enough to
+ * fill all lanes of the widest engine at least once
+ */
+#define BATCH (4 * VECTORS)
+
+/**
+ * Largest peer key tried, in bytes
+ */
+#define PEER_MAX 4096
+
+static int failures;
+
+/**
+ * Records and reports a failed check
+ */
+static void check(int ok, const char *curve, const char *what, size_t i)
+{
+	if (ok)
+		return;
+	printf("%s: %s failed for case %zu\n", curve, what, i);
+	failures++;
+}
+
+static int point_equal(struct Point *p, struct Point *q)
+{
+	return mpz_cmp(p->x, q->x) == 0 && mpz_cmp(p->y, q->y) == 0;
+}
+
+/**
+ * Checks the scalar multiplications of a curve against its vectors
+ */
+static void check_scalar_mult(const char *name, const struct Curve *ec,
+				const struct Vector v[])
+{
+	struct Point pub[BATCH], peer[BATCH], secret[BATCH], r[BATCH];
+	mpz_t k[BATCH];
+	struct Scratch s;
+	struct Point *p;
+	size_t i;
+
+	init_scratch(&s);
+	// Lane i exchanges key a with b for even i, and b with a for odd i
+	for (i = 0; i < BATCH; i++) {
+		const struct Vector *w = &v[i / 2 % VECTORS];
+
+		str_to_scalar(k[i], i % 2 ? w->b : w->a);
+		init_point(&pub[i]);
+		init_point(&peer[i]);
+		init_point(&secret[i]);
+		init_point(&r[i]);
+		p = str_to_point(i % 2 ? w->pub_b : w->pub_a);
+		mpz_set(pub[i].x, p->x);
+		mpz_set(pub[i].y, p->y);
+		free_point(p);
+		p = str_to_point(i % 2 ? w->pub_a : w->pub_b);
+		mpz_set(peer[i].x, p->x);
+		mpz_set(peer[i].y, p->y);
+		free_point(p);
+		p = str_to_point(w->secret);
+		mpz_set(secret[i].x, p->x);
+		mpz_set(secret[i].y, p->y);
+		free_point(p);
+	}
+
+	for (i = 0; i < 2 * VECTORS; i++) {
+		scalar_mult_base_into(&r[i], k[i], ec, &s);
+		check(point_equal(&r[i], &pub[i]), name,
+			"scalar_mult_base_into", i / 2);
+		check(scalar_mult_into(&r[i], &peer[i], k[i], ec, &s) == 0
+			&& point_equal(&r[i], &secret[i]), name,
+			"scalar_mult_into", i / 2);
+	}
+
+	scalar_mult_base_batch_into(r, k, BATCH, ec, &s);
+	for (i = 0; i < BATCH; i++)
+		check(point_equal(&r[i], &pub[i]), name,
+			"scalar_mult_base_batch_into", i / 2 % VECTORS);
+	scalar_mult_batch_into(r, peer, k, BATCH, ec, &s);
+	for (i = 0; i < BATCH; i++)
+		check(point_equal(&r[i], &secret[i]), name,
+			"scalar_mult_batch_into", i / 2 % VECTORS);
+
+	for (i = 0; i < BATCH; i++) {
+		mpz_clear(k[i]);
+		clear_point(&pub[i]);
+		clear_point(&peer[i]);
+		clear_point(&secret[i]);
+		clear_point(&r[i]);
+	}
+	clear_scratch(&s);
+}
+
+/**
+ * Checks the exchanges of a curve against its vectors
+ */
+static void check_secrets(const char *name, enum Curves curve,
+				const struct Vector v[])
+{
+	struct KeyPair keys[BATCH], *key_ptrs[BATCH];
+	char *peers[BATCH], *secrets[BATCH];
+	size_t lens[BATCH];
+	char *secret;
+	size_t i, len;
+
+	for (i = 0; i < BATCH; i++) {
+		const struct Vector *w = &v[i / 2 % VECTORS];
+
+		str_to_scalar(keys[i].private, i % 2 ? w->b : w->a);
+		keys[i].public = NULL;
+		keys[i].ec = get_curve(curve);
+		key_ptrs[i] = &keys[i];
+		peers[i] = (char *)(i % 2 ? w->pub_a : w->pub_b);
+	}
+
+	for (i = 0; i < 2 * VECTORS; i++) {
+		secret = get_secret(&keys[i], peers[i], &len);
+		check(secret != NULL && len == strlen(v[i / 2].secret)
+			&& strcmp(secret, v[i / 2].secret) == 0, name,
+			"get_secret", i / 2);
+		free(secret);
+	}
+
+	get_secrets(secrets, lens, key_ptrs, peers, BATCH);
+	for (i = 0; i < BATCH; i++) {
+		const struct Vector *w = &v[i / 2 % VECTORS];
+
+		check(secrets[i] != NULL && lens[i] == strlen(w->secret)
+			&& strcmp(secrets[i], w->secret) == 0, name,
+			"get_secrets", i / 2 % VECTORS);
+		free(secrets[i]);
+		mpz_clear(keys[i].private);
+	}
+}
+
+/**
+ * Checks that the point operations reject points of a curve with a
+ * co-ordinate outside the prime field, built from the public key of its
+ * vectors: above the prime, or negative
+ */
+static void check_out_of_range(const char *name, const struct Curve *ec,
+				const struct Vector v[])
+{
+	struct Point *good = str_to_point(v[2].pub_b);
+	struct Point bad[4], r;
+	struct Scratch s;
+	mpz_t k;
+	size_t i;
+
+	init_scratch(&s);
+	init_point(&r);
+	str_to_scalar(k, v[2].a);
+	for (i = 0; i < 4; i++) {
+		init_point(&bad[i]);
+		mpz_set(bad[i].x, good->x);
+		mpz_set(bad[i].y, good->y);
+	}
+	mpz_add(bad[0].x, bad[0].x, ec->prime);
+	mpz_add(bad[1].y, bad[1].y, ec->prime);
+	mpz_neg(bad[2].y, bad[2].y);
+	mpz_setbit(bad[3].x, 2 * FIELD_BITS);
+
+	for (i = 0; i < 4; i++) {
+		struct Point *q;
+
+		mpz_set_ui(r.x, 1UL);
+		check(point_add_into(&r, &bad[i], good, ec) != 0
+			&& mpz_sgn(r.x) == 0 && mpz_sgn(r.y) == 0, name,
+			"point_add_into rejecting a co-ordinate", i);
+		check(point_add_into(&r, good, &bad[i], ec) != 0, name,
+			"point_add_into rejecting a co-ordinate", i);
+		mpz_set_ui(r.x, 1UL);
+		check(point_double_into(&r, &bad[i], ec) != 0
+			&& mpz_sgn(r.x) == 0 && mpz_sgn(r.y) == 0, name,
+			"point_double_into rejecting a co-ordinate", i);
+		mpz_set_ui(r.x, 1UL);
+		check(scalar_mult_into(&r, &bad[i], k, ec, &s) != 0
+			&& mpz_sgn(r.x) == 0 && mpz_sgn(r.y) == 0, name,
+			"scalar_mult_into rejecting a co-ordinate", i);
+
+		q = point_add(&bad[i], good, ec);
+		check(q == NULL, name, "point_add rejecting a co-ordinate", i);
+		if (q != NULL)
+			free_point(q);
+		q = point_double(&bad[i], ec);
+		check(q == NULL, name, "point_double rejecting a co-ordinate",
+			i);
+		if (q != NULL)
+			free_point(q);
+		q = scalar_mult(&bad[i], k, ec);
+		check(q == NULL, name, "scalar_mult rejecting a co-ordinate",
+			i);
+		if (q != NULL)
+			free_point(q);
+		clear_point(&bad[i]);
+	}
+	check(point_add_into(&r, good, good, ec) == 0
+		&& point_double_into(&r, good, ec) == 0, name,
+		"point operations on a valid point", 2);
+
+	mpz_clear(k);
+	clear_point(&r);
+	free_point(good);
+	clear_scratch(&s);
+}
+
+/**
+ * Writes the public key p of a curve to str with the coordinate at
+ * offset off raised by the prime, which is the same point in a
+ * non-canonical form
+ */
+static void noncanonical_key(char *str, const char *p, int off,
+				const struct Curve *ec)
+{
+	struct Point *q = str_to_point(p);
+	char *t;
+	size_t len;
+
+	mpz_add(off ? q->y : q->x, off ? q->y : q->x, ec->prime);
+	t = point_to_str(q, &len);
+	strcpy(str, t);
+	free(t);
+	free_point(q);
+}
+
+/**
+ * Checks that get_secret and get_secrets reject invalid peer keys of a
+ * curve, built from the public keys of its vectors
+ */
+static void check_invalid(const char *name, enum Curves curve,
+				const struct Vector v[])
+{
+	static const char *const bad[] = {
+		"", "0", "04", "040", "0400", "040000", "04zz", "0g04"
+	};
+	enum { FIXED = 8, INVALID = FIXED + 8 };
+	static char peers[INVALID][PEER_MAX];
+	char *batch[2 * INVALID], *secrets[2 * INVALID];
+	struct KeyPair key, *keys[2 * INVALID];
+	const char *pub = v[2].pub_b;
+	size_t lens[2 * INVALID];
+	size_t i, len, n = strlen(pub);
+	char *secret;
+
+	for (i = 0; i < FIXED; i++)
+		strcpy(peers[i], bad[i]);
+	// Another prefix, no prefix, and a wrong last digit of y
+	strcpy(peers[i], pub);
+	peers[i++][1] = '5';
+	strcpy(peers[i++], pub + 2);
+	strcpy(peers[i], pub);
+	peers[i++][n - 1] ^= 1;
+	// A digit that is not hexadecimal, and a negative y
+	strcpy(peers[i], pub);
+	peers[i++][n / 2] = 'x';
+	strcpy(peers[i], pub);
+	peers[i++][n / 2 + 1] = '-';
+	// Coordinates above the prime
+	noncanonical_key(peers[i++], pub, 0, get_curve(curve));
+	noncanonical_key(peers[i++], pub, 1, get_curve(curve));
+	memset(peers[i], '7', PEER_MAX - 1);
+	peers[i][0] = '0';
+	peers[i][1] = '4';
+	peers[i][PEER_MAX - 2] = '\0';
+
+	str_to_scalar(key.private, v[2].a);
+	key.public = NULL;
+	key.ec = get_curve(curve);
+	for (i = 0; i < INVALID; i++) {
+		secret = get_secret(&key, peers[i], &len);
+		check(secret == NULL, name, "rejecting an invalid key", i);
+		free(secret);
+	}
+
+	// Invalid keys between valid ones, which must still be exchanged
+	for (i = 0; i < 2 * INVALID; i++) {
+		keys[i] = &key;
+		batch[i] = i % 2 ? (char *)pub : peers[i / 2];
+	}
+	get_secrets(secrets, lens, keys, batch, 2 * INVALID);
+	for (i = 0; i < 2 * INVALID; i++) {
+		if (i % 2)
+			check(secrets[i] != NULL
+				&& strcmp(secrets[i], v[2].secret) == 0, name,
+				"get_secrets after an invalid key", i / 2);
+		else
+			check(secrets[i] == NULL && lens[i] == 0, name,
+				"get_secrets rejecting an invalid key", i / 2);
+		free(secrets[i]);
+	}
+	mpz_clear(key.private);
+}
+
+/**
+ * Prints the names of the backends of this build that the CPU can run,
+ * for the Makefile to pass as ECDH_BACKEND
+ */
+static void list_backends(void)
+{
+	size_t i;
+
+	for (i = 0; i < BACKENDS; i++) {
+		if (backends[i]->supported == NULL || backends[i]->supported())
+			printf("%s\n", backends[i]->name);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = getenv("ECDH_BACKEND");
+
+	if (argc > 1 && strcmp(argv[1], "-l") == 0) {
+		list_backends();
+		return 0;
+	}
+	// A forced backend must be the one that runs the checks
+	if (name != NULL && *name != '\0'
+	    && strcmp(name, get_backend()->name) != 0) {
+		printf("ECDH_BACKEND=%s runs on %s\n", name,
+			get_backend()->name);
+		failures++;
+	}
+
+	check_scalar_mult("secp192k1", get_curve(SECP_192_K1), k1_vectors);
+	check_scalar_mult("secp192r1", get_curve(SECP_192_R1), r1_vectors);
+	check_secrets("secp192k1", SECP_192_K1, k1_vectors);
+	check_secrets("secp192r1", SECP_192_R1, r1_vectors);
+	check_out_of_range("secp192k1", get_curve(SECP_192_K1), k1_vectors);
+	check_out_of_range("secp192r1", get_curve(SECP_192_R1), r1_vectors);
+	check_invalid("secp192k1", SECP_192_K1, k1_vectors);
+	check_invalid("secp192r1", SECP_192_R1, r1_vectors);
+
+	printf("%-10s %s\n", get_backend()->name,
+		failures ? "FAILED" : "passed");
+	return failures != 0;
+}
@@ -0,0 +1,193 @@
+/**
+ * Key exchange without GMP and without heap allocation
+ *
+ * The program is built from the same sources as ``ecdh`` by including
+ * ecdh.c with its main function disabled, with -DECDH_NO_GMP so that
+ * integers come from fixedmpz.h, and with -DFIXED_BASE_WINDOW=0 so that
+ * no table of G is allocated. The curves, points and scratch integers
+ * all live on the stack and use the in-place API, so nothing in the
+ * exchange calls malloc; the Makefile checks that malloc is not linked
+ * at all.
+ *
+ * For both curves it runs key exchanges between two random keys,
+ * checks that the shared secrets agree and prints the time per
+ * exchange. It also prints the peak stack used by one exchange,
+ * measured by filling the unused stack with a pattern beforehand and
+ * looking for the deepest byte that changed.
+ *
+ * Build with ``make ecdh-embedded`` and run ``./ecdh-embedded [iterations]``.
+ */
+#define _POSIX_C_SOURCE 200112L
+#define ECDH_NO_MAIN
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ecdh.c"
+
+#ifndef ECDH_NO_GMP
+#error "ecdh-embedded must be built with -DECDH_NO_GMP"
+#endif
+
+/**
+ * Bytes of stack below the caller filled with STACK_PATTERN
+ */
+#define STACK_PAINT (64 * 1024)
+#define STACK_PATTERN 0xa5
+
+static uintptr_t paint_bottom;
+
+/**
+ * Fills STACK_PAINT bytes of unused stack with STACK_PATTERN
+ */
+static void __attribute__((noinline)) paint_stack(void)
+{
+	volatile unsigned char area[STACK_PAINT];
+	size_t i;
+
+	for (i = 0; i < sizeof(area); i++)
+		area[i] = STACK_PATTERN;
+	paint_bottom = (uintptr_t)area;
+}
+
+/**
+ * Returns the number of bytes of stack below top that were written to
+ * since paint_stack
+ */
+static size_t __attribute__((noinline)) stack_used(const unsigned char *top)
+{
+	const volatile unsigned char *p = (unsigned char *)paint_bottom;
+
+	while (p < top && *p == STACK_PATTERN)
+		p++;
+	return top - (const unsigned char *)p;
+}
+
+/**
+ * Prints a formatted line to standard output without stdio buffers
+ */
+static void print(const char *fmt, ...)
+{
+	char line[128];
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+	if (n > 0 && write(STDOUT_FILENO, line, n) < 0)
+		_exit(1);
+}
+
+/**
+ * Fills k with a random scalar below the order of the curve
+ */
+static int random_scalar(mpz_t k, int fd, const struct Curve *ec)
+{
+	unsigned char buf[FIELD_BITS / 8];
+	size_t bytes = (ec->key_size_bits + 7) / 8;
+
+	if (read(fd, buf, bytes) != (ssize_t)bytes)
+		return -1;
+	mpz_import(k, bytes, 1, 1, 1, 0, buf);
+	mpz_mod(k, k, ec->order);
+	return 0;
+}
+
+/**
+ * Runs one key exchange, returning 0 if both sides get the same secret
+ */
+static int __attribute__((noinline)) exchange(const struct Curve *ec,
+						mpz_t ka, mpz_t kb)
+{
+	struct Point pa, pb, sa, sb;
+	struct Scratch s;
+	int ok;
+
+	init_point(&pa);
+	init_point(&pb);
+	init_point(&sa);
+	init_point(&sb);
+	init_scratch(&s);
+
+	scalar_mult_base_into(&pa, ka, ec, &s);
+	scalar_mult_base_into(&pb, kb, ec, &s);
+	scalar_mult_into(&sa, &pb, ka, ec, &s);
+	scalar_mult_into(&sb, &pa, kb, ec, &s);
+	ok = mpz_cmp(sa.x, sb.x) == 0 && mpz_cmp(sa.y, sb.y) == 0;
+
+	clear_scratch(&s);
+	clear_point(&pa);
+	clear_point(&pb);
+	clear_point(&sa);
+	clear_point(&sb);
+	return ok ? 0 : -1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run(const char *name, const struct Curve *ec, int fd, long iters)
+{
+	unsigned char *top = __builtin_frame_address(0);
+	mpz_t ka, kb;
+	size_t stack;
+	double t;
+	long i;
+
+	mpz_init(ka);
+	mpz_init(kb);
+	if (random_scalar(ka, fd, ec) < 0 || random_scalar(kb, fd, ec) < 0)
+		return -1;
+
+	paint_stack();
+	if (exchange(ec, ka, kb) < 0) {
+		print("%s: shared secrets differ\n", name);
+		return -1;
+	}
+	stack = stack_used(top);
+
+	t = now();
+	for (i = 0; i < iters; i++)
+		exchange(ec, ka, kb);
+	t = now() - t;
+
+	print("%-10s %10.0f ns/exchange %8.0f exchanges/s  stack %zu B\n",
+		name, t * 1e9 / iters, iters / t, stack);
+	mpz_clear(ka);
+	mpz_clear(kb);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long iters = argc > 1 ? atol(argv[1]) : 200;
+	struct Curve k1, r1;
+	int fd, status = 0;
+
+	if (iters <= 0)
+		iters = 1;
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0) {
+		print("Failed to open /dev/urandom\n");
+		return 1;
+	}
+
+	init_secp192k1_curve(&k1);
+	init_secp192r1_curve(&r1);
+	print("Curve struct %zu B, integer %zu B\n", sizeof(k1), sizeof(mpz_t));
+	if (run("secp192k1", &k1, fd, iters) < 0
+	    || run("secp192r1", &r1, fd, iters) < 0)
+		status = 1;
+	clear_curve(&k1);
+	clear_curve(&r1);
+	close(fd);
+	return status;
+}
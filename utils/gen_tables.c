@@ -0,0 +1,252 @@
+/**
+ * Generator for curve_tables.h
+ *
+ * The generator is built from the same sources as ``ecdh`` by including
+ * ecdh.c with its main function disabled. It sets up every curve at
+ * runtime, exactly as get_curve would, and prints the result as static
+ * const data: the curve parameters as read-only GMP integers, the field
+ * and Montgomery constants as limb arrays and the fixed-base tables of
+ * G as arrays of affine points. Building with -DCURVE_TABLES makes
+ * get_curve return these curves, so no curve setup runs at startup.
+ *
+ * The tables depend on FIELD_LIMB_BITS, FIELD_MONTGOMERY,
+ * FIXED_BASE_WINDOW and FIELD_DISPATCH, which are recorded in the output
+ * and checked when it is compiled. The Makefile rebuilds the generator
+ * with the same CFLAGS as ``ecdh``.
+ *
+ * Build with ``make build/curve_tables.h``.
+ */
+#define ECDH_NO_MAIN
+
+#include "../ecdh.c"
+
+/**
+ * Prints an array of limbs of the given width in bits as a
+ * brace-enclosed initializer
+ */
+static void print_words(const void *words, size_t n, int bits)
+{
+	unsigned long long w;
+	size_t i;
+
+	printf("{ ");
+	for (i = 0; i < n; i++) {
+		if (bits == 64)
+			w = ((const uint64_t *)words)[i];
+		else
+			w = ((const uint32_t *)words)[i];
+		printf("%s0x%0*llxULL", i ? ", " : "", bits / 4, w);
+	}
+	printf(" }");
+}
+
+/**
+ * Prints the limbs of a field element
+ */
+static void print_limbs(const limb_t *limbs, size_t n)
+{
+	print_words(limbs, n, FIELD_LIMB_BITS);
+}
+
+/**
+ * Prints the limbs of an integer as a static array named
+ * <prefix>_<name>, to be referenced by print_mpz
+ */
+static void print_mpz_limbs(const char *prefix, const char *name,
+				const mpz_t a)
+{
+	size_t n = mpz_size(a);
+
+	printf("static const mp_limb_t %s_%s[] = ", prefix, name);
+	if (n == 0) {
+		printf("{ 0 };\n");
+		return;
+	}
+	print_words(mpz_limbs_read(a), n, GMP_NUMB_BITS);
+	printf(";\n");
+}
+
+/**
+ * Prints a read-only GMP integer initializer for the limbs printed by
+ * print_mpz_limbs
+ */
+static void print_mpz(const char *prefix, const char *name, const mpz_t a)
+{
+	printf("MPZ_ROINIT_N((mp_limb_t *)%s_%s, %d)", prefix, name,
+		a->_mp_size);
+}
+
+#if FIELD_DISPATCH
+/**
+ * Prints the constants of a multi-buffer engine
+ */
+static void print_multibuf(const char *name, const struct MultiBufField *c)
+{
+	printf(",\n\t.%s = {\n\t\t.p = ", name);
+	print_words(c->p, MULTIBUF_MAX_LIMBS, 64);
+	printf(",\n\t\t.q = ");
+	print_words(c->q, MULTIBUF_MAX_LIMBS, 64);
+	printf(",\n\t\t.r2 = ");
+	print_words(c->r2, MULTIBUF_MAX_LIMBS, 64);
+	printf(",\n\t\t.one = ");
+	print_words(c->one, MULTIBUF_MAX_LIMBS, 64);
+	printf(",\n\t\t.a = ");
+	print_words(c->a, MULTIBUF_MAX_LIMBS, 64);
+	printf(",\n\t\t.b3 = ");
+	print_words(c->b3, MULTIBUF_MAX_LIMBS, 64);
+	printf(",\n\t\t.n0 = 0x%016llxULL,\n", (unsigned long long)c->n0);
+	printf("\t\t.a_zero = %d\n\t}", c->a_zero);
+}
+#endif
+
+/**
+ * Returns the name of the doubling formula of a curve
+ */
+static const char *double_point_name(const struct Curve *ec)
+{
+	if (ec->double_point == jacobian_double_a0)
+		return "jacobian_double_a0";
+	if (ec->double_point == jacobian_double_a3)
+		return "jacobian_double_a3";
+	return "jacobian_double_generic";
+}
+
+/**
+ * Returns the name of a field type
+ */
+static const char *field_type_name(enum Fields type)
+{
+	switch (type) {
+	case FIELD_P192K1:
+		return "FIELD_P192K1";
+	case FIELD_P192R1:
+		return "FIELD_P192R1";
+	case FIELD_GENERIC:
+	default:
+		return "FIELD_GENERIC";
+	}
+}
+
+/**
+ * Prints the static const definition of a curve named <prefix>_curve
+ */
+static void print_curve(const char *prefix, const struct Curve *ec)
+{
+	const struct Field *f = &ec->field;
+#if FIXED_BASE_WINDOW > 0
+	int i, n;
+#endif
+
+	printf("\n/* %s */\n", prefix);
+	print_mpz_limbs(prefix, "prime", ec->prime);
+	print_mpz_limbs(prefix, "a", ec->a);
+	print_mpz_limbs(prefix, "b", ec->b);
+	print_mpz_limbs(prefix, "gx", ec->G.x);
+	print_mpz_limbs(prefix, "gy", ec->G.y);
+	print_mpz_limbs(prefix, "order", ec->order);
+	print_mpz_limbs(prefix, "cofactor", ec->cofactor);
+	print_mpz_limbs(prefix, "glv_a1", ec->glv.a1);
+	print_mpz_limbs(prefix, "glv_b1", ec->glv.b1);
+	print_mpz_limbs(prefix, "glv_a2", ec->glv.a2);
+	print_mpz_limbs(prefix, "glv_b2", ec->glv.b2);
+
+#if FIXED_BASE_WINDOW > 0
+	n = ec->g_windows * FIXED_BASE_ENTRIES;
+	printf("\nstatic const struct AffinePoint %s_g_table[%d] = {\n",
+		prefix, n);
+	for (i = 0; i < n; i++) {
+		printf("\t{ ");
+		print_limbs(ec->g_table[i].x, FIELD_LIMBS);
+		printf(",\n\t  ");
+		print_limbs(ec->g_table[i].y, FIELD_LIMBS);
+		printf(", %d },\n", ec->g_table[i].infinity);
+	}
+	printf("};\n");
+#endif
+
+	printf("\nstatic const struct Curve %s_curve = {\n", prefix);
+	printf("\t.prime = ");
+	print_mpz(prefix, "prime", ec->prime);
+	printf(",\n\t.a = ");
+	print_mpz(prefix, "a", ec->a);
+	printf(",\n\t.b = ");
+	print_mpz(prefix, "b", ec->b);
+	printf(",\n\t.G = {\n\t\t");
+	print_mpz(prefix, "gx", ec->G.x);
+	printf(",\n\t\t");
+	print_mpz(prefix, "gy", ec->G.y);
+	printf("\n\t},\n\t.order = ");
+	print_mpz(prefix, "order", ec->order);
+	printf(",\n\t.cofactor = ");
+	print_mpz(prefix, "cofactor", ec->cofactor);
+	printf(",\n\t.key_size_bits = %u,\n", ec->key_size_bits);
+
+	printf("\t.field = {\n\t\t.prime = ");
+	print_limbs(f->prime, FIELD_LIMBS);
+	printf(",\n\t\t.one = ");
+	print_limbs(f->one, FIELD_LIMBS);
+	printf(",\n\t\t.r2 = ");
+	print_limbs(f->r2, FIELD_LIMBS);
+	printf(",\n\t\t.r3 = ");
+	print_limbs(f->r3, FIELD_LIMBS);
+	printf(",\n\t\t.n0 = 0x%016llxULL,\n", (unsigned long long)f->n0);
+	printf("\t\t.type = %s,\n", field_type_name(f->type));
+	printf("\t\t.montgomery = %d,\n", f->montgomery);
+	printf("\t\t.inversion = %s\n\t},\n",
+		f->inversion == INVERSION_FERMAT ? "INVERSION_FERMAT"
+						: "INVERSION_SAFEGCD");
+
+	printf("\t.fe_a = ");
+	print_limbs(ec->fe_a, FIELD_LIMBS);
+	printf(",\n\t.double_point = %s,\n", double_point_name(ec));
+
+	printf("\t.glv = {\n\t\t.enabled = %d,\n\t\t.beta = ", ec->glv.enabled);
+	print_limbs(ec->glv.beta, FIELD_LIMBS);
+	printf(",\n\t\t.a1 = ");
+	print_mpz(prefix, "glv_a1", ec->glv.a1);
+	printf(",\n\t\t.b1 = ");
+	print_mpz(prefix, "glv_b1", ec->glv.b1);
+	printf(",\n\t\t.a2 = ");
+	print_mpz(prefix, "glv_a2", ec->glv.a2);
+	printf(",\n\t\t.b2 = ");
+	print_mpz(prefix, "glv_b2", ec->glv.b2);
+	printf("\n\t},\n");
+
+	printf("\t.window = %d,\n", ec->window);
+	if (ec->g_table != NULL)
+		printf("\t.g_table = %s_g_table,\n", prefix);
+	else
+		printf("\t.g_table = NULL,\n");
+	printf("\t.g_windows = %d", ec->g_windows);
+#if FIELD_DISPATCH
+	print_multibuf("mb_x4", &ec->mb_x4);
+	print_multibuf("mb_x8", &ec->mb_x8);
+#endif
+	printf("\n};\n");
+}
+
+int main(void)
+{
+	struct Curve *k1 = get_secp192k1_curve();
+	struct Curve *r1 = get_secp192r1_curve();
+
+	printf("/* Generated by utils/gen_tables.c, do not edit */\n");
+	printf("#ifndef __curve_tables_header\n");
+	printf("#define __curve_tables_header\n\n");
+	printf("#if FIELD_LIMB_BITS != %d || FIELD_MONTGOMERY != %d "
+		"|| FIXED_BASE_WINDOW != %d || FIELD_DISPATCH != %d\n",
+		FIELD_LIMB_BITS, FIELD_MONTGOMERY, FIXED_BASE_WINDOW,
+		FIELD_DISPATCH);
+	printf("#error \"curve_tables.h was generated with other options, "
+		"run make clean\"\n");
+	printf("#endif\n");
+
+	print_curve("secp192k1", k1);
+	print_curve("secp192r1", r1);
+
+	printf("\n#endif\n");
+
+	free_curve(k1);
+	free_curve(r1);
+	return 0;
+}